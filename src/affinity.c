@@ -0,0 +1,173 @@
+// cpu_set_t and sched_setaffinity need this
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+#include "affinity.h"
+#include "log.h"
+
+// Thread placement. With -A the server pins its main thread to a set of
+// CPUs before starting any others, and every thread it creates (sessions,
+// disk I/O, logging, TLS pumps) inherits that set. With -N a session then
+// narrows itself to the NUMA node of the CPU that handled its socket's
+// receive queue (SO_INCOMING_CPU), so it runs, and its buffers live, on
+// the node the packets arrive on, normally the NIC's.
+//
+// Transfer buffers come from fresh pages faulted in by the thread that
+// uses them. Under the default local allocation policy a page is placed
+// on the node of the CPU that first touches it, so once a session is
+// pinned its buffers are on its node; a malloc'd buffer could instead be
+// recycled memory some thread on another node touched first.
+
+static int enabled = 0;
+static int follow_rx = 0;
+static cpu_set_t allowed;
+static int num_nodes = 0;
+static cpu_set_t node_cpus[AFFINITY_MAX_NODES];
+static int cpu_node[CPU_SETSIZE];
+
+// parse a CPU list like "0-7,16-23", the format of -A and of sysfs
+// return: 0 on success, -1 if malformed
+static int parse_cpulist(const char *list, cpu_set_t *set) {
+  CPU_ZERO(set);
+  const char *p = list;
+  while (*p && *p != '\n') {
+    char *end;
+    long lo = strtol(p, &end, 10);
+    long hi = lo;
+    if (end == p) {
+      return -1;
+    }
+    if (*end == '-') {
+      p = end + 1;
+      hi = strtol(p, &end, 10);
+      if (end == p) {
+        return -1;
+      }
+    }
+    if (lo < 0 || hi < lo || hi >= CPU_SETSIZE) {
+      return -1;
+    }
+    for (long cpu = lo; cpu <= hi; cpu++) {
+      CPU_SET(cpu, set);
+    }
+    p = end;
+    if (*p == ',') {
+      p++;
+    } else if (*p && *p != '\n') {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// learn which CPUs are on which NUMA node; without sysfs everything is
+// node 0
+static void read_nodes(void) {
+  for (int node = 0; node < AFFINITY_MAX_NODES; node++) {
+    char path[64];
+    char line[4096];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+      continue;
+    }
+    int ok = fgets(line, sizeof(line), f) != NULL &&
+        parse_cpulist(line, &node_cpus[node]) == 0;
+    fclose(f);
+    if (!ok) {
+      continue;
+    }
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if (CPU_ISSET(cpu, &node_cpus[node])) {
+        cpu_node[cpu] = node;
+      }
+    }
+    num_nodes = node + 1;
+  }
+}
+
+// set up thread placement, call from main before starting any threads
+// return: 0 on success, -1 on error
+// cpus: CPU list for all of the server's threads, NULL to leave them be
+// follow: move each session to the NUMA node its packets arrive on
+int affinity_init(char *cpus, int follow) {
+  if (cpus == NULL && !follow) {
+    return 0;
+  }
+  if (cpus) {
+    if (parse_cpulist(cpus, &allowed) || CPU_COUNT(&allowed) == 0) {
+      fprintf(stderr, "Bad CPU list: %s\n", cpus);
+      return -1;
+    }
+    if (sched_setaffinity(0, sizeof(allowed), &allowed)) {
+      fprintf(stderr, "sched_setaffinity: %s\n", strerror(errno));
+      return -1;
+    }
+  } else if (sched_getaffinity(0, sizeof(allowed), &allowed)) {
+    fprintf(stderr, "sched_getaffinity: %s\n", strerror(errno));
+    return -1;
+  }
+  read_nodes();
+  enabled = 1;
+  follow_rx = follow;
+  return 0;
+}
+
+// pin the calling session thread to the allowed CPUs on the NUMA node that
+// handles its connection's receive queue, when following is on
+// connfd: the session's TCP socket
+void affinity_place(int connfd) {
+  if (!follow_rx || num_nodes < 2) {
+    return;
+  }
+  int cpu;
+  socklen_t len = sizeof(cpu);
+  if (getsockopt(connfd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) ||
+      cpu < 0 || cpu >= CPU_SETSIZE) {
+    return;
+  }
+  int node = cpu_node[cpu];
+  cpu_set_t set;
+  CPU_AND(&set, &allowed, &node_cpus[node]);
+  if (CPU_COUNT(&set) == 0) {
+    // none of that node's CPUs are ours, stay anywhere allowed
+    return;
+  }
+  int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+  if (err) {
+    log_msg(LOG_WARN, "pthread_setaffinity_np: %s", strerror(err));
+    return;
+  }
+  log_msg(LOG_DEBUG, "Packets arrive on CPU %d, session moved to node %d.", cpu, node);
+}
+
+// get a transfer buffer on the calling thread's NUMA node
+// return: the buffer, NULL on error
+// size: bytes
+void *affinity_alloc(size_t size) {
+  if (!enabled) {
+    return malloc(size);
+  }
+  // faulted in here, by the thread that will use it
+  void *buf = mmap(NULL, size, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+  return buf == MAP_FAILED ? NULL : buf;
+}
+
+// free a buffer from affinity_alloc
+// size: as passed to affinity_alloc
+void affinity_free(void *buf, size_t size) {
+  if (!enabled) {
+    free(buf);
+  } else if (buf) {
+    munmap(buf, size);
+  }
+}
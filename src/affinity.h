@@ -0,0 +1,14 @@
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+#include <stddef.h>
+
+// most NUMA nodes told apart; CPUs on higher ones count as node 0
+#define AFFINITY_MAX_NODES 64
+
+int affinity_init(char *cpus, int follow);
+void affinity_place(int connfd);
+void *affinity_alloc(size_t size);
+void affinity_free(void *buf, size_t size);
+
+#endif
@@ -0,0 +1,803 @@
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "archive.h"
+#include "common.h"
+
+// Directory transfers as one stream of records. The sender walks the tree
+// first, then a few threads open and read small files ahead of the socket
+// while the calling thread sends them in order, so a directory of small
+// files costs one round trip and runs at disk or network speed instead of
+// one request per file. The receiver mirrors this: the calling thread reads
+// records and creates directories, and the I/O threads create, write and
+// timestamp the small files. Directory mtimes are set last, since writing
+// their contents changes them.
+
+// buffer for streaming large files, two of them so one can be read into
+// while the kernel still sends from the other
+#define ARCHIVE_CHUNK 65536
+
+enum entry_state { ENTRY_PENDING, ENTRY_READY, ENTRY_FAILED };
+
+struct archive_entry {
+  char *path;          // relative to the root
+  int disk;            // which of io->roots it's in, if spread
+  int is_dir;
+  uint64_t size;
+  struct timespec mtime;
+  mode_t mode;
+  char *data;          // contents of a small file once read
+  uint32_t zc_mark;    // zerocopy sends that read data, see zc_wait
+  enum entry_state state;
+};
+
+struct entry_list {
+  struct archive_entry *entries;
+  size_t count;
+  size_t cap;
+};
+
+// shared between the sending thread and its readers
+struct send_state {
+  struct archive_io *io;
+  char *root;
+  struct entry_list *list;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  size_t next;         // next entry for a reader to take
+  size_t sent;         // entries the sender is done with
+  int stop;
+  // the sender's socket; file data is sent without copying it into the
+  // kernel, so buffers are freed or reused only once it has gone
+  struct zc_sock zc;
+  uint32_t chunk_mark[2]; // sends reading from each streaming buffer
+  size_t released;        // entries before this have had their data freed
+};
+
+// a small file waiting to be written
+struct write_job {
+  char *path;          // full path
+  char *data;
+  uint64_t size;
+  struct timespec mtime;
+  mode_t mode;
+};
+
+// shared between the receiving thread and its writers
+struct recv_state {
+  struct archive_io *io;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  struct write_job queue[ARCHIVE_AHEAD];
+  int head;
+  int count;
+  int busy;            // jobs taken but not finished
+  int stop;
+  int failed;
+};
+
+// report an error through io->log
+static void report(struct archive_io *io, const char *fmt, ...)
+  __attribute__((format(printf, 2, 3)));
+static void report(struct archive_io *io, const char *fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  io->log(fmt, args);
+  va_end(args);
+}
+
+// the path of rel inside the tree, in one of io->roots if it's spread
+// return: 0 on success, -1 if it's too long
+// disk: which of io->roots
+// root: the tree
+// rel: path below root, "" for root itself
+static int tree_path(struct archive_io *io, int disk, char *root, char *rel, char *full) {
+  int n = io->num_roots ?
+      snprintf(full, PATH_MAX, "%s/%s%s%s", io->roots[disk], root, *rel ? "/" : "", rel) :
+      snprintf(full, PATH_MAX, "%s%s%s", root, *rel ? "/" : "", rel);
+  return n < PATH_MAX ? 0 : -1;
+}
+
+// which of io->roots a file of the tree belongs in
+// return: its index, 0 if the tree isn't spread
+static int tree_place(struct archive_io *io, char *root, char *rel) {
+  if (io->num_roots == 0) {
+    return 0;
+  }
+  char name[PATH_MAX];
+  snprintf(name, sizeof(name), "%s/%s", root, rel);
+  return io->place(name);
+}
+
+static int list_add(struct entry_list *list, char *path, struct stat *st) {
+  if (list->count == list->cap) {
+    size_t cap = list->cap ? list->cap * 2 : 256;
+    struct archive_entry *bigger = realloc(list->entries, cap * sizeof(*bigger));
+    if (bigger == NULL) {
+      return -1;
+    }
+    list->entries = bigger;
+    list->cap = cap;
+  }
+  struct archive_entry *e = &list->entries[list->count];
+  memset(e, 0, sizeof(*e));
+  e->path = strdup(path);
+  if (e->path == NULL) {
+    return -1;
+  }
+  e->is_dir = S_ISDIR(st->st_mode);
+  e->size = e->is_dir ? 0 : (uint64_t) st->st_size;
+  e->mtime = st->st_mtim;
+  e->mode = st->st_mode & 07777;
+  list->count++;
+  return 0;
+}
+
+// list a directory tree, parents before their contents
+// return: 0 on success, -1 if out of memory
+// disk: which of io->roots to look in, if the tree is spread
+// root: the directory being sent
+// rel: path below root, "" for root itself
+// failed: counts entries that couldn't be listed
+static int walk(struct entry_list *list, struct archive_io *io, int disk, char *root,
+    char *rel, int *failed) {
+  char full[PATH_MAX];
+  tree_path(io, disk, root, rel, full);
+  DIR *dir = opendir(full);
+  if (!dir) {
+    // a spread tree needn't have every directory in every root
+    if (errno != ENOENT || io->num_roots == 0) {
+      report(io, "opendir %s: %s", full, strerror(errno));
+      (*failed)++;
+    }
+    return 0;
+  }
+  int err = 0;
+  struct dirent *ent;
+  while (err == 0 && (ent = readdir(dir)) != NULL) {
+    if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
+      continue;
+    }
+    char child[PATH_MAX];
+    char child_full[PATH_MAX];
+    if ((size_t) snprintf(child, sizeof(child), "%s%s%s", rel, *rel ? "/" : "",
+          ent->d_name) >= sizeof(child) ||
+        tree_path(io, disk, root, child, child_full)) {
+      report(io, "Path too long: %s/%s", full, ent->d_name);
+      (*failed)++;
+      continue;
+    }
+    struct stat st;
+    if (lstat(child_full, &st)) {
+      report(io, "lstat %s: %s", child_full, strerror(errno));
+      (*failed)++;
+      continue;
+    }
+    // only regular files and directories; links and devices are skipped.
+    // In a spread tree a file is sent from the root it belongs in, and a
+    // directory from the first root that has it.
+    if (S_ISREG(st.st_mode)) {
+      if (tree_place(io, root, child) == disk) {
+        err = list_add(list, child, &st);
+        if (err == 0) {
+          list->entries[list->count - 1].disk = disk;
+        }
+      }
+    } else if (S_ISDIR(st.st_mode)) {
+      int seen = 0;
+      for (int i = 0; i < disk && !seen; i++) {
+        struct stat other;
+        seen = tree_path(io, i, root, child, child_full) == 0 && stat(child_full, &other) == 0;
+      }
+      if (!seen) {
+        err = list_add(list, child, &st);
+      }
+      if (err == 0) {
+        err = walk(list, io, disk, root, child, failed);
+      }
+    }
+  }
+  closedir(dir);
+  return err;
+}
+
+// read a whole small file
+// return: 0 if it had exactly size bytes, -1 otherwise
+static int read_file(struct archive_io *io, char *path, uint64_t size, char **data) {
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    report(io, "open %s: %s", path, strerror(errno));
+    return -1;
+  }
+  *data = malloc(size ? size : 1);
+  if (*data == NULL) {
+    close(fd);
+    return -1;
+  }
+  uint64_t got = 0;
+  while (got < size) {
+    ssize_t n = read(fd, *data + got, size - got);
+    if (n <= 0) {
+      if (n == -1 && errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+    got += n;
+  }
+  close(fd);
+  if (got != size) {
+    report(io, "%s changed size while being sent", path);
+    free(*data);
+    *data = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+// read small files ahead of the sender
+static void *reader(void *arg) {
+  struct send_state *st = arg;
+  pthread_mutex_lock(&st->lock);
+  for (;;) {
+    while (!st->stop && st->next < st->list->count && st->next >= st->sent + ARCHIVE_AHEAD) {
+      pthread_cond_wait(&st->cond, &st->lock);
+    }
+    if (st->stop || st->next >= st->list->count) {
+      break;
+    }
+    struct archive_entry *e = &st->list->entries[st->next++];
+    if (e->is_dir || e->size > ARCHIVE_INLINE_MAX) {
+      // nothing to read ahead, the sender handles it
+      e->state = ENTRY_READY;
+      pthread_cond_broadcast(&st->cond);
+      continue;
+    }
+    pthread_mutex_unlock(&st->lock);
+
+    char full[PATH_MAX];
+    tree_path(st->io, e->disk, st->root, e->path, full);
+    char *data = NULL;
+    int err = read_file(st->io, full, e->size, &data);
+
+    pthread_mutex_lock(&st->lock);
+    e->data = data;
+    e->state = err ? ENTRY_FAILED : ENTRY_READY;
+    pthread_cond_broadcast(&st->cond);
+  }
+  pthread_mutex_unlock(&st->lock);
+  return NULL;
+}
+
+// send a record header and its path
+// return: 0 on success, -1 on error
+static int send_record(struct archive_io *io, uint32_t type, char *path, uint64_t size,
+    struct timespec *mtime, mode_t mode) {
+  char buf[sizeof(struct archive_record) + PATH_MAX];
+  size_t path_len = strlen(path);
+  struct archive_record rec = {0};
+  rec.type = htonl(type);
+  rec.path_len = htonl(path_len);
+  rec.mode = htonl(mode);
+  rec.size = htobe64(size);
+  if (mtime) {
+    rec.mtime_sec = htobe64(mtime->tv_sec);
+    rec.mtime_nsec = htonl(mtime->tv_nsec);
+  }
+  memcpy(buf, &rec, sizeof(rec));
+  memcpy(buf + sizeof(rec), path, path_len);
+  if (send_all(io->sockfd, buf, sizeof(rec) + path_len) == -1) {
+    return -1;
+  }
+  return 0;
+}
+
+// send file data, letting the pace hook slow it down
+// return: 0 on success, -1 on error
+static int send_data(struct archive_io *io, struct zc_sock *zc, char *data, size_t len) {
+  if (io->pace && io->pace(io->pace_arg, len)) {
+    return -1;
+  }
+  if (len && send_all_zc(zc, data, len) == -1) {
+    return -1;
+  }
+  io->bytes += len;
+  return 0;
+}
+
+// stream a large file from disk
+// return: 0 on success, 1 if the file went bad after its header was sent
+//         (the stream is still in step), 2 if it couldn't be opened and was
+//         skipped, -1 on a connection error
+static int send_big(struct send_state *st, struct archive_entry *e) {
+  struct archive_io *io = st->io;
+  char full[PATH_MAX];
+  tree_path(io, e->disk, st->root, e->path, full);
+  int fd = open(full, O_RDONLY);
+  if (fd == -1) {
+    report(st->io, "open %s: %s", full, strerror(errno));
+    return 2;
+  }
+  if (send_record(io, REC_FILE, e->path, e->size, &e->mtime, e->mode)) {
+    close(fd);
+    return -1;
+  }
+
+  static __thread char bufs[2][ARCHIVE_CHUNK];
+  int cur = 0;
+  uint64_t left = e->size;
+  int bad = 0;
+  while (left > 0) {
+    char *buf = bufs[cur];
+    if (zc_wait(&st->zc, st->chunk_mark[cur])) {
+      report(st->io, "send: %s", strerror(errno));
+      close(fd);
+      return -1;
+    }
+    size_t len = left < ARCHIVE_CHUNK ? left : ARCHIVE_CHUNK;
+    ssize_t n = bad ? 0 : read(fd, buf, len);
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      // the size was announced, so pad it out and mark the file bad after
+      if (!bad) {
+        report(st->io, "%s changed size while being sent", full);
+      }
+      bad = 1;
+      memset(buf, 0, len);
+      n = len;
+    }
+    if (send_data(io, &st->zc, buf, n)) {
+      close(fd);
+      return -1;
+    }
+    st->chunk_mark[cur] = st->zc.next;
+    cur = !cur;
+    left -= n;
+  }
+  close(fd);
+  return bad;
+}
+
+// free small files' data once the kernel has sent it
+// return: 0 on success, -1 if waiting for the kernel failed
+// sent: entries before this have been sent
+// keep: most sent entries to leave holding data; older ones are waited for
+static int release_data(struct send_state *st, size_t sent, size_t keep) {
+  while (st->released < sent) {
+    struct archive_entry *e = &st->list->entries[st->released];
+    if (sent - st->released > keep) {
+      if (zc_wait(&st->zc, e->zc_mark)) {
+        report(st->io, "send: %s", strerror(errno));
+        return -1;
+      }
+    } else if ((int32_t) (e->zc_mark - st->zc.done) > 0) {
+      break;
+    }
+    free(e->data);
+    e->data = NULL;
+    st->released++;
+  }
+  return 0;
+}
+
+// send a directory tree as an archive stream
+// return: 0 if the whole stream was sent (files that couldn't be read are
+//         counted in io->failed), -1 on a connection or memory error
+// root: the directory to send
+int archive_send(struct archive_io *io, char *root) {
+  struct entry_list list = {0};
+  int err = 0;
+  for (int disk = 0; err == 0 && disk < (io->num_roots ? io->num_roots : 1); disk++) {
+    err = walk(&list, io, disk, root, "", &io->failed);
+  }
+  if (err) {
+    report(io, "Out of memory.");
+  }
+
+  struct send_state st = {0};
+  st.io = io;
+  st.root = root;
+  st.list = &list;
+  zc_init(&st.zc, io->sockfd);
+  pthread_mutex_init(&st.lock, NULL);
+  pthread_cond_init(&st.cond, NULL);
+  pthread_t threads[ARCHIVE_THREADS];
+  int started = 0;
+  for (; err == 0 && started < ARCHIVE_THREADS; started++) {
+    if (pthread_create(&threads[started], NULL, reader, &st)) {
+      break;
+    }
+  }
+  if (started == 0) {
+    err = -1;
+  }
+
+  for (size_t i = 0; err == 0 && i < list.count; i++) {
+    struct archive_entry *e = &list.entries[i];
+    pthread_mutex_lock(&st.lock);
+    while (e->state == ENTRY_PENDING) {
+      pthread_cond_wait(&st.cond, &st.lock);
+    }
+    pthread_mutex_unlock(&st.lock);
+
+    if (e->is_dir) {
+      err = send_record(io, REC_DIR, e->path, 0, &e->mtime, e->mode);
+    } else if (e->state == ENTRY_FAILED) {
+      io->failed++;
+    } else if (e->size > ARCHIVE_INLINE_MAX) {
+      int res = send_big(&st, e);
+      if (res == 1) {
+        io->failed++;
+        err = send_record(io, REC_BAD, e->path, 0, NULL, 0);
+      } else if (res == 2) {
+        io->failed++;
+      } else {
+        err = res;
+        io->files++;
+      }
+    } else {
+      err = send_record(io, REC_FILE, e->path, e->size, &e->mtime, e->mode);
+      if (err == 0) {
+        err = send_data(io, &st.zc, e->data, e->size);
+      }
+      io->files++;
+    }
+    e->zc_mark = st.zc.next;
+    if (err == 0) {
+      err = release_data(&st, i + 1, ARCHIVE_AHEAD);
+    }
+
+    pthread_mutex_lock(&st.lock);
+    st.sent = i + 1;
+    pthread_cond_broadcast(&st.cond);
+    pthread_mutex_unlock(&st.lock);
+  }
+  if (err == 0) {
+    err = send_record(io, REC_END, "", io->files, NULL, 0);
+  }
+  if (err == 0) {
+    // the streaming buffers are reused by the next transfer
+    err = release_data(&st, list.count, 0);
+  }
+  if (err == 0 && zc_wait(&st.zc, st.zc.next)) {
+    report(io, "send: %s", strerror(errno));
+    err = -1;
+  }
+
+  pthread_mutex_lock(&st.lock);
+  st.stop = 1;
+  pthread_cond_broadcast(&st.cond);
+  pthread_mutex_unlock(&st.lock);
+  for (int i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  for (size_t i = 0; i < list.count; i++) {
+    free(list.entries[i].data);
+    free(list.entries[i].path);
+  }
+  free(list.entries);
+  pthread_mutex_destroy(&st.lock);
+  pthread_cond_destroy(&st.cond);
+  return err;
+}
+
+// accept only plain relative paths, nothing that climbs out of the root
+// return: 1 if path is safe, 0 if not
+int archive_safe_path(char *path) {
+  if (path[0] == '\0' || path[0] == '/') {
+    return 0;
+  }
+  for (char *p = path; p; ) {
+    char *slash = strchr(p, '/');
+    size_t len = slash ? (size_t) (slash - p) : strlen(p);
+    if (len == 0 || (len == 1 && p[0] == '.') || (len == 2 && p[0] == '.' && p[1] == '.')) {
+      return 0;
+    }
+    p = slash ? slash + 1 : NULL;
+  }
+  return 1;
+}
+
+// create a file with the given contents and mtime
+// return: 0 on success, -1 on error
+static int write_file(struct archive_io *io, struct write_job *job) {
+  int fd = open(job->path, O_WRONLY | O_CREAT | O_TRUNC, job->mode ? job->mode : 0644);
+  if (fd == -1) {
+    report(io, "open %s: %s", job->path, strerror(errno));
+    return -1;
+  }
+  uint64_t done = 0;
+  while (done < job->size) {
+    ssize_t n = write(fd, job->data + done, job->size - done);
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      report(io, "write %s: %s", job->path, strerror(errno));
+      close(fd);
+      return -1;
+    }
+    done += n;
+  }
+  struct timespec times[2] = { { 0, UTIME_OMIT }, job->mtime };
+  futimens(fd, times);
+  if (close(fd)) {
+    report(io, "close %s: %s", job->path, strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+// write small files behind the receiver
+static void *writer(void *arg) {
+  struct recv_state *st = arg;
+  pthread_mutex_lock(&st->lock);
+  for (;;) {
+    while (!st->stop && st->count == 0) {
+      pthread_cond_wait(&st->cond, &st->lock);
+    }
+    if (st->count == 0) {
+      break;
+    }
+    struct write_job job = st->queue[st->head];
+    st->head = (st->head + 1) % ARCHIVE_AHEAD;
+    st->count--;
+    st->busy++;
+    pthread_cond_broadcast(&st->cond);
+    pthread_mutex_unlock(&st->lock);
+
+    int err = write_file(st->io, &job);
+    free(job.path);
+    free(job.data);
+
+    pthread_mutex_lock(&st->lock);
+    st->busy--;
+    if (err) {
+      st->failed++;
+    }
+    pthread_cond_broadcast(&st->cond);
+  }
+  pthread_mutex_unlock(&st->lock);
+  return NULL;
+}
+
+// wait until every queued file has been written
+static void drain(struct recv_state *st) {
+  pthread_mutex_lock(&st->lock);
+  while (st->count > 0 || st->busy > 0) {
+    pthread_cond_wait(&st->cond, &st->lock);
+  }
+  pthread_mutex_unlock(&st->lock);
+}
+
+// receive file data, letting the pace hook slow it down
+// return: 0 on success, -1 on error
+static int recv_data(struct archive_io *io, char *buf, size_t len) {
+  if (len && recv(io->sockfd, buf, len, MSG_WAITALL) != (ssize_t) len) {
+    report(io, "Connection closed during archive.");
+    return -1;
+  }
+  io->bytes += len;
+  if (io->pace && io->pace(io->pace_arg, len)) {
+    return -1;
+  }
+  return 0;
+}
+
+// stream a large file to disk
+// return: 0 on success, 1 if the file couldn't be written (the stream is
+//         still in step), -1 on a connection error
+static int recv_big(struct archive_io *io, char *full, struct archive_record *rec) {
+  int fd = open(full, O_WRONLY | O_CREAT | O_TRUNC, rec->mode ? rec->mode : 0644);
+  if (fd == -1) {
+    report(io, "open %s: %s", full, strerror(errno));
+  }
+  static __thread char buf[ARCHIVE_CHUNK];
+  uint64_t left = rec->size;
+  int bad = fd == -1;
+  while (left > 0) {
+    size_t len = left < sizeof(buf) ? left : sizeof(buf);
+    if (recv_data(io, buf, len)) {
+      if (fd != -1) {
+        close(fd);
+      }
+      return -1;
+    }
+    // keep reading even after a write error so the stream stays in step
+    size_t done = 0;
+    while (!bad && done < len) {
+      ssize_t n = write(fd, buf + done, len - done);
+      if (n == -1 && errno != EINTR) {
+        report(io, "write %s: %s", full, strerror(errno));
+        bad = 1;
+      } else if (n > 0) {
+        done += n;
+      }
+    }
+    left -= len;
+  }
+  if (fd != -1) {
+    struct timespec times[2] = { { 0, UTIME_OMIT }, { rec->mtime_sec, rec->mtime_nsec } };
+    futimens(fd, times);
+    if (close(fd)) {
+      report(io, "close %s: %s", full, strerror(errno));
+      bad = 1;
+    }
+  }
+  return bad;
+}
+
+// receive an archive stream into a directory
+// return: 0 if the whole stream was read (files that couldn't be written are
+//         counted in io->failed), -1 on a connection or protocol error
+// root: the directory to create the tree in, made if it doesn't exist
+int archive_recv(struct archive_io *io, char *root) {
+  int disks = io->num_roots ? io->num_roots : 1;
+  for (int disk = 0; disk < disks; disk++) {
+    char full[PATH_MAX];
+    if (tree_path(io, disk, root, "", full) || (mkdir(full, 0755) && errno != EEXIST)) {
+      report(io, "mkdir %s: %s", full, strerror(errno));
+      return -1;
+    }
+  }
+
+  struct recv_state st = {0};
+  st.io = io;
+  pthread_mutex_init(&st.lock, NULL);
+  pthread_cond_init(&st.cond, NULL);
+  pthread_t threads[ARCHIVE_THREADS];
+  int started = 0;
+  for (; started < ARCHIVE_THREADS; started++) {
+    if (pthread_create(&threads[started], NULL, writer, &st)) {
+      break;
+    }
+  }
+
+  // directory mtimes, applied once everything inside is written
+  struct entry_list dirs = {0};
+  struct entry_list bad = {0};
+  int err = 0;
+  for (;;) {
+    struct archive_record rec;
+    if (recv(io->sockfd, &rec, sizeof(rec), MSG_WAITALL) != sizeof(rec)) {
+      report(io, "Connection closed during archive.");
+      err = -1;
+      break;
+    }
+    rec.type = ntohl(rec.type);
+    rec.path_len = ntohl(rec.path_len);
+    rec.mode = ntohl(rec.mode) & 0777;
+    rec.mtime_nsec = ntohl(rec.mtime_nsec);
+    rec.size = be64toh(rec.size);
+    rec.mtime_sec = be64toh(rec.mtime_sec);
+    if (rec.type == REC_END) {
+      break;
+    }
+
+    char path[PATH_MAX];
+    char full[PATH_MAX];
+    if (rec.path_len == 0 || rec.path_len >= sizeof(path) ||
+        recv(io->sockfd, path, rec.path_len, MSG_WAITALL) != (ssize_t) rec.path_len) {
+      report(io, "Bad archive record.");
+      err = -1;
+      break;
+    }
+    path[rec.path_len] = '\0';
+    if (!archive_safe_path(path) || tree_path(io, tree_place(io, root, path), root, path, full)) {
+      report(io, "Refusing archive path %s", path);
+      err = -1;
+      break;
+    }
+
+    struct stat st_rec = {0};
+    st_rec.st_mtim.tv_sec = rec.mtime_sec;
+    st_rec.st_mtim.tv_nsec = rec.mtime_nsec;
+    st_rec.st_mode = rec.mode;
+    if (rec.type == REC_DIR) {
+      // a spread tree has every directory in every root, so any file
+      // under it has somewhere to go
+      st_rec.st_mode |= S_IFDIR;
+      for (int disk = 0; err == 0 && disk < disks; disk++) {
+        tree_path(io, disk, root, path, full);
+        if (mkdir(full, rec.mode | 0700) && errno != EEXIST) {
+          report(io, "mkdir %s: %s", full, strerror(errno));
+          io->failed++;
+        }
+        err = list_add(&dirs, full, &st_rec);
+      }
+      if (err) {
+        break;
+      }
+    } else if (rec.type == REC_BAD) {
+      st_rec.st_mode |= S_IFREG;
+      if (list_add(&bad, full, &st_rec)) {
+        err = -1;
+        break;
+      }
+    } else if (rec.type == REC_FILE && (rec.size > ARCHIVE_INLINE_MAX || started == 0)) {
+      int res = recv_big(io, full, &rec);
+      if (res == -1) {
+        err = -1;
+        break;
+      }
+      io->failed += res;
+      io->files++;
+    } else if (rec.type == REC_FILE) {
+      struct write_job job = { strdup(full), malloc(rec.size ? rec.size : 1), rec.size,
+        { rec.mtime_sec, rec.mtime_nsec }, rec.mode };
+      if (job.path == NULL || job.data == NULL) {
+        free(job.path);
+        free(job.data);
+        report(io, "Out of memory.");
+        err = -1;
+        break;
+      }
+      if (recv_data(io, job.data, rec.size)) {
+        free(job.path);
+        free(job.data);
+        err = -1;
+        break;
+      }
+      io->files++;
+      pthread_mutex_lock(&st.lock);
+      while (st.count == ARCHIVE_AHEAD) {
+        pthread_cond_wait(&st.cond, &st.lock);
+      }
+      st.queue[(st.head + st.count) % ARCHIVE_AHEAD] = job;
+      st.count++;
+      pthread_cond_broadcast(&st.cond);
+      pthread_mutex_unlock(&st.lock);
+    } else {
+      report(io, "Unknown archive record %u.", rec.type);
+      err = -1;
+      break;
+    }
+  }
+
+  drain(&st);
+  pthread_mutex_lock(&st.lock);
+  st.stop = 1;
+  pthread_cond_broadcast(&st.cond);
+  pthread_mutex_unlock(&st.lock);
+  for (int i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  io->failed += st.failed;
+
+  // files the sender couldn't read properly
+  for (size_t i = 0; i < bad.count; i++) {
+    unlink(bad.entries[i].path);
+    io->failed++;
+    io->files -= io->files > 0;
+  }
+  // nothing more will be created in the directories, so their times stick
+  for (size_t i = 0; i < dirs.count; i++) {
+    struct timespec times[2] = { { 0, UTIME_OMIT }, dirs.entries[i].mtime };
+    utimensat(AT_FDCWD, dirs.entries[i].path, times, 0);
+  }
+  for (size_t i = 0; i < dirs.count; i++) {
+    free(dirs.entries[i].path);
+  }
+  for (size_t i = 0; i < bad.count; i++) {
+    free(bad.entries[i].path);
+  }
+  free(dirs.entries);
+  free(bad.entries);
+  pthread_mutex_destroy(&st.lock);
+  pthread_cond_destroy(&st.cond);
+  return err;
+}
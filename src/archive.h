@@ -0,0 +1,58 @@
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// disk I/O threads on each side of a directory transfer
+#define ARCHIVE_THREADS 4
+// files up to this size are read and written by the I/O threads, bigger
+// ones are streamed straight between the file and the socket
+#define ARCHIVE_INLINE_MAX (256 * 1024)
+// most files read ahead of, or waiting to be written behind, the socket
+#define ARCHIVE_AHEAD 64
+
+enum archive_record_type {
+  REC_DIR = 0x01,   // a directory, created before anything inside it
+  REC_FILE = 0x02,  // a regular file, size bytes follow the path
+  REC_BAD = 0x03,   // the file with this path was sent damaged, remove it
+  REC_END = 0x04    // end of the archive
+};
+
+// every record is this header, path_len bytes of relative path, then for
+// REC_FILE the file's contents
+struct archive_record {
+  uint32_t type;
+  uint32_t path_len;
+  uint32_t mode;        // permission bits
+  uint32_t mtime_nsec;
+  uint64_t size;
+  int64_t mtime_sec;
+};
+
+// one side of a directory transfer
+struct archive_io {
+  int sockfd;
+  // called for every chunk of file data moved, may be NULL; -1 aborts
+  int (*pace)(void *arg, size_t n);
+  void *pace_arg;
+  // called with each error, a printf format without a newline
+  void (*log)(const char *fmt, va_list args);
+  uint64_t files;   // files moved
+  uint64_t bytes;   // file bytes moved
+  int failed;       // files that couldn't be read or written
+  // a tree spread over several directories, like the server's data
+  // directories: root is then relative to each of roots, and place gives
+  // the one a file belongs in from its root-relative name. Not used when
+  // num_roots is 0.
+  char **roots;
+  int num_roots;
+  int (*place)(char *name);
+};
+
+int archive_safe_path(char *path);
+int archive_send(struct archive_io *io, char *root);
+int archive_recv(struct archive_io *io, char *root);
+
+#endif
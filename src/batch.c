@@ -0,0 +1,350 @@
+// Data & Communication Networks
+// Project 1 - Socket Programming
+// Peter Fabinski (pnf9945)
+// TigerC - batch mode
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "batch.h"
+#include "client.h"
+#include "common.h"
+#include "muxclient.h"
+#include "trace.h"
+
+// Batch mode runs a list of transfers on a small pool of worker threads.
+// Each worker opens one connection, authenticates once and then takes jobs
+// off the shared list until it is empty, so a hundred files cost a handful
+// of handshakes instead of a hundred processes. A worker whose transfer
+// fails reconnects before taking the next job, since the connection may be
+// out of step with the server. With -x each worker instead keeps several
+// transfers going at once as streams on its connection.
+
+static char *batch_host;
+static char *batch_user;
+static char *batch_pass;
+static int batch_streams;
+static struct batch_job *jobs = NULL;
+static int num_jobs = 0;
+static int next_job = 0;
+static uint64_t next_conn = 0;
+static int logged_in = 0;
+static pthread_mutex_t print_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// add a job to the list
+// return: 0 on success, -1 if out of memory
+static int add_job(enum ftp_command cmd, char *filename) {
+  static int capacity = 0;
+  if (num_jobs == capacity) {
+    int new_capacity = capacity ? capacity * 2 : 64;
+    struct batch_job *bigger = realloc(jobs, new_capacity * sizeof(*jobs));
+    if (bigger == NULL) {
+      fprintf(stderr, "Out of memory.\n");
+      return -1;
+    }
+    jobs = bigger;
+    capacity = new_capacity;
+  }
+  struct batch_job *job = &jobs[num_jobs];
+  memset(job, 0, sizeof(*job));
+  job->cmd = cmd;
+  job->filename = strdup(filename);
+  if (job->filename == NULL) {
+    fprintf(stderr, "Out of memory.\n");
+    return -1;
+  }
+  num_jobs++;
+  return 0;
+}
+
+// read jobs from a manifest, one tget, ttail or tput command per line
+// return: 0 on success, -1 on error
+// path: the manifest file, "-" for stdin
+static int read_manifest(char *path) {
+  FILE *file = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+  if (!file) {
+    fprintf(stderr, "fopen: %s\n", strerror(errno));
+    return -1;
+  }
+
+  char line[CMDLEN + 2];
+  int lineno = 0;
+  int err = 0;
+  while (fgets(line, sizeof(line), file)) {
+    lineno++;
+    if (strchr(line, '\n') == NULL && !feof(file)) {
+      fprintf(stderr, "%s:%d: line too long.\n", path, lineno);
+      err = -1;
+      break;
+    }
+    // skip blank lines and comments
+    char *start = line + strspn(line, " \t\r\n");
+    if (*start == '\0' || *start == '#') {
+      continue;
+    }
+    enum ftp_command cmd;
+    char *hostname, *username, *password, *filename, *target;
+    if (parse_cmd(start, &cmd, &hostname, &username, &password, &filename, &target)) {
+      err = -1;
+      break;
+    }
+    if (cmd != TGET && cmd != TTAIL && cmd != TPUT) {
+      fprintf(stderr, "%s:%d: only tget, ttail and tput are allowed.\n", path, lineno);
+      err = -1;
+      break;
+    }
+    if (add_job(cmd, filename)) {
+      err = -1;
+      break;
+    }
+  }
+  if (ferror(file)) {
+    fprintf(stderr, "fgets: %s\n", strerror(errno));
+    err = -1;
+  }
+  if (file != stdin) {
+    fclose(file);
+  }
+  return err;
+}
+
+// open and authenticate a worker connection
+// return: socket file descriptor, -1 on error
+static int worker_connect(void) {
+  conn_id = __atomic_add_fetch(&next_conn, 1, __ATOMIC_RELAXED);
+  uint64_t trace_start = trace_begin();
+  int sockfd = open_conn(batch_host);
+  if (sockfd == -1) {
+    return -1;
+  }
+  trace_end("connect", trace_start, conn_id, batch_host);
+
+  trace_start = trace_begin();
+  int err = do_auth(sockfd, batch_user, batch_pass);
+  trace_end("auth", trace_start, conn_id, batch_user);
+  if (err == 1) {
+    fprintf(stderr, "Incorrect username or password, or the server is full.\n");
+  } else if (err == -1) {
+    fprintf(stderr, "Error occurred during authentication.\n");
+  }
+  if (err == 0 && batch_streams) {
+    err = mux_start(sockfd);
+  }
+  if (err) {
+    close_conn(sockfd);
+    return -1;
+  }
+  __atomic_add_fetch(&logged_in, 1, __ATOMIC_RELAXED);
+  return sockfd;
+}
+
+// return: what a job does, for the results
+static const char *job_name(struct batch_job *job) {
+  return job->cmd == TGET ? "get" : job->cmd == TTAIL ? "tail" : "put";
+}
+
+// take the next job off the list
+// return: the job, NULL when the list is empty
+static struct batch_job *take_job(void) {
+  int i = __atomic_fetch_add(&next_job, 1, __ATOMIC_RELAXED);
+  if (i >= num_jobs) {
+    return NULL;
+  }
+  return &jobs[i];
+}
+
+// record and print a finished job
+// err: the transfer result
+static void finish_job(struct batch_job *job, int err) {
+  job->ns = now_ns() - job->ns;
+  job->err = err;
+  job->done = 1;
+
+  // both sides end up with the whole file, so its size is what moved
+  struct stat stats;
+  if (job->err == 0 && stat(job->filename, &stats) == 0) {
+    job->bytes = stats.st_size;
+  }
+
+  pthread_mutex_lock(&print_lock);
+  printf("%-4s %s %s %llu bytes %.3f s %.2f MB/s\n", job->err ? "FAIL" : "OK",
+      job_name(job), job->filename, (unsigned long long) job->bytes,
+      job->ns / 1e9, job->ns ? job->bytes / (job->ns / 1e9) / 1e6 : 0.0);
+  fflush(stdout);
+  pthread_mutex_unlock(&print_lock);
+}
+
+// hand the next job to mux_run
+static int mux_next(void *arg, enum ftp_req_type *type, char **filename, void **job) {
+  (void) arg;
+  struct batch_job *next = take_job();
+  if (next == NULL) {
+    return 0;
+  }
+  next->ns = now_ns(); // start time until it finishes
+  *type = next->cmd == TGET ? GET : PUT;
+  *filename = next->filename;
+  *job = next;
+  return 1;
+}
+
+static void mux_done(void *arg, void *job, int err) {
+  (void) arg;
+  finish_job(job, err);
+}
+
+// take jobs off the list until it is empty
+static void *batch_worker(void *arg) {
+  (void) arg;
+  int sockfd = -1;
+  for (;;) {
+    if (sockfd == -1) {
+      sockfd = worker_connect();
+      if (sockfd == -1) {
+        // leave the rest to the other workers
+        break;
+      }
+    }
+
+    if (batch_streams) {
+      // runs until the list is empty, unless the connection fails
+      if (mux_run(sockfd, batch_streams, mux_next, mux_done, NULL) == 0) {
+        break;
+      }
+      close_conn(sockfd);
+      sockfd = -1;
+      continue;
+    }
+
+    struct batch_job *job = take_job();
+    if (job == NULL) {
+      break;
+    }
+    job->ns = now_ns();
+    int err = job->cmd == TPUT ? do_put(sockfd, job->filename) :
+        do_get(sockfd, job->filename, job->cmd == TTAIL);
+    finish_job(job, err);
+
+    if (err) {
+      close_conn(sockfd);
+      sockfd = -1;
+    }
+  }
+
+  if (sockfd != -1) {
+    if (batch_streams) {
+      mux_end(sockfd);
+    } else {
+      send_close(sockfd);
+    }
+    close_conn(sockfd);
+  }
+  trace_flush();
+  return NULL;
+}
+
+// run transfers from a manifest and/or the command line on parallel connections
+// return: exit status, 0 if every transfer worked, 1 on a usage or setup error,
+//         2 if any transfer failed
+// host, user, pass: the server and login used by every worker
+// workers: number of worker connections
+// streams: transfers at once on each connection, 0 to not multiplex
+// manifest: file of tget/ttail/tput lines, NULL for none
+// argc, argv: more jobs as "tget <file>" / "ttail <file>" / "tput <file>" pairs
+int batch_main(char *host, char *user, char *pass, int workers, int streams,
+    char *manifest, int argc, char **argv) {
+  batch_host = host;
+  batch_user = user;
+  batch_pass = pass;
+  batch_streams = streams;
+
+  if (manifest && read_manifest(manifest)) {
+    return 1;
+  }
+  for (int i = 0; i < argc; i += 2) {
+    enum ftp_command cmd;
+    if (strcmp(argv[i], "tget") == 0) {
+      cmd = TGET;
+    } else if (strcmp(argv[i], "ttail") == 0) {
+      cmd = TTAIL;
+    } else if (strcmp(argv[i], "tput") == 0) {
+      cmd = TPUT;
+    } else {
+      fprintf(stderr, "Expected tget, ttail or tput, got %s\n", argv[i]);
+      return 1;
+    }
+    if (i + 1 == argc) {
+      fprintf(stderr, "%s requires a filename.\n", argv[i]);
+      return 1;
+    }
+    if (add_job(cmd, argv[i + 1])) {
+      return 1;
+    }
+  }
+  if (num_jobs == 0) {
+    fprintf(stderr, "Nothing to transfer.\n");
+    return 1;
+  }
+  // a stream waiting on an upload would hold up the rest of its connection
+  for (int i = 0; streams && i < num_jobs; i++) {
+    if (jobs[i].cmd == TTAIL) {
+      fprintf(stderr, "ttail can't be multiplexed (-x).\n");
+      return 1;
+    }
+  }
+
+  if (workers > num_jobs) {
+    workers = num_jobs;
+  }
+  pthread_t *threads = malloc(workers * sizeof(*threads));
+  if (threads == NULL) {
+    fprintf(stderr, "Out of memory.\n");
+    return 1;
+  }
+
+  uint64_t start = now_ns();
+  int started = 0;
+  for (int i = 0; i < workers; i++) {
+    int err = pthread_create(&threads[i], NULL, batch_worker, NULL);
+    if (err) {
+      fprintf(stderr, "pthread_create: %s\n", strerror(err));
+      break;
+    }
+    started++;
+  }
+  for (int i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  uint64_t elapsed = now_ns() - start;
+  free(threads);
+
+  // jobs no worker got to (every connection failed) count as failures
+  int failed = 0;
+  uint64_t bytes = 0;
+  for (int i = 0; i < num_jobs; i++) {
+    if (!jobs[i].done) {
+      printf("FAIL %s %s not attempted\n", job_name(&jobs[i]), jobs[i].filename);
+      jobs[i].err = -1;
+    }
+    if (jobs[i].err) {
+      failed++;
+    }
+    bytes += jobs[i].bytes;
+    free(jobs[i].filename);
+  }
+  free(jobs);
+
+  printf("%d files, %d failed, %llu bytes in %.3f s, %.2f MB/s over %d logins\n",
+      num_jobs, failed, (unsigned long long) bytes, elapsed / 1e9,
+      elapsed ? bytes / (elapsed / 1e9) / 1e6 : 0.0, logged_in);
+  if (logged_in == 0) {
+    // never got a working connection, nothing was really tried
+    return 1;
+  }
+  return failed ? 2 : 0;
+}
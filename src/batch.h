@@ -0,0 +1,23 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stdint.h>
+#include "client.h"
+
+// default number of worker connections
+#define BATCH_WORKERS 4
+
+// one transfer from the manifest or command line
+struct batch_job {
+  enum ftp_command cmd;  // TGET, TTAIL or TPUT
+  char *filename;
+  int done;              // set once a worker has tried it
+  int err;
+  uint64_t bytes;
+  uint64_t ns;           // start time while running, then duration
+};
+
+int batch_main(char *host, char *user, char *pass, int workers, int streams,
+    char *manifest, int argc, char **argv);
+
+#endif
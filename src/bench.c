@@ -0,0 +1,224 @@
+
+// Data & Communication Networks
+// Project 1 - Socket Programming
+// Peter Fabinski (pnf9945)
+// TigerBench - load generator and benchmark
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "bench.h"
+#include "tls.h"
+
+// run parameters, set once by main before the workers start
+static char *host = "127.0.0.1";
+static char *user = "user";
+static char *pass = "pass";
+static int sessions = 8;
+static int duration = 10;
+static int ops_per_session = 10;
+static int get_percent = 50;
+static int think_ms = 0;
+static size_t sizes[MAX_SIZES];
+static int num_sizes = 0;
+static uint64_t deadline;
+
+static const char *op_names[NUM_OPS] = { "connect", "get", "put" };
+
+int main(int argc, char **argv) {
+  int opt;
+  while ((opt = getopt(argc, argv, "h:u:p:c:d:n:g:s:t:e:")) != -1) {
+    switch (opt) {
+      case 'h': host = optarg; break;
+      case 'u': user = optarg; break;
+      case 'p': pass = optarg; break;
+      case 'c': sessions = atoi(optarg); break;
+      case 'd': duration = atoi(optarg); break;
+      case 'n': ops_per_session = atoi(optarg); break;
+      case 'g': get_percent = atoi(optarg); break;
+      case 't': think_ms = atoi(optarg); break;
+      case 'e':
+        if (tls_client_init(optarg)) {
+          return 1;
+        }
+        break;
+      case 's': {
+        // comma separated list of sizes
+        static char *strtok_state;
+        char *token = strtok_r(optarg, ",", &strtok_state);
+        while (token && num_sizes < MAX_SIZES) {
+          sizes[num_sizes++] = parse_size(token);
+          token = strtok_r(NULL, ",", &strtok_state);
+        }
+        break;
+      }
+      default:
+        usage();
+        return 1;
+    }
+  }
+  if (sessions < 1 || duration < 1 || ops_per_session < 1 ||
+      get_percent < 0 || get_percent > 100) {
+    usage();
+    return 1;
+  }
+  if (num_sizes == 0) {
+    sizes[num_sizes++] = 64 * 1024;
+  }
+
+  // workers still transferring at the deadline see EPIPE instead of dying
+  signal(SIGPIPE, SIG_IGN);
+
+  // upload one file per size so the GETs have something to fetch; each
+  // PUT returns once the server has published the file
+  int sockfd = bench_connect(host, user, pass);
+  if (sockfd == -1) {
+    fprintf(stderr, "Could not connect to server.\n");
+    return 1;
+  }
+  for (int i = 0; i < num_sizes; i++) {
+    char filename[64];
+    uint64_t bytes;
+    snprintf(filename, sizeof(filename), "bench_%zu.dat", sizes[i]);
+    if (bench_put(sockfd, filename, sizes[i], &bytes)) {
+      fprintf(stderr, "Failed to upload %s.\n", filename);
+      return 1;
+    }
+  }
+  send_close(sockfd);
+  close_conn(sockfd);
+
+  struct bench_worker *workers = calloc(sessions, sizeof(*workers));
+  if (workers == NULL) {
+    fprintf(stderr, "Out of memory.\n");
+    return 1;
+  }
+
+  uint64_t start = now_ns();
+  deadline = start + (uint64_t) duration * 1000000000ULL;
+  for (int i = 0; i < sessions; i++) {
+    workers[i].id = i;
+    workers[i].seed = i + 1;
+    int err = pthread_create(&workers[i].thread, NULL, bench_worker, &workers[i]);
+    if (err) {
+      fprintf(stderr, "pthread_create: %s\n", strerror(err));
+      return 1;
+    }
+  }
+
+  // merge the per-worker results
+  struct bench_worker total = {0};
+  for (int i = 0; i < sessions; i++) {
+    pthread_join(workers[i].thread, NULL);
+    total.bytes += workers[i].bytes;
+    total.sessions += workers[i].sessions;
+    total.errors += workers[i].errors;
+    for (int op = 0; op < NUM_OPS; op++) {
+      struct lat_samples *s = &workers[i].lat[op];
+      for (size_t j = 0; j < s->count; j++) {
+        lat_add(&total.lat[op], s->ns[j]);
+      }
+      free(s->ns);
+    }
+  }
+  double elapsed = (now_ns() - start) / 1e9;
+
+  // one JSON object on stdout
+  printf("{\"sessions\": %d, \"duration_s\": %.3f, \"get_percent\": %d, "
+      "\"think_ms\": %d, \"ops_per_session\": %d,\n",
+      sessions, elapsed, get_percent, think_ms, ops_per_session);
+  printf(" \"bytes\": %llu, \"throughput_MBps\": %.3f, "
+      "\"connections\": %llu, \"connections_per_s\": %.3f, \"errors\": %llu,\n",
+      (unsigned long long) total.bytes, total.bytes / elapsed / 1e6,
+      (unsigned long long) total.sessions, total.sessions / elapsed,
+      (unsigned long long) total.errors);
+  printf(" \"latency_us\": {");
+  for (int op = 0; op < NUM_OPS; op++) {
+    struct lat_samples *s = &total.lat[op];
+    printf("%s\n  \"%s\": {\"count\": %zu, \"p50\": %.1f, \"p99\": %.1f, \"p999\": %.1f}",
+        op ? "," : "", op_names[op], s->count,
+        lat_percentile(s, 0.50) / 1e3, lat_percentile(s, 0.99) / 1e3,
+        lat_percentile(s, 0.999) / 1e3);
+  }
+  printf("\n }\n}\n");
+
+  free(workers);
+  return total.errors ? 2 : 0;
+}
+
+// run sessions until the deadline passes
+// arg: this worker's struct bench_worker
+void *bench_worker(void *arg) {
+  struct bench_worker *w = arg;
+
+  while (now_ns() < deadline) {
+    uint64_t t0 = now_ns();
+    int sockfd = bench_connect(host, user, pass);
+    if (sockfd == -1) {
+      w->errors++;
+      usleep(1000); // don't spin if the server is refusing us
+      continue;
+    }
+    lat_add(&w->lat[OP_CONNECT], now_ns() - t0);
+
+    int ok = 1;
+    for (int i = 0; i < ops_per_session && ok && now_ns() < deadline; i++) {
+      if (think_ms > 0 && i > 0) {
+        usleep(think_ms * 1000);
+      }
+      size_t size = sizes[rand_r(&w->seed) % num_sizes];
+      char filename[64];
+      snprintf(filename, sizeof(filename), "bench_%zu.dat", size);
+
+      int err;
+      t0 = now_ns();
+      if ((int) (rand_r(&w->seed) % 100) < get_percent) {
+        err = bench_get(sockfd, filename, &w->bytes);
+        if (!err) {
+          lat_add(&w->lat[OP_GET], now_ns() - t0);
+        }
+      } else {
+        // each worker writes its own copy so PUTs don't clobber the GET files;
+        // named by worker so the next run overwrites them
+        snprintf(filename, sizeof(filename), "bench_put_%zu_%d.dat", size, w->id);
+        err = bench_put(sockfd, filename, size, &w->bytes);
+        if (!err) {
+          lat_add(&w->lat[OP_PUT], now_ns() - t0);
+        }
+      }
+      if (err) {
+        w->errors++;
+        ok = 0;
+      }
+    }
+    if (ok) {
+      send_close(sockfd);
+    }
+    close_conn(sockfd);
+    w->sessions++;
+  }
+  return NULL;
+}
+
+// print usage message
+void usage(void) {
+  fprintf(stderr, "Usage: TigerBench [options]\n");
+  fprintf(stderr, "  -h <host>      server address, optionally host:port (default 127.0.0.1)\n");
+  fprintf(stderr, "  -u <user>      username (default user)\n");
+  fprintf(stderr, "  -p <pass>      password (default pass)\n");
+  fprintf(stderr, "  -c <sessions>  concurrent sessions (default 8)\n");
+  fprintf(stderr, "  -d <seconds>   run time (default 10)\n");
+  fprintf(stderr, "  -n <ops>       operations per session (default 10)\n");
+  fprintf(stderr, "  -g <percent>   percentage of operations that are GETs (default 50)\n");
+  fprintf(stderr, "  -s <sizes>     comma separated file sizes, k/m/g suffixes are powers of 1024\n");
+  fprintf(stderr, "                 (default 64k)\n");
+  fprintf(stderr, "  -t <ms>        think time between operations (default 0)\n");
+  fprintf(stderr, "  -e <cafile>    connect with TLS, trusting the CAs in this PEM file\n");
+}
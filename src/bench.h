@@ -0,0 +1,46 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common.h"
+
+#define MAX_SIZES 16
+
+enum bench_op { OP_CONNECT, OP_GET, OP_PUT, NUM_OPS };
+
+// latency samples for one operation type, in nanoseconds
+struct lat_samples {
+  uint64_t *ns;
+  size_t count;
+  size_t cap;
+};
+
+// per-worker results, merged by main when the run ends
+struct bench_worker {
+  pthread_t thread;
+  int id;
+  unsigned int seed;
+  struct lat_samples lat[NUM_OPS];
+  uint64_t bytes;
+  uint64_t sessions;
+  uint64_t errors;
+};
+
+int lat_add(struct lat_samples *s, uint64_t ns);
+uint64_t lat_percentile(struct lat_samples *s, double p);
+size_t parse_size(char *str);
+void *bench_worker(void *arg);
+int bench_connect(char *host, char *user, char *pass);
+int bench_get(int sockfd, char *filename, uint64_t *bytes);
+int bench_put(int sockfd, char *filename, size_t filesize, uint64_t *bytes);
+int bench_list(int sockfd, char *request, size_t len, size_t limit, uint64_t *bytes);
+int bench_copy(int sockfd, enum ftp_req_type type, char *request, size_t len);
+int bench_stats(int sockfd, uint64_t *bytes);
+void usage(void);
+void micro_usage(void);
+void replay_usage(void);
+
+#endif
@@ -0,0 +1,216 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "common.h"
+#include "bench.h"
+#include "clientlib.h"
+
+#define BUF_SIZE 65536
+
+// append a latency sample
+// return: 0 on success, -1 if out of memory
+int lat_add(struct lat_samples *s, uint64_t ns) {
+  if (s->count == s->cap) {
+    size_t cap = s->cap ? s->cap * 2 : 1024;
+    uint64_t *ns_new = realloc(s->ns, cap * sizeof(*ns_new));
+    if (ns_new == NULL) {
+      return -1;
+    }
+    s->ns = ns_new;
+    s->cap = cap;
+  }
+  s->ns[s->count++] = ns;
+  return 0;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *) a;
+  uint64_t y = *(const uint64_t *) b;
+  return (x > y) - (x < y);
+}
+
+// nearest-rank percentile of the samples (sorts them in place)
+// return: the sample at percentile p, 0 if there are none
+uint64_t lat_percentile(struct lat_samples *s, double p) {
+  if (s->count == 0) {
+    return 0;
+  }
+  qsort(s->ns, s->count, sizeof(*s->ns), cmp_u64);
+  size_t rank = (size_t) (p * s->count);
+  if (rank >= s->count) {
+    rank = s->count - 1;
+  }
+  return s->ns[rank];
+}
+
+// parse a size with an optional k/m/g suffix
+// return: size in bytes
+size_t parse_size(char *str) {
+  char *end;
+  size_t size = strtoull(str, &end, 10);
+  switch (*end) {
+    case 'k': case 'K': size *= 1024; break;
+    case 'm': case 'M': size *= 1024 * 1024; break;
+    case 'g': case 'G': size *= 1024 * 1024 * 1024; break;
+  }
+  return size;
+}
+
+// open a connection and authenticate
+// return: socket file descriptor, -1 on error
+// hostname: the server, optionally with :port
+int bench_connect(char *hostname, char *username, char *password) {
+  // the TLS handshake, if any, counts toward the connect latency
+  int sockfd = open_conn(hostname);
+  if (sockfd == -1) {
+    return -1;
+  }
+  if (do_auth(sockfd, username, password)) {
+    fprintf(stderr, "Authentication failed.\n");
+    close(sockfd);
+    return -1;
+  }
+  return sockfd;
+}
+
+// send a file request and wait for the response
+// return: 0 on success, -1 on error
+// filename: the request's filename, which may contain NULs (COPY, LIST)
+static int bench_request(int sockfd, enum ftp_req_type type, char *filename,
+    size_t filename_len, size_t filesize, struct ftp_file_response *resp) {
+  struct ftp_file_request req = {0};
+  req.type = htonl(type);
+  req.filesize = htonl(filesize);
+  req.filename_len = htonl(filename_len);
+  // header and filename in one send, or Nagle holds the filename back for
+  // the server's delayed ACK
+  char msg[sizeof(req) + MAX_NAME_LEN];
+  if (filename_len > sizeof(msg) - sizeof(req)) {
+    return -1;
+  }
+  memcpy(msg, &req, sizeof(req));
+  memcpy(msg + sizeof(req), filename, filename_len);
+  if (send_all(sockfd, msg, sizeof(req) + filename_len) == -1) {
+    return -1;
+  }
+
+  ssize_t received = recv(sockfd, resp, sizeof(*resp), MSG_WAITALL);
+  if (received != sizeof(*resp)) {
+    fprintf(stderr, "Connection closed during response.\n");
+    return -1;
+  }
+  resp->type = ntohl(resp->type);
+  resp->result = ntohl(resp->result);
+  resp->filesize = ntohl(resp->filesize);
+  if (resp->type != type || resp->result != SUCCESS) {
+    fprintf(stderr, "Request for %s failed (type %d, result %d).\n", filename,
+        resp->type, resp->result);
+    return -1;
+  }
+  return 0;
+}
+
+// receive a response's payload and discard it
+// return: 0 on success, -1 on error
+// len: payload size
+// bytes: incremented by len
+static int bench_discard(int sockfd, size_t len, uint64_t *bytes) {
+  static char buf[BUF_SIZE]; // contents are never looked at, share it
+  size_t num_received = 0;
+  while (num_received < len) {
+    size_t to_receive = len - num_received;
+    if (to_receive > sizeof(buf)) {
+      to_receive = sizeof(buf);
+    }
+    ssize_t received = recv(sockfd, buf, to_receive, 0);
+    if (received <= 0) {
+      fprintf(stderr, "Connection closed during response.\n");
+      return -1;
+    }
+    num_received += received;
+  }
+  *bytes += num_received;
+  return 0;
+}
+
+// GET a file and discard the data
+// return: 0 on success, -1 on error
+// bytes: incremented by the payload size
+int bench_get(int sockfd, char *filename, uint64_t *bytes) {
+  struct ftp_file_response resp;
+  if (bench_request(sockfd, GET, filename, strlen(filename), 0, &resp)) {
+    return -1;
+  }
+  return bench_discard(sockfd, resp.filesize, bytes);
+}
+
+// LIST a page of names and discard it
+// return: 0 on success, -1 on error
+// request: prefix, optionally followed by a NUL and the previous page's last name
+// len: length of request
+// limit: most entries wanted, 0 for the server's default
+// bytes: incremented by the listing's size
+int bench_list(int sockfd, char *request, size_t len, size_t limit, uint64_t *bytes) {
+  struct ftp_file_response resp;
+  if (bench_request(sockfd, LIST, request, len, limit, &resp)) {
+    return -1;
+  }
+  return bench_discard(sockfd, resp.filesize, bytes);
+}
+
+// COPY or MOVE a file on the server
+// return: 0 on success, -1 on error
+// request: source, a NUL, then destination
+// len: length of request
+int bench_copy(int sockfd, enum ftp_req_type type, char *request, size_t len) {
+  struct ftp_file_response resp;
+  return bench_request(sockfd, type, request, len, 0, &resp);
+}
+
+// fetch the server's metrics and discard them
+// return: 0 on success, -1 on error
+// bytes: incremented by the text's size
+int bench_stats(int sockfd, uint64_t *bytes) {
+  struct ftp_file_response resp;
+  if (bench_request(sockfd, STATS, "", 0, 0, &resp)) {
+    return -1;
+  }
+  return bench_discard(sockfd, resp.filesize, bytes);
+}
+
+// PUT a file of zeros
+// return: 0 on success, -1 on error
+// bytes: incremented by the payload size
+int bench_put(int sockfd, char *filename, size_t filesize, uint64_t *bytes) {
+  struct ftp_file_response resp;
+  if (bench_request(sockfd, PUT, filename, strlen(filename), filesize, &resp)) {
+    return -1;
+  }
+
+  static char buf[BUF_SIZE]; // always zero
+  size_t num_sent = 0;
+  while (num_sent < filesize) {
+    size_t to_send = filesize - num_sent;
+    if (to_send > sizeof(buf)) {
+      to_send = sizeof(buf);
+    }
+    if (send_all(sockfd, buf, to_send) == -1) {
+      return -1;
+    }
+    num_sent += to_send;
+  }
+  // wait for the server to publish the file
+  struct ftp_file_response done;
+  if (recv(sockfd, &done, sizeof(done), MSG_WAITALL) != sizeof(done) ||
+      ntohl(done.type) != PUT || ntohl(done.result) != SUCCESS) {
+    fprintf(stderr, "PUT of %s wasn't saved.\n", filename);
+    return -1;
+  }
+  *bytes += num_sent;
+  return 0;
+}
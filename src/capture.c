@@ -0,0 +1,99 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "capture.h"
+
+// Traffic capture for replay (see capture.h for the format). Each event is
+// formatted into a line by the session's own thread and appended with a
+// single write, so lines from concurrent sessions, and from the old and new
+// server while a hot restart drains, never interleave, and a crash loses
+// nothing already recorded. When capturing is off capture_begin and
+// capture_event are a single branch.
+
+int capture_enabled = 0;
+
+static int capture_fd = -1;
+static pid_t capture_pid;
+
+static const char *result_names[] = { "ok", "fail", "busy" };
+
+static uint64_t now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// start capturing, appending to a file
+// return: 0 on success, -1 on error
+// path: file to write the capture to
+int capture_open(char *path) {
+  capture_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  if (capture_fd == -1) {
+    fprintf(stderr, "open: %s\n", strerror(errno));
+    return -1;
+  }
+  capture_pid = getpid();
+  char line[128];
+  int len = snprintf(line, sizeof(line), "# tigerftp capture v1, server %d\n", (int) capture_pid);
+  if (write(capture_fd, line, len) != len) {
+    fprintf(stderr, "write: %s\n", strerror(errno));
+    close(capture_fd);
+    return -1;
+  }
+  capture_enabled = 1;
+  return 0;
+}
+
+// timestamp the start of an event
+// return: start time, 0 if capturing is off
+uint64_t capture_begin(void) {
+  return capture_enabled ? now() : 0;
+}
+
+// record a finished event
+// session: connection number
+// op: event name, see capture.h
+// start: value returned by capture_begin
+// size: see capture.h, CAPTURE_NONE if unknown
+// name: the request's filename, may be NULL
+// name_len: its length; it may contain NULs
+void capture_event(uint64_t session, const char *op, uint64_t start, uint64_t size,
+    enum capture_result result, const char *name, size_t name_len) {
+  if (!capture_enabled) {
+    return;
+  }
+  char line[CAPTURE_LINE];
+  uint64_t end = now();
+  int len = snprintf(line, sizeof(line), "%llu %d.%llu %s ",
+      (unsigned long long) (start / 1000), (int) capture_pid,
+      (unsigned long long) session, op);
+  if (size == CAPTURE_NONE) {
+    len += snprintf(line + len, sizeof(line) - len, "- ");
+  } else {
+    len += snprintf(line + len, sizeof(line) - len, "%llu ", (unsigned long long) size);
+  }
+  len += snprintf(line + len, sizeof(line) - len, "%llu %s ",
+      (unsigned long long) ((end - start) / 1000), result_names[result]);
+
+  if (name == NULL || name_len == 0) {
+    line[len++] = '-';
+  }
+  for (size_t i = 0; name && i < name_len && len < (int) sizeof(line) - 5; i++) {
+    unsigned char c = name[i];
+    if (c <= ' ' || c >= 0x7f || c == '%' || (c == '-' && name_len == 1)) {
+      len += snprintf(line + len, sizeof(line) - len, "%%%02X", c);
+    } else {
+      line[len++] = c;
+    }
+  }
+  line[len++] = '\n';
+
+  // best effort: a full disk shouldn't take sessions down with it
+  ssize_t n = write(capture_fd, line, len);
+  (void) n;
+}
@@ -0,0 +1,39 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common.h"
+
+// A capture is a text file with one line per event:
+//
+//   time_us session op size dur_us result name
+//
+// time_us is when the event started, in microseconds since the Unix epoch;
+// session is the server's pid and connection number, "pid.conn". op is
+// OPEN (connection accepted), AUTH, a request type (GET, PUT, LIST, ...),
+// END, or CLOSE (connection gone). size is the file size for GET and PUT and the most entries asked
+// for by LIST, "-" if unknown or not applicable. dur_us is how long it took,
+// result ok, fail or busy. name is the request's filename with bytes
+// outside printable ASCII, spaces and '%' written as %XX ("src%00dst" for
+// COPY and MOVE), or "-" if empty. Lines starting with '#' are comments.
+// Lines are written as events end, so they're ordered by end time. A
+// server appends to an existing capture, so one file can span restarts.
+//
+// Payloads and credentials are never recorded.
+
+#define CAPTURE_NONE UINT64_MAX
+// longest line, a name of MAX_NAME_LEN bytes all escaped
+#define CAPTURE_LINE (128 + 3 * MAX_NAME_LEN)
+
+enum capture_result { CAPTURE_OK, CAPTURE_FAIL, CAPTURE_BUSY };
+
+extern int capture_enabled;
+
+int capture_open(char *path);
+uint64_t capture_begin(void);
+void capture_event(uint64_t session, const char *op, uint64_t start, uint64_t size,
+    enum capture_result result, const char *name, size_t name_len);
+
+#endif
@@ -4,25 +4,97 @@
 // TigerC - client
 
 #include <arpa/inet.h>
+#include <endian.h>
 #include <errno.h>
 #include <limits.h>
 #include <netdb.h>
+#include <signal.h>
+#include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "archive.h"
+#include "batch.h"
 #include "common.h"
 #include "client.h"
+#include "clientlib.h"
+#include "muxclient.h"
+#include "tls.h"
+#include "trace.h"
 
-#define CMDLEN 255
+// connection number for trace output, per thread for batch workers
+__thread uint64_t conn_id = 0;
 
-int main(void) {
+// set once the connection has switched to multiplexed streams
+__thread int muxed = 0;
+
+// batch mode prints its own per-file results
+static int quiet = 0;
+
+int main(int argc, char **argv) {
   int line_max;
 
+  // parse options
+  int opt;
+  char *batch_host = NULL;
+  char *batch_user = "user";
+  char *batch_pass = "pass";
+  char *manifest = NULL;
+  int workers = BATCH_WORKERS;
+  int streams = 0;
+  int secure = 0;
+  char *cafile = NULL;
+  while ((opt = getopt(argc, argv, "T:b:u:p:j:f:x:sA:")) != -1) {
+    switch (opt) {
+      case 'T':
+        if (trace_open(optarg, "client")) {
+          fprintf(stderr, "Failed to open trace file %s\n", optarg);
+          exit(1);
+        }
+        break;
+      case 'b': batch_host = optarg; break;
+      case 'u': batch_user = optarg; break;
+      case 'p': batch_pass = optarg; break;
+      case 'j': workers = atoi(optarg); break;
+      case 'f': manifest = optarg; break;
+      case 'x': streams = atoi(optarg); break;
+      case 's': secure = 1; break;
+      case 'A': secure = 1; cafile = optarg; break;
+      default:
+        batch_usage();
+        exit(1);
+    }
+  }
+
+  // a server that closed the connection shows up as a send error instead
+  signal(SIGPIPE, SIG_IGN);
+
+  if (secure && tls_client_init(cafile)) {
+    exit(1);
+  }
+
+  // batch mode: run the transfers and exit
+  if (batch_host) {
+    if (workers < 1 || streams < 0) {
+      batch_usage();
+      exit(1);
+    }
+    quiet = 1;
+    int status = batch_main(batch_host, batch_user, batch_pass, workers, streams, manifest,
+        argc - optind, argv + optind);
+    trace_flush();
+    return status;
+  } else if (optind != argc) {
+    batch_usage();
+    exit(1);
+  }
+
   // find max line length
   if (LINE_MAX >= CMDLEN) {
     line_max = CMDLEN;
@@ -49,6 +121,7 @@ int main(void) {
   char *username;
   char *password;
   char *filename;
+  char *target;
 
   while (1) {
     printf("TigerC> ");
@@ -74,7 +147,7 @@ int main(void) {
     }
 
     // interpret the command
-    int err = parse_cmd(line, &cmd, &hostname, &username, &password, &filename);
+    int err = parse_cmd(line, &cmd, &hostname, &username, &password, &filename, &target);
     if (err) {
       // error parsing command, start the loop again
       continue;
@@ -90,16 +163,21 @@ int main(void) {
         continue;
       }
       // connect to the given server
+      conn_id++;
+      uint64_t trace_start = trace_begin();
       sockfd = open_conn(hostname);
       if (sockfd == -1) {
         fprintf(stdout, "Could not connect to server.\n");
         continue;
       }
+      trace_end("connect", trace_start, conn_id, hostname);
 
       // authenticate ourselves
+      trace_start = trace_begin();
       err = do_auth(sockfd, username, password);
+      trace_end("auth", trace_start, conn_id, username);
       if (err == 1) {
-        fprintf(stdout, "Incorrect username or password.\n");
+        fprintf(stdout, "Incorrect username or password, or the server is full.\n");
         close_conn(sockfd);
         continue;
       } else if (err == -1) {
@@ -108,18 +186,25 @@ int main(void) {
         continue;
       }
 
+      if (streams && mux_start(sockfd)) {
+        fprintf(stdout, "Could not switch to multiplexed mode.\n");
+        close_conn(sockfd);
+        continue;
+      }
+      muxed = streams > 0;
+
       // connected and authenticated successfully
       state = CONNECTED;
       printf("Connected successfully.\n");
 
-    // **** tget command
-    } else if (cmd == TGET) {
+    // **** tget and ttail commands
+    } else if (cmd == TGET || cmd == TTAIL) {
       if (state != CONNECTED) {
         fprintf(stdout, "You need to connect first.\n");
         continue;
       }
 
-      err = do_get(sockfd, filename);
+      err = do_get(sockfd, filename, cmd == TTAIL);
       if (err) {
         printf("Unable to complete get request.\n");
       }
@@ -136,11 +221,71 @@ int main(void) {
         printf("Unable to complete put request.\n");
       }
 
+    // **** tgetdir command
+    } else if (cmd == TGETDIR) {
+      if (state != CONNECTED) {
+        fprintf(stdout, "You need to connect first.\n");
+        continue;
+      }
+
+      err = do_getdir(sockfd, filename);
+      if (err) {
+        printf("Unable to complete getdir request.\n");
+      }
+
+    // **** tputdir command
+    } else if (cmd == TPUTDIR) {
+      if (state != CONNECTED) {
+        fprintf(stdout, "You need to connect first.\n");
+        continue;
+      }
+
+      err = do_putdir(sockfd, filename);
+      if (err) {
+        printf("Unable to complete putdir request.\n");
+      }
+
+    // **** tcopy and tmove commands
+    } else if (cmd == TCOPY || cmd == TMOVE) {
+      if (state != CONNECTED) {
+        fprintf(stdout, "You need to connect first.\n");
+        continue;
+      }
+
+      err = do_copy(sockfd, cmd == TCOPY ? COPY : MOVE, filename, target);
+      if (err) {
+        printf("Unable to complete %s request.\n", cmd == TCOPY ? "copy" : "move");
+      }
+
+    // **** tlist command
+    } else if (cmd == TLIST) {
+      if (state != CONNECTED) {
+        fprintf(stdout, "You need to connect first.\n");
+        continue;
+      }
+
+      err = do_list(sockfd, filename);
+      if (err) {
+        printf("Unable to complete list request.\n");
+      }
+
+    // **** tstats command
+    } else if (cmd == TSTATS) {
+      if (state != CONNECTED) {
+        fprintf(stdout, "You need to connect first.\n");
+        continue;
+      }
+
+      err = do_stats(sockfd);
+      if (err) {
+        printf("Unable to complete stats request.\n");
+      }
+
     // **** exit command
     } else if (cmd == EXIT) {
       // close down the client
       if (state == CONNECTED) {
-        err = send_close(sockfd);
+        err = muxed ? mux_end(sockfd) : send_close(sockfd);
         if (err) {
           fprintf(stderr, "Failed to close gracefully.\n");
         }
@@ -159,205 +304,94 @@ int main(void) {
   }
 
   // clean up input stuff and show message
+  trace_flush();
   free(line);
   printf("Quitting\n");
   return 0;
 }
 
-// connect to the given server
-// return: socket file descriptor
-// hostname: the hostname of the server to connect to
-int open_conn(char *hostname) {
-
-  int err;
-
-  // parse the hostname to get the addrinfo
-  struct addrinfo *hostinfo;
-
-  // hints tell getaddrinfo what kind of address we want
-  struct addrinfo hints = {0};
-  hints.ai_flags = 0;               // nothing special
-  hints.ai_family = AF_INET;        // IPv4
-  hints.ai_socktype = SOCK_STREAM;  // TCP
-  hints.ai_protocol = IPPROTO_TCP;  // TCP
-
-  err = getaddrinfo(hostname, STR(FTP_PORT), &hints, &hostinfo);
-  if (err) {
-    fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(err));
-    return -1;
-  }
-
-  // create a socket with the first address response
-  int sockfd = socket(hostinfo->ai_family, hostinfo->ai_socktype, hostinfo->ai_protocol);
-  if (sockfd == -1) {
-    fprintf(stderr, "socket: %s\n", strerror(errno));
-    return -1;
-  }
-
-  // connect to the specified server
-  err = connect(sockfd, hostinfo->ai_addr, hostinfo->ai_addrlen);
-  if (err) {
-    fprintf(stderr, "connect: %s\n", strerror(errno));
-    return -1;
-  }
-
-  freeaddrinfo(hostinfo);
-  
-  return sockfd;
-}
-
-// send an authentication request to the server
-// return: authentication result (-1 error, 0 success, 1 denied)
-// sockfd: socket file descriptor
-// user: username to try
-// pass: password to try
-int do_auth(int sockfd, char *user, char *pass) {
-
-  struct ftp_auth_request req = {0};
-  req.type = htonl(AUTH_REQ);
-  req.username_len = htonl(strlen(user));
-  req.password_len = htonl(strlen(pass));
-
-  int err;
-
-  err = send_all(sockfd, &req, sizeof(req));
-  if (err == -1) {
-    fprintf(stderr, "Error sending auth request.\n");
-    return -1;
-  }
-  send_all(sockfd, user, strlen(user));
-  if (err == -1) {
-    fprintf(stderr, "send: %s\n", strerror(errno));
-    return -1;
-  }
-  send_all(sockfd, pass, strlen(pass));
-  if (err == -1) {
-    fprintf(stderr, "send: %s\n", strerror(errno));
-    return -1;
-  }
-
-  struct ftp_auth_response resp = {0};
-  ssize_t received = recv(sockfd, &resp, sizeof(resp), MSG_WAITALL);
-  if (received == 0) {
-    fprintf(stderr, "Connection closed during authentication.\n");
-    return -1;
-  } else if (received == -1) {
-    fprintf(stderr, "recv: %s\n", strerror(errno));
-    return -1;
-  } else if ((size_t)received < sizeof(resp)) {
-    fprintf(stderr, "Not enough data received during authentication.\n");
-    return -1;
-  }
-
-  resp.type = ntohl(resp.type);
-
-  if (resp.type != AUTH_RESP) {
-    fprintf(stderr, "Sequence error: expected AUTH_RESP\n");
-    return -1;
-  }
-  resp.result = ntohl(resp.result);
-  if (resp.result == SUCCESS) {
-    return 0;
-  } else if (resp.result == FAILURE) {
-    return 1;
-  }
-  return -1;
-}
-
 // send a get request to the server
 // return: get result
 // filename: the filename to get from the server
-int do_get(int sockfd, char *filename) {
-  // make the get request
-  struct ftp_file_request req = {0};
-  req.type = htonl(GET);
-  req.filesize = htonl(0); // unknown
-  req.filename_len = htonl(strlen(filename));
-
-  int err = send_all(sockfd, &req, sizeof(req));
-  if (err == -1) {
-    fprintf(stderr, "Error sending get request.\n");
-    return -1;
-  }
-
-  err = send_all(sockfd, filename, strlen(filename));
-  if (err == -1) {
-    fprintf(stderr, "Error sending get filename.\n");
+// follow: if the file is being uploaded, receive the upload as it arrives
+int do_get(int sockfd, char *filename, int follow) {
+  if (muxed && follow) {
+    fprintf(stderr, "ttail isn't available on a multiplexed connection.\n");
     return -1;
   }
-
-  // get server response
-  struct ftp_file_response resp = {0};
-
-  ssize_t received = recv(sockfd, &resp, sizeof(resp), MSG_WAITALL);
-  if (received == 0) {
-    fprintf(stderr, "Connection closed during response.\n");
-    return -1;
-  } else if (received == -1) {
-    fprintf(stderr, "recv: %s\n", strerror(errno));
-    return -1;
-  } else if ((size_t)received < sizeof(resp)) {
-    fprintf(stderr, "Not enough data received during response.\n");
-    return -1;
+  if (muxed) {
+    return do_mux(sockfd, GET, filename);
   }
-
-  // check response results
-  resp.type = ntohl(resp.type);
-
-  if (resp.type != GET) {
-    fprintf(stderr, "Sequence error: expected GET\n");
-    return -1;
-  }
-
-  resp.result = ntohl(resp.result);
-  if (resp.result != SUCCESS) {
+  uint64_t trace_request = trace_begin();
+  uint64_t filesize;
+  int err = get_request(sockfd, filename, follow, &filesize);
+  if (err == 1) {
     fprintf(stderr, "Server failed to read file.\n");
+  }
+  if (err) {
     return -1;
   }
-  // get the file size
-  resp.filesize = ntohl(resp.filesize);
+  trace_end("request", trace_request, conn_id, filename);
 
   // create new file for writing
+  uint64_t trace_start = trace_begin();
   FILE *file = fopen(filename, "w");
   if (!file) {
     fprintf(stderr, "Failed to open requested file for writing.\n");
     return -1;
   }
+  trace_end("open", trace_start, conn_id, filename);
+  trace_start = trace_begin();
 
   char buf[512];
 
   size_t num_received = 0;
   int to_receive;
-  while (num_received < resp.filesize) {
+  while (num_received < filesize) {
     // determine how much to receive
-    if (resp.filesize - num_received >= sizeof(buf)) {
+    if (filesize - num_received >= sizeof(buf)) {
       to_receive = sizeof(buf);
     } else {
-      to_receive = resp.filesize - num_received;
+      to_receive = filesize - num_received;
     }
     // receive and write to the file
     ssize_t received = recv(sockfd, buf, to_receive, 0);
     if (received == 0) {
       fprintf(stderr, "Connection closed.\n");
-      return -1;
+      err = -1;
+      break;
     } else if (received == -1) {
       fprintf(stderr, "recv: %s\n", strerror(errno));
-      return -1;
+      err = -1;
+      break;
     }
     fwrite(buf, 1, received, file);
     if (ferror(file)) {
       fprintf(stderr, "fwrite: %s\n", strerror(errno));
-      return -1;
+      err = -1;
+      break;
     }
     num_received += received;
   }
+  if (err) {
+    fclose(file);
+    // a followed upload that failed leaves nothing that looks like the file
+    if (follow) {
+      unlink(filename);
+    }
+    return -1;
+  }
+  trace_end("recv", trace_start, conn_id, filename);
 
-  printf("File transfer completed.\n");
+  if (!quiet) {
+    printf("File transfer completed.\n");
+  }
   err = fclose(file);
   if (err) {
     fprintf(stderr, "fclose: %s\n", strerror(errno));
     return -1;
   }
+  trace_end("get", trace_request, conn_id, filename);
 
   return 0;
 }
@@ -366,6 +400,10 @@ int do_get(int sockfd, char *filename) {
 // return: put result
 // filename: the filename to upload to the server
 int do_put(int sockfd, char *filename) {
+  if (muxed) {
+    return do_mux(sockfd, PUT, filename);
+  }
+  uint64_t trace_request = trace_begin();
   // open the file to send
   FILE *file = fopen(filename, "r");
   if (!file) {
@@ -380,24 +418,33 @@ int do_put(int sockfd, char *filename) {
   if (err) {
     fprintf(stderr, "stat: %s\n", strerror(errno));
     // don't transfer if we can't determine size
+    fclose(file);
     return -1;
   }
   off_t filesize = stats.st_size;
+  trace_end("open", trace_request, conn_id, filename);
+  uint64_t trace_start = trace_begin();
+  size_t filename_len = strlen(filename);
+  if (filename_len > PATH_MAX) {
+    fprintf(stderr, "Filename too long.\n");
+    fclose(file);
+    return -1;
+  }
   // send file size in the PUT request
   struct ftp_file_request req = {0};
   req.type = htonl(PUT);
   req.filesize = htonl(filesize);
-  req.filename_len = htonl(strlen(filename));
-
-  err = send_all(sockfd, &req, sizeof(req));
+  req.filename_len = htonl(filename_len);
+
+  // header and filename in one send, so the second write doesn't wait for
+  // the ACK of the first
+  char msg[sizeof(req) + PATH_MAX];
+  memcpy(msg, &req, sizeof(req));
+  memcpy(msg + sizeof(req), filename, filename_len);
+  err = send_all(sockfd, msg, sizeof(req) + filename_len);
   if (err == -1) {
     fprintf(stderr, "Error sending put request.\n");
-    return -1;
-  }
-
-  err = send_all(sockfd, filename, strlen(filename));
-  if (err == -1) {
-    fprintf(stderr, "Error sending put filename.\n");
+    fclose(file);
     return -1;
   }
 
@@ -407,12 +454,15 @@ int do_put(int sockfd, char *filename) {
   ssize_t received = recv(sockfd, &resp, sizeof(resp), MSG_WAITALL);
   if (received == 0) {
     fprintf(stderr, "Connection closed during response.\n");
+    fclose(file);
     return -1;
   } else if (received == -1) {
     fprintf(stderr, "recv: %s\n", strerror(errno));
+    fclose(file);
     return -1;
   } else if ((size_t)received < sizeof(resp)) {
     fprintf(stderr, "Not enough data received during response.\n");
+    fclose(file);
     return -1;
   }
 
@@ -421,15 +471,19 @@ int do_put(int sockfd, char *filename) {
 
   if (resp.type != PUT) {
     fprintf(stderr, "Sequence error: expected PUT\n");
+    fclose(file);
     return -1;
   }
   resp.result = ntohl(resp.result);
   if (resp.result != SUCCESS) {
     fprintf(stderr, "Server failed to create file.\n");
+    fclose(file);
     return -1;
   }
+  trace_end("request", trace_start, conn_id, filename);
 
   // transmit the file to the server
+  trace_start = trace_begin();
   char buf[512];
 
   for (;;) {
@@ -438,11 +492,13 @@ int do_put(int sockfd, char *filename) {
       err = send_all(sockfd, buf, num_read);
       if (err == -1) {
         fprintf(stderr, "Error sending file data.\n");
+        fclose(file);
         return -1;
       } 
     } else {
       if (ferror(file)) {
         fprintf(stderr, "fread: %s\n", strerror(errno));
+        fclose(file);
         return -1;
       } else {
         // read 0 and no ferror, so we're finished
@@ -450,13 +506,406 @@ int do_put(int sockfd, char *filename) {
       }
     }
   }
-  printf("File transfer completed.\n");
+  trace_end("send", trace_start, conn_id, filename);
   // done sending file
   err = fclose(file);
   if (err) {
     fprintf(stderr, "fclose: %s\n", strerror(errno));
   }
 
+  // the server answers again once the file is in place
+  trace_start = trace_begin();
+  received = recv(sockfd, &resp, sizeof(resp), MSG_WAITALL);
+  if (received != sizeof(resp) || ntohl(resp.type) != PUT) {
+    fprintf(stderr, "Connection closed before the server confirmed the upload.\n");
+    return -1;
+  }
+  if (ntohl(resp.result) != SUCCESS) {
+    fprintf(stderr, "Server failed to save file.\n");
+    return -1;
+  }
+  trace_end("commit", trace_start, conn_id, filename);
+  if (!quiet) {
+    printf("File transfer completed.\n");
+  }
+  trace_end("put", trace_request, conn_id, filename);
+
+  return 0;
+}
+
+// hand out a single transfer to mux_run
+static int single_next(void *arg, enum ftp_req_type *type, char **filename, void **job) {
+  struct single_transfer *t = arg;
+  if (t->started) {
+    return 0;
+  }
+  t->started = 1;
+  *type = t->type;
+  *filename = t->filename;
+  *job = NULL;
+  return 1;
+}
+
+static void single_done(void *arg, void *job, int err) {
+  (void) job;
+  ((struct single_transfer *) arg)->err = err;
+}
+
+// run one transfer as a stream on a multiplexed connection
+// return: transfer result
+// type: GET or PUT
+// filename: the file to transfer
+int do_mux(int sockfd, enum ftp_req_type type, char *filename) {
+  struct single_transfer t = { type, filename, 0, -1 };
+  if (mux_run(sockfd, 1, single_next, single_done, &t)) {
+    return -1;
+  }
+  if (t.err == 0 && !quiet) {
+    printf("File transfer completed.\n");
+  }
+  return t.err;
+}
+
+// send a directory request and check the server's answer
+// return: 0 if the server is ready, -1 otherwise
+// type: GETDIR or PUTDIR
+// dirname: the directory to transfer
+static int dir_request(int sockfd, enum ftp_req_type type, char *dirname) {
+  if (muxed) {
+    fprintf(stderr, "Directories can't be transferred on a multiplexed connection.\n");
+    return -1;
+  }
+  struct ftp_file_request req = {0};
+  req.type = htonl(type);
+  req.filesize = htonl(0);
+  req.filename_len = htonl(strlen(dirname));
+
+  if (send_all(sockfd, &req, sizeof(req)) == -1 ||
+      send_all(sockfd, dirname, strlen(dirname)) == -1) {
+    fprintf(stderr, "Error sending directory request.\n");
+    return -1;
+  }
+
+  struct ftp_file_response resp = {0};
+  ssize_t received = recv(sockfd, &resp, sizeof(resp), MSG_WAITALL);
+  if (received == -1) {
+    fprintf(stderr, "recv: %s\n", strerror(errno));
+    return -1;
+  } else if ((size_t)received < sizeof(resp)) {
+    fprintf(stderr, "Connection closed during response.\n");
+    return -1;
+  }
+  if (ntohl(resp.type) != type) {
+    fprintf(stderr, "Sequence error: expected %s\n", type == GETDIR ? "GETDIR" : "PUTDIR");
+    return -1;
+  }
+  if (ntohl(resp.result) != SUCCESS) {
+    fprintf(stderr, type == GETDIR ? "Server failed to read directory.\n" :
+        "Server failed to create directory.\n");
+    return -1;
+  }
+  return 0;
+}
+
+// archive_io log hook, errors go to stderr like the rest of the client's
+static void log_stderr(const char *fmt, va_list args) {
+  vfprintf(stderr, fmt, args);
+  fputc('\n', stderr);
+}
+
+// download a directory tree from the server
+// return: getdir result
+// dirname: the directory to get, created here under the same name
+int do_getdir(int sockfd, char *dirname) {
+  uint64_t trace_request = trace_begin();
+  if (dir_request(sockfd, GETDIR, dirname)) {
+    return -1;
+  }
+
+  struct archive_io io = { sockfd, NULL, NULL, log_stderr, 0, 0, 0, NULL, 0, NULL };
+  int err = archive_recv(&io, dirname);
+  if (err) {
+    return -1;
+  }
+  if (!quiet) {
+    printf("Received %llu files, %llu bytes.\n", (unsigned long long) io.files,
+        (unsigned long long) io.bytes);
+  }
+  if (io.failed) {
+    fprintf(stderr, "%d files couldn't be transferred.\n", io.failed);
+    return -1;
+  }
+  trace_end("getdir", trace_request, conn_id, dirname);
+  return 0;
+}
+
+// upload a directory tree to the server
+// return: putdir result
+// dirname: the local directory, created on the server under the same name
+int do_putdir(int sockfd, char *dirname) {
+  uint64_t trace_request = trace_begin();
+  struct stat stats;
+  if (stat(dirname, &stats) || !S_ISDIR(stats.st_mode)) {
+    fprintf(stderr, "%s is not a directory.\n", dirname);
+    return -1;
+  }
+  if (dir_request(sockfd, PUTDIR, dirname)) {
+    return -1;
+  }
+
+  struct archive_io io = { sockfd, NULL, NULL, log_stderr, 0, 0, 0, NULL, 0, NULL };
+  int err = archive_send(&io, dirname);
+  if (err) {
+    return -1;
+  }
+
+  // the server answers again once everything is on its disk
+  struct ftp_file_response resp = {0};
+  ssize_t received = recv(sockfd, &resp, sizeof(resp), MSG_WAITALL);
+  if (received != sizeof(resp) || ntohl(resp.type) != PUTDIR) {
+    fprintf(stderr, "Connection closed during response.\n");
+    return -1;
+  }
+  if (!quiet) {
+    printf("Sent %llu files, %llu bytes.\n", (unsigned long long) io.files,
+        (unsigned long long) io.bytes);
+  }
+  if (io.failed) {
+    fprintf(stderr, "%d files couldn't be read.\n", io.failed);
+  }
+  if (ntohl(resp.result) != SUCCESS) {
+    fprintf(stderr, "Server failed to write some files.\n");
+    return -1;
+  }
+  if (io.failed) {
+    return -1;
+  }
+  trace_end("putdir", trace_request, conn_id, dirname);
+  return 0;
+}
+
+// copy or move a file on the server, without transferring it
+// return: copy result
+// type: COPY or MOVE
+// src: the file to copy or move
+// dst: its new name
+int do_copy(int sockfd, enum ftp_req_type type, char *src, char *dst) {
+  if (muxed) {
+    fprintf(stderr, "Copies aren't available on a multiplexed connection.\n");
+    return -1;
+  }
+  size_t src_len = strlen(src);
+  size_t dst_len = strlen(dst);
+  if (src_len > PATH_MAX || dst_len > PATH_MAX) {
+    fprintf(stderr, "Filename too long.\n");
+    return -1;
+  }
+  // header, source, NUL, destination in one send
+  char msg[sizeof(struct ftp_file_request) + 2 * PATH_MAX + 1];
+  struct ftp_file_request req = {0};
+  req.type = htonl(type);
+  req.filesize = htonl(0);
+  req.filename_len = htonl(src_len + 1 + dst_len);
+  memcpy(msg, &req, sizeof(req));
+  memcpy(msg + sizeof(req), src, src_len + 1);
+  memcpy(msg + sizeof(req) + src_len + 1, dst, dst_len);
+  if (send_all(sockfd, msg, sizeof(req) + src_len + 1 + dst_len) == -1) {
+    fprintf(stderr, "Error sending %s request.\n", type == COPY ? "copy" : "move");
+    return -1;
+  }
+
+  struct ftp_file_response resp = {0};
+  ssize_t received = recv(sockfd, &resp, sizeof(resp), MSG_WAITALL);
+  if (received == -1) {
+    fprintf(stderr, "recv: %s\n", strerror(errno));
+    return -1;
+  } else if ((size_t)received < sizeof(resp)) {
+    fprintf(stderr, "Connection closed during response.\n");
+    return -1;
+  }
+  if (ntohl(resp.type) != type) {
+    fprintf(stderr, "Sequence error: expected %s\n", type == COPY ? "COPY" : "MOVE");
+    return -1;
+  }
+  if (ntohl(resp.result) != SUCCESS) {
+    fprintf(stderr, "Server failed to %s file.\n", type == COPY ? "copy" : "move");
+    return -1;
+  }
+  if (!quiet) {
+    printf("%s %s to %s.\n", type == COPY ? "Copied" : "Moved", src, dst);
+  }
+  return 0;
+}
+
+// list the files on the server, a page at a time
+// return: list result
+// prefix: only files whose names start with this, "" for all
+int do_list(int sockfd, char *prefix) {
+  if (muxed) {
+    fprintf(stderr, "Listing isn't available on a multiplexed connection.\n");
+    return -1;
+  }
+  size_t prefix_len = strlen(prefix);
+  if (prefix_len > PATH_MAX) {
+    fprintf(stderr, "Prefix too long.\n");
+    return -1;
+  }
+  // the request header, prefix, NUL, then the last name printed, all in
+  // one send
+  char msg[sizeof(struct ftp_file_request) + 2 * PATH_MAX + 2];
+  char *request = msg + sizeof(struct ftp_file_request);
+  memcpy(request, prefix, prefix_len);
+  size_t request_len = prefix_len;
+  uint64_t total = 0;
+  int more = 1;
+  while (more) {
+    struct ftp_file_request req = {0};
+    req.type = htonl(LIST);
+    req.filesize = htonl(LIST_PAGE);
+    req.filename_len = htonl(request_len);
+    memcpy(msg, &req, sizeof(req));
+    if (send_all(sockfd, msg, sizeof(req) + request_len) == -1) {
+      fprintf(stderr, "Error sending list request.\n");
+      return -1;
+    }
+
+    struct ftp_file_response resp = {0};
+    ssize_t received = recv(sockfd, &resp, sizeof(resp), MSG_WAITALL);
+    if (received == -1) {
+      fprintf(stderr, "recv: %s\n", strerror(errno));
+      return -1;
+    } else if ((size_t)received < sizeof(resp)) {
+      fprintf(stderr, "Connection closed during response.\n");
+      return -1;
+    }
+    if (ntohl(resp.type) != LIST) {
+      fprintf(stderr, "Sequence error: expected LIST\n");
+      return -1;
+    }
+    if (ntohl(resp.result) != SUCCESS) {
+      fprintf(stderr, "Server failed to list files.\n");
+      return -1;
+    }
+    size_t size = ntohl(resp.filesize);
+    if (size < sizeof(struct list_header)) {
+      fprintf(stderr, "Bad listing from server.\n");
+      return -1;
+    }
+    char *page = malloc(size);
+    if (page == NULL) {
+      fprintf(stderr, "Out of memory.\n");
+      return -1;
+    }
+    if (recv(sockfd, page, size, MSG_WAITALL) != (ssize_t) size) {
+      fprintf(stderr, "Connection closed during listing.\n");
+      free(page);
+      return -1;
+    }
+
+    struct list_header header;
+    memcpy(&header, page, sizeof(header));
+    uint32_t count = ntohl(header.count);
+    more = ntohl(header.more);
+    size_t pos = sizeof(header);
+    for (uint32_t i = 0; i < count; i++) {
+      struct list_entry entry;
+      if (pos + sizeof(entry) > size) {
+        break;
+      }
+      memcpy(&entry, page + pos, sizeof(entry));
+      pos += sizeof(entry);
+      size_t name_len = ntohl(entry.name_len);
+      if (name_len > PATH_MAX || pos + name_len > size) {
+        break;
+      }
+      time_t mtime = (time_t) be64toh(entry.mtime_sec);
+      char when[32];
+      strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&mtime));
+      printf("%12llu  %s  %.*s\n", (unsigned long long) be64toh(entry.size), when,
+          (int) name_len, page + pos);
+      // the next page starts after this name
+      request[prefix_len] = '\0';
+      memcpy(request + prefix_len + 1, page + pos, name_len);
+      request_len = prefix_len + 1 + name_len;
+      pos += name_len;
+      total++;
+    }
+    free(page);
+    if (pos != size) {
+      fprintf(stderr, "Bad listing from server.\n");
+      return -1;
+    }
+  }
+  if (!quiet) {
+    printf("%llu files.\n", (unsigned long long) total);
+  }
+  return 0;
+}
+
+// ask the server for its metrics and print them
+// return: stats result
+int do_stats(int sockfd) {
+  if (muxed) {
+    fprintf(stderr, "Stats aren't available on a multiplexed connection.\n");
+    return -1;
+  }
+  struct ftp_file_request req = {0};
+  req.type = htonl(STATS);
+  req.filesize = htonl(0);
+  req.filename_len = htonl(0);
+
+  int err = send_all(sockfd, &req, sizeof(req));
+  if (err == -1) {
+    fprintf(stderr, "Error sending stats request.\n");
+    return -1;
+  }
+
+  // get server response
+  struct ftp_file_response resp = {0};
+
+  ssize_t received = recv(sockfd, &resp, sizeof(resp), MSG_WAITALL);
+  if (received == 0) {
+    fprintf(stderr, "Connection closed during response.\n");
+    return -1;
+  } else if (received == -1) {
+    fprintf(stderr, "recv: %s\n", strerror(errno));
+    return -1;
+  } else if ((size_t)received < sizeof(resp)) {
+    fprintf(stderr, "Not enough data received during response.\n");
+    return -1;
+  }
+
+  resp.type = ntohl(resp.type);
+  if (resp.type != STATS) {
+    fprintf(stderr, "Sequence error: expected STATS\n");
+    return -1;
+  }
+  resp.result = ntohl(resp.result);
+  if (resp.result != SUCCESS) {
+    fprintf(stderr, "Server failed to collect stats.\n");
+    return -1;
+  }
+  resp.filesize = ntohl(resp.filesize);
+
+  // the text goes straight to stdout
+  char buf[512];
+  size_t num_received = 0;
+  while (num_received < resp.filesize) {
+    size_t to_receive = resp.filesize - num_received;
+    if (to_receive > sizeof(buf)) {
+      to_receive = sizeof(buf);
+    }
+    ssize_t received = recv(sockfd, buf, to_receive, 0);
+    if (received == 0) {
+      fprintf(stderr, "Connection closed.\n");
+      return -1;
+    } else if (received == -1) {
+      fprintf(stderr, "recv: %s\n", strerror(errno));
+      return -1;
+    }
+    fwrite(buf, 1, received, stdout);
+    num_received += received;
+  }
   return 0;
 }
 
@@ -468,8 +917,9 @@ int do_put(int sockfd, char *filename) {
 // username: set to the provided username, if any
 // password: set to the provided password, if any
 // filename: set to the provided filename, if any
+// target: set to the second filename of tcopy and tmove
 int parse_cmd(char *line, enum ftp_command *cmd, char **hostname,
-    char **username, char **password, char **filename) {
+    char **username, char **password, char **filename, char **target) {
 
   // Parse the line. First, separate the command.
   static char *strtok_state;
@@ -521,6 +971,16 @@ int parse_cmd(char *line, enum ftp_command *cmd, char **hostname,
       fprintf(stdout, "tget requires a filename.\n");
       return -1;
     }
+  } else if (strcmp(token, "ttail") == 0) {
+    // ttail command, a tget that follows an upload in progress
+    *cmd = TTAIL;
+    token = strtok_r(NULL, "\n", &strtok_state);
+    if (token) {
+      *filename = token;
+    } else {
+      fprintf(stdout, "ttail requires a filename.\n");
+      return -1;
+    }
   } else if (strcmp(token, "tput") == 0) {
     // tput command, print the filename
     *cmd = TPUT;
@@ -531,6 +991,35 @@ int parse_cmd(char *line, enum ftp_command *cmd, char **hostname,
       fprintf(stdout, "tput requires a filename.\n");
       return -1;
     }
+  } else if (strcmp(token, "tgetdir") == 0 || strcmp(token, "tputdir") == 0) {
+    // directory transfer, the rest of the line is the directory
+    *cmd = strcmp(token, "tgetdir") == 0 ? TGETDIR : TPUTDIR;
+    char *name = token;
+    token = strtok_r(NULL, "\n", &strtok_state);
+    if (token) {
+      *filename = token;
+    } else {
+      fprintf(stdout, "%s requires a directory.\n", name);
+      return -1;
+    }
+  } else if (strcmp(token, "tcopy") == 0 || strcmp(token, "tmove") == 0) {
+    // server-side copy or move, two filenames without spaces
+    *cmd = strcmp(token, "tcopy") == 0 ? TCOPY : TMOVE;
+    char *name = token;
+    *filename = strtok_r(NULL, " \n", &strtok_state);
+    *target = strtok_r(NULL, " \n", &strtok_state);
+    if (*filename == NULL || *target == NULL) {
+      fprintf(stdout, "%s requires a source and a destination.\n", name);
+      return -1;
+    }
+  } else if (strcmp(token, "tlist") == 0) {
+    // tlist command, the rest of the line is an optional prefix
+    *cmd = TLIST;
+    token = strtok_r(NULL, "\n", &strtok_state);
+    *filename = token ? token : "";
+  } else if (strcmp(token, "tstats") == 0) {
+    // tstats command, no arguments
+    *cmd = TSTATS;
   } else if (strcmp(token, "exit") == 0) {
     // exit command
     *cmd = EXIT;
@@ -543,9 +1032,33 @@ int parse_cmd(char *line, enum ftp_command *cmd, char **hostname,
 // print usage message
 void usage(void) {
   printf("Commands:\n");
-  printf("  tconnect <ip> <user> <pass>\n");
+  printf("  tconnect <ip>[:port] <user> <pass>\n");
   printf("  tget <filename>\n");
+  printf("  ttail <filename>\n");
   printf("  tput <filename>\n");
+  printf("  tgetdir <directory>\n");
+  printf("  tputdir <directory>\n");
+  printf("  tcopy <source> <destination>\n");
+  printf("  tmove <source> <destination>\n");
+  printf("  tlist [prefix]\n");
+  printf("  tstats\n");
   printf("  help\n");
 }
 
+// print command line usage
+void batch_usage(void) {
+  fprintf(stderr, "Usage: TigerC [-T tracefile] [-s] [-A cafile]\n");
+  fprintf(stderr, "       TigerC [-T tracefile] [-s] [-A cafile] -b <host> [options] [tget|ttail|tput <file>]...\n");
+  fprintf(stderr, "  -s             encrypt connections with TLS, trusting the system's CAs\n");
+  fprintf(stderr, "  -A <file>      encrypt connections with TLS, trusting the CAs in this PEM file\n");
+  fprintf(stderr, "  -b <host>      batch mode: run the transfers on parallel connections and exit\n");
+  fprintf(stderr, "  -u <user>      username (default user)\n");
+  fprintf(stderr, "  -p <pass>      password (default pass)\n");
+  fprintf(stderr, "  -j <count>     worker connections (default %d)\n", BATCH_WORKERS);
+  fprintf(stderr, "  -f <file>      manifest of tget/ttail/tput lines, - for stdin\n");
+  fprintf(stderr, "  -x <streams>   run up to this many transfers at once on each connection,\n");
+  fprintf(stderr, "                 smallest first (also multiplexes the prompt's connection);\n");
+  fprintf(stderr, "                 not with ttail\n");
+  fprintf(stderr, "  exit status is 0 if every transfer worked, 2 if any failed, 1 on other errors\n");
+}
+
@@ -1,17 +1,39 @@
 #ifndef CLIENT_H
 #define CLIENT_H
 
+#include <stdint.h>
+#include "clientlib.h"
+#include "common.h"
+
+#define CMDLEN 255
+
 enum ftp_state { IDLE, CONNECTED };
-enum ftp_command { TCONNECT, TGET, TPUT, EXIT };
+enum ftp_command { TCONNECT, TGET, TTAIL, TPUT, TGETDIR, TPUTDIR, TLIST, TCOPY, TMOVE, TSTATS, EXIT };
 
-int open_conn(char *host);
-int do_auth(int sockfd, char *user, char *pass);
-int do_get(int sockfd, char *filename);
+// the one transfer do_mux hands to mux_run
+struct single_transfer {
+  enum ftp_req_type type;
+  char *filename;
+  int started;
+  int err;
+};
+
+int do_get(int sockfd, char *filename, int follow);
 int do_put(int sockfd, char *filename);
+int do_mux(int sockfd, enum ftp_req_type type, char *filename);
+int do_getdir(int sockfd, char *dirname);
+int do_putdir(int sockfd, char *dirname);
+int do_list(int sockfd, char *prefix);
+int do_copy(int sockfd, enum ftp_req_type type, char *src, char *dst);
+int do_stats(int sockfd);
 int close_conn(int sockfd);
 int parse_cmd(char *line, enum ftp_command *cmd, char **hostname,
-    char **username, char **password, char **filename);
+    char **username, char **password, char **filename, char **target);
 void usage(void);
+void batch_usage(void);
+
+extern __thread uint64_t conn_id;
+extern __thread int muxed;
 
 #endif
 
@@ -0,0 +1,212 @@
+#include <arpa/inet.h>
+#include <endian.h>
+#include <errno.h>
+#include <limits.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "clientlib.h"
+#include "common.h"
+#include "tls.h"
+
+// Connecting, logging in and asking for a file, shared by TigerC and by
+// TigerS when it relays misses to an upstream server. Errors go to stderr
+// like the rest of the client.
+
+// connect to the given server
+// return: socket file descriptor
+// host: the hostname of the server to connect to, optionally with :port
+int open_conn(char *host) {
+
+  int err;
+
+  // split off the port, if any
+  char name[256];
+  char *port = STR(FTP_PORT);
+  char *colon = strrchr(host, ':');
+  size_t name_len = colon ? (size_t) (colon - host) : strlen(host);
+  if (name_len >= sizeof(name)) {
+    fprintf(stderr, "Host name too long.\n");
+    return -1;
+  }
+  memcpy(name, host, name_len);
+  name[name_len] = '\0';
+  if (colon) {
+    port = colon + 1;
+  }
+
+  // parse the hostname to get the addrinfo
+  struct addrinfo *hostinfo;
+
+  // hints tell getaddrinfo what kind of address we want
+  struct addrinfo hints = {0};
+  hints.ai_flags = 0;               // nothing special
+  hints.ai_family = AF_INET;        // IPv4
+  hints.ai_socktype = SOCK_STREAM;  // TCP
+  hints.ai_protocol = IPPROTO_TCP;  // TCP
+
+  err = getaddrinfo(name, port, &hints, &hostinfo);
+  if (err) {
+    fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(err));
+    return -1;
+  }
+
+  // create a socket with the first address response
+  int sockfd = socket(hostinfo->ai_family, hostinfo->ai_socktype, hostinfo->ai_protocol);
+  if (sockfd == -1) {
+    fprintf(stderr, "socket: %s\n", strerror(errno));
+    freeaddrinfo(hostinfo);
+    return -1;
+  }
+
+  // connect to the specified server
+  err = connect(sockfd, hostinfo->ai_addr, hostinfo->ai_addrlen);
+  if (err) {
+    fprintf(stderr, "connect: %s\n", strerror(errno));
+    freeaddrinfo(hostinfo);
+    close(sockfd);
+    return -1;
+  }
+
+  freeaddrinfo(hostinfo);
+
+  if (tls_client_enabled()) {
+    // the password and payloads are encrypted from the first byte
+    int offloaded;
+    int conn = tls_connect(sockfd, name, &offloaded);
+    if (conn == -1) {
+      close(sockfd);
+    }
+    return conn;
+  }
+
+  return sockfd;
+}
+
+// send an authentication request to the server
+// return: authentication result (-1 error, 0 success, 1 denied or server full)
+// sockfd: socket file descriptor
+// user: username to try
+// pass: password to try
+int do_auth(int sockfd, char *user, char *pass) {
+
+  size_t user_len = strlen(user);
+  size_t pass_len = strlen(pass);
+  if (user_len > MAX_NAME_LEN || pass_len > MAX_NAME_LEN) {
+    fprintf(stderr, "Username or password too long.\n");
+    return -1;
+  }
+  struct ftp_auth_request req = {0};
+  req.type = htonl(AUTH_REQ);
+  req.username_len = htonl(user_len);
+  req.password_len = htonl(pass_len);
+
+  // header, username and password in one send
+  char msg[sizeof(req) + 2 * MAX_NAME_LEN];
+  memcpy(msg, &req, sizeof(req));
+  memcpy(msg + sizeof(req), user, user_len);
+  memcpy(msg + sizeof(req) + user_len, pass, pass_len);
+  int err = send_all(sockfd, msg, sizeof(req) + user_len + pass_len);
+  if (err == -1) {
+    fprintf(stderr, "Error sending auth request.\n");
+    return -1;
+  }
+
+  struct ftp_auth_response resp = {0};
+  ssize_t received = recv(sockfd, &resp, sizeof(resp), MSG_WAITALL);
+  if (received == 0) {
+    fprintf(stderr, "Connection closed during authentication.\n");
+    return -1;
+  } else if (received == -1) {
+    fprintf(stderr, "recv: %s\n", strerror(errno));
+    return -1;
+  } else if ((size_t)received < sizeof(resp)) {
+    fprintf(stderr, "Not enough data received during authentication.\n");
+    return -1;
+  }
+
+  resp.type = ntohl(resp.type);
+
+  if (resp.type != AUTH_RESP) {
+    fprintf(stderr, "Sequence error: expected AUTH_RESP\n");
+    return -1;
+  }
+  resp.result = ntohl(resp.result);
+  if (resp.result == SUCCESS) {
+    return 0;
+  } else if (resp.result == FAILURE) {
+    return 1;
+  }
+  return -1;
+}
+
+// send a get request, leaving the connection at the start of the file data
+// return: 0 if the file follows, 1 if the server refused, -1 on error
+// sockfd: socket file descriptor
+// filename: the filename to get from the server
+// follow: stream an upload of the file still in progress (see GET_FOLLOW)
+// filesize: set to the size of the data that follows
+int get_request(int sockfd, char *filename, int follow, uint64_t *filesize) {
+  size_t filename_len = strlen(filename);
+  if (filename_len > PATH_MAX) {
+    fprintf(stderr, "Filename too long.\n");
+    return -1;
+  }
+  struct ftp_file_request req = {0};
+  req.type = htonl(GET);
+  req.filesize = htonl(follow ? GET_FOLLOW : 0); // the size is unknown
+  req.filename_len = htonl(filename_len);
+
+  // header and filename in one send
+  char msg[sizeof(req) + PATH_MAX];
+  memcpy(msg, &req, sizeof(req));
+  memcpy(msg + sizeof(req), filename, filename_len);
+  int err = send_all(sockfd, msg, sizeof(req) + filename_len);
+  if (err == -1) {
+    fprintf(stderr, "Error sending get request.\n");
+    return -1;
+  }
+
+  // get server response
+  struct ftp_file_response resp = {0};
+
+  ssize_t received = recv(sockfd, &resp, sizeof(resp), MSG_WAITALL);
+  if (received == 0) {
+    fprintf(stderr, "Connection closed during response.\n");
+    return -1;
+  } else if (received == -1) {
+    fprintf(stderr, "recv: %s\n", strerror(errno));
+    return -1;
+  } else if ((size_t)received < sizeof(resp)) {
+    fprintf(stderr, "Not enough data received during response.\n");
+    return -1;
+  }
+
+  // check response results
+  resp.type = ntohl(resp.type);
+
+  if (resp.type != GET) {
+    fprintf(stderr, "Sequence error: expected GET\n");
+    return -1;
+  }
+
+  resp.result = ntohl(resp.result);
+  if (resp.result != SUCCESS) {
+    return 1;
+  }
+  *filesize = ntohl(resp.filesize);
+  if (follow) {
+    // the whole size, which may not fit in filesize
+    uint64_t size;
+    received = recv(sockfd, &size, sizeof(size), MSG_WAITALL);
+    if (received != sizeof(size)) {
+      fprintf(stderr, "Not enough data received during response.\n");
+      return -1;
+    }
+    *filesize = be64toh(size);
+  }
+  return 0;
+}
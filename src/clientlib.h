@@ -0,0 +1,10 @@
+#ifndef CLIENTLIB_H
+#define CLIENTLIB_H
+
+#include <stdint.h>
+
+int open_conn(char *host);
+int do_auth(int sockfd, char *user, char *pass);
+int get_request(int sockfd, char *filename, int follow, uint64_t *filesize);
+
+#endif
@@ -1,11 +1,23 @@
 #include <arpa/inet.h>
+#include <endian.h>
 #include <errno.h>
+#include <linux/errqueue.h>
+#include <poll.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
 #include <unistd.h>
 #include "common.h"
 
+// monotonic clock in nanoseconds, for timeouts, rates and latencies
+uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
 // keep calling send until finished or error
 // return: -1 on error, bytes sent otherwise
 // sockfd: socket file descriptor
@@ -25,6 +37,123 @@ int send_all(int sockfd, void *buf, int len) {
   return sent;
 }
 
+// set up zerocopy sends on a socket; where the socket doesn't support
+// them (not TCP, or an old kernel) send_all_zc just copies
+// zc: state for the socket, one per socket
+// sockfd: socket file descriptor
+void zc_init(struct zc_sock *zc, int sockfd) {
+  int one = 1;
+  zc->fd = sockfd;
+  zc->on = setsockopt(sockfd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0;
+  zc->next = 0;
+  zc->done = 0;
+}
+
+// read whatever completions are queued, without waiting
+// return: number of notifications read
+static int zc_reap(struct zc_sock *zc) {
+  int found = 0;
+  for (;;) {
+    char ctrl[CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in6))];
+    struct msghdr msg = {0};
+    msg.msg_control = ctrl;
+    msg.msg_controllen = sizeof(ctrl);
+    if (recvmsg(zc->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1) {
+      return found;
+    }
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if (!((cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) ||
+            (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR))) {
+        continue;
+      }
+      struct sock_extended_err *err = (struct sock_extended_err *) CMSG_DATA(cmsg);
+      if (err->ee_origin != SO_EE_ORIGIN_ZEROCOPY || err->ee_errno != 0) {
+        continue;
+      }
+      // TCP completes sends in order, so a range [ee_info, ee_data] done
+      // means everything up to ee_data is
+      if ((int32_t) (err->ee_data + 1 - zc->done) > 0) {
+        zc->done = err->ee_data + 1;
+      }
+      if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+        // the device (or loopback) needed a copy after all, so pinning
+        // the pages only added work; copy up front from now on
+        zc->on = 0;
+      }
+      found++;
+    }
+  }
+}
+
+// send like send_all, without copying big buffers into the kernel
+// return: -1 on error, bytes sent otherwise
+// zc: the socket's state from zc_init
+// buf: the data to send, left alone until zc_wait(zc, zc->next) afterwards
+// len: length of the data
+int send_all_zc(struct zc_sock *zc, void *buf, int len) {
+  if (!zc->on || len < ZEROCOPY_MIN) {
+    return send_all(zc->fd, buf, len);
+  }
+  int sent = 0;
+  while (len > 0) {
+    int n = send(zc->fd, buf + sent, len, MSG_ZEROCOPY);
+    if (n == -1 && errno == ENOBUFS) {
+      // out of memory for notifications: collect some, copy this piece
+      zc_reap(zc);
+      n = send(zc->fd, buf + sent, len, 0);
+    } else if (n > 0) {
+      zc->next++;
+    }
+    if (n == -1) {
+      fprintf(stderr, "send: %s\n", strerror(errno));
+      return -1;
+    }
+    sent += n;
+    len -= n;
+  }
+  return sent;
+}
+
+// wait until the kernel is done with the buffers of earlier zerocopy sends,
+// as long as the socket's send timeout
+// return: 0 once they're free, -1 on error or timeout (errno is set)
+// zc: the socket's state from zc_init
+// mark: zc->next just after the last send whose buffer is wanted back
+int zc_wait(struct zc_sock *zc, uint32_t mark) {
+  if ((int32_t) (mark - zc->done) <= 0) {
+    return 0;
+  }
+  struct timeval tv = {0};
+  socklen_t tv_len = sizeof(tv);
+  getsockopt(zc->fd, SOL_SOCKET, SO_SNDTIMEO, &tv, &tv_len);
+  int timeout = tv.tv_sec || tv.tv_usec ? tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000 : -1;
+  while ((int32_t) (mark - zc->done) > 0) {
+    if (zc_reap(zc)) {
+      continue;
+    }
+    // the error queue having something sets POLLERR
+    struct pollfd pfd = { zc->fd, 0, 0 };
+    int n = poll(&pfd, 1, timeout);
+    if (n == 0) {
+      errno = EAGAIN;
+      return -1;
+    }
+    if (n == -1 && errno != EINTR) {
+      return -1;
+    }
+    if ((pfd.revents & (POLLERR | POLLHUP)) && zc_reap(zc) == 0) {
+      // the connection failed; the kernel holds its own references to the
+      // pages, so the buffers can still be freed safely
+      int err = 0;
+      socklen_t err_len = sizeof(err);
+      getsockopt(zc->fd, SOL_SOCKET, SO_ERROR, &err, &err_len);
+      errno = err ? err : EPIPE;
+      return -1;
+    }
+  }
+  return 0;
+}
+
 int send_close(int sockfd) {
   struct ftp_file_request req = {0};
   req.type = htonl(END);
@@ -50,3 +179,21 @@ int close_conn(int sockfd) {
   return 0;
 }
 
+
+// convert a frame header to network byte order
+void mux_hton(struct mux_frame *frame) {
+  frame->type = htonl(frame->type);
+  frame->stream = htonl(frame->stream);
+  frame->result = htonl(frame->result);
+  frame->len = htonl(frame->len);
+  frame->size = htobe64(frame->size);
+}
+
+// convert a frame header to host byte order
+void mux_ntoh(struct mux_frame *frame) {
+  frame->type = ntohl(frame->type);
+  frame->stream = ntohl(frame->stream);
+  frame->result = ntohl(frame->result);
+  frame->len = ntohl(frame->len);
+  frame->size = be64toh(frame->size);
+}
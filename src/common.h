@@ -1,12 +1,19 @@
 #ifndef COMMON_H
 #define COMMON_H
 
+#include <stdint.h>
+
 #define STR_X(x) #x
 #define STR(x) STR_X(x)
 
 #define FTP_PORT 2100
 
-enum ftp_req_type { AUTH_REQ = 0x01, AUTH_RESP = 0x02, GET = 0x03, PUT = 0x04, END = 0x05 };
+// longest username, password or filename a server accepts
+#define MAX_NAME_LEN 4096
+
+enum ftp_req_type { AUTH_REQ = 0x01, AUTH_RESP = 0x02, GET = 0x03, PUT = 0x04, END = 0x05,
+  STATS = 0x06, MUX = 0x07, GETDIR = 0x08, PUTDIR = 0x09, LIST = 0x0A,
+  COPY = 0x0B, MOVE = 0x0C };
 
 struct ftp_auth_request {
   enum ftp_req_type type;
@@ -20,7 +27,7 @@ struct ftp_file_request {
   size_t filename_len;
 };
 
-enum ftp_result { SUCCESS = 0x01, FAILURE = 0x02, UNKNOWN = 0x03 };
+enum ftp_result { SUCCESS = 0x01, FAILURE = 0x02, UNKNOWN = 0x03, BUSY = 0x04 };
 
 struct ftp_auth_response {
   enum ftp_req_type type;
@@ -33,7 +40,90 @@ struct ftp_file_response {
   size_t filesize;
 };
 
+// A GET request's filesize is 0, or GET_FOLLOW to follow an upload of the
+// file that is still in progress: the response's filesize is the size
+// being uploaded and the data is sent as it arrives. If the upload fails
+// the server closes the connection. With no upload in progress it's an
+// ordinary GET. A successful response to GET_FOLLOW is followed by the
+// size again as a 64-bit big-endian integer, since the filesize field only
+// carries 32 bits.
+#define GET_FOLLOW 1
+
+// COPY and MOVE requests' filename is the source, a NUL, then the
+// destination; the response's filesize is the number of bytes the server
+// had to copy (0 for a rename or a reflink).
+
+// A LIST request's filename is a prefix to match, optionally followed by a
+// NUL and the last name of the previous page; filesize is the most entries
+// wanted, 0 for LIST_PAGE. The response's filesize is the length of what
+// follows: a list_header, then count list_entry headers each followed by
+// name_len bytes of name, in name order. 64-bit fields are big-endian.
+#define LIST_PAGE 1000
+#define LIST_PAGE_MAX 10000
+
+struct list_header {
+  uint32_t count;
+  uint32_t more;   // another page would follow
+};
+
+struct list_entry {
+  uint64_t size;
+  int64_t mtime_sec;
+  uint32_t mtime_nsec;
+  uint32_t name_len;
+};
+
+// After a successful MUX request the session carries frames instead: every
+// frame is a mux_frame header followed by len payload bytes. Streams are
+// numbered by the client; each side may send at most the other side's
+// window of DATA bytes per stream, and grants more with WINDOW frames.
+#define MUX_CHUNK 16384               // largest DATA payload
+#define MUX_WINDOW_INIT (256 * 1024)  // credit each stream starts with
+#define MUX_MAX_STREAMS 64            // open streams per session
+#define MUX_LOWAT (4 * MUX_CHUNK)     // unsent bytes either side leaves in the kernel
+
+enum mux_frame_type {
+  MUX_GET = 0x01,    // client: open a download, payload is the filename
+  MUX_PUT = 0x02,    // client: open an upload of size bytes, payload is the filename
+  MUX_RESP = 0x03,   // server: result of GET/PUT, size is the file size for GET
+  MUX_DATA = 0x04,   // file bytes
+  MUX_WINDOW = 0x05, // size more bytes may be sent on the stream
+  MUX_DONE = 0x06,   // server: result of a finished (or failed) upload
+  MUX_RESET = 0x07,  // abort a stream
+  MUX_END = 0x08     // client: end of session
+};
+
+struct mux_frame {
+  uint32_t type;
+  uint32_t stream;
+  uint32_t result;
+  uint32_t len;
+  uint64_t size;
+};
+
+// sends from user-space buffers at least this big skip the kernel's copy
+// (MSG_ZEROCOPY); below it pinning the pages and reading the completion
+// costs more than copying
+#define ZEROCOPY_MIN (16 * 1024)
+
+// zerocopy sends on one socket. A buffer passed to send_all_zc must not be
+// changed or freed until zc_wait for the value of next just after the send
+// returns: the kernel sends straight from its pages and reports on the
+// socket's error queue once it no longer needs them.
+struct zc_sock {
+  int fd;
+  int on;          // MSG_ZEROCOPY in use
+  uint32_t next;   // number of the next zerocopy send
+  uint32_t done;   // every send numbered below this has completed
+};
+
+uint64_t now_ns(void);
 int send_all(int sockfd, void *buf, int len);
+void zc_init(struct zc_sock *zc, int sockfd);
+int send_all_zc(struct zc_sock *zc, void *buf, int len);
+int zc_wait(struct zc_sock *zc, uint32_t mark);
+void mux_hton(struct mux_frame *frame);
+void mux_ntoh(struct mux_frame *frame);
 int send_close(int sockfd);
 int close_conn(int sockfd);
 
@@ -0,0 +1,142 @@
+// copy_file_range needs this
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "copy.h"
+#include "log.h"
+#include "stage.h"
+
+// Server-side copies and moves. A copy first asks the filesystem for a
+// reflink (FICLONE), which shares the source's extents and costs no I/O at
+// all on btrfs, XFS and the like. Otherwise copy_file_range keeps the data
+// in the kernel and lets filesystems that can (NFS, SMB, ...) copy on the
+// storage side; where it isn't supported, sendfile still avoids copying
+// through user space. A move is a rename, or a copy and unlink when the
+// two names are on different filesystems.
+
+static const char *method_names[] = { "none", "clone", "copy_file_range", "sendfile", "rename" };
+
+// name a copy method for log messages
+const char *copy_method_name(enum copy_method method) {
+  return method_names[method];
+}
+
+// copy size bytes from in to out, both at offset 0
+// return: 0 on success, -1 on error
+// bytes: set to the bytes copied
+// method: set to the method that worked
+static int copy_data(int in, int out, uint64_t size, uint64_t *bytes, enum copy_method *method) {
+  if (ioctl(out, FICLONE, in) == 0) {
+    *method = COPY_CLONE;
+    *bytes = size;
+    return 0;
+  }
+
+  *method = COPY_RANGE;
+  uint64_t done = 0;
+  while (done < size) {
+    size_t len = size - done < COPY_CHUNK ? size - done : COPY_CHUNK;
+    ssize_t n = *method == COPY_RANGE ? copy_file_range(in, NULL, out, NULL, len, 0) :
+        sendfile(out, in, NULL, len);
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n == -1 && *method == COPY_RANGE && done == 0 && (errno == EXDEV ||
+        errno == ENOSYS || errno == EOPNOTSUPP || errno == EINVAL)) {
+      // older kernel or a pair of filesystems it won't do
+      *method = COPY_SENDFILE;
+      continue;
+    }
+    if (n == -1) {
+      log_msg(LOG_ERROR, "%s: %s", copy_method_name(*method), strerror(errno));
+      return -1;
+    }
+    if (n == 0) {
+      // the source shrank under us, keep what there was
+      break;
+    }
+    done += n;
+  }
+  *bytes = done;
+  return 0;
+}
+
+// copy a regular file, replacing dst
+// return: 0 on success, -1 on error
+// bytes: set to the bytes copied
+// method: set to the method that worked
+int copy_file(char *src, char *dst, uint64_t *bytes, enum copy_method *method) {
+  *bytes = 0;
+  *method = COPY_NONE;
+  int in = open(src, O_RDONLY | O_CLOEXEC);
+  if (in == -1) {
+    log_msg(LOG_ERROR, "open %s: %s", src, strerror(errno));
+    return -1;
+  }
+  struct stat st;
+  if (fstat(in, &st) || !S_ISREG(st.st_mode)) {
+    log_msg(LOG_ERROR, "%s is not a regular file.", src);
+    close(in);
+    return -1;
+  }
+  // copying a file over itself would only cost the I/O
+  struct stat dst_st;
+  if (stat(dst, &dst_st) == 0 && dst_st.st_dev == st.st_dev && dst_st.st_ino == st.st_ino) {
+    log_msg(LOG_ERROR, "%s and %s are the same file.", src, dst);
+    close(in);
+    return -1;
+  }
+  // staged like an upload, so dst is replaced all at once
+  struct stage stage;
+  if (stage_open(&stage, dst, st.st_mode & 0777)) {
+    close(in);
+    return -1;
+  }
+
+  int err = copy_data(in, fileno(stage.file), st.st_size, bytes, method);
+  close(in);
+  if (err) {
+    stage_abort(&stage);
+    return -1;
+  }
+  return stage_commit(&stage);
+}
+
+// move a regular file, replacing dst
+// return: 0 on success, -1 on error
+// bytes: set to the bytes copied, 0 if it was renamed
+// method: set to the method that worked
+int move_file(char *src, char *dst, uint64_t *bytes, enum copy_method *method) {
+  *bytes = 0;
+  *method = COPY_NONE;
+  struct stat st;
+  if (lstat(src, &st) || !S_ISREG(st.st_mode)) {
+    log_msg(LOG_ERROR, "%s is not a regular file.", src);
+    return -1;
+  }
+  if (rename(src, dst) == 0) {
+    *method = COPY_RENAME;
+    return 0;
+  }
+  if (errno != EXDEV) {
+    log_msg(LOG_ERROR, "rename %s: %s", src, strerror(errno));
+    return -1;
+  }
+  if (copy_file(src, dst, bytes, method)) {
+    return -1;
+  }
+  if (unlink(src)) {
+    log_msg(LOG_ERROR, "unlink %s: %s", src, strerror(errno));
+    return -1;
+  }
+  return 0;
+}
@@ -0,0 +1,16 @@
+#ifndef COPY_H
+#define COPY_H
+
+#include <stdint.h>
+
+// largest piece handed to copy_file_range or sendfile at once
+#define COPY_CHUNK (64 * 1024 * 1024)
+
+// how a copy was done, cheapest first
+enum copy_method { COPY_NONE, COPY_CLONE, COPY_RANGE, COPY_SENDFILE, COPY_RENAME };
+
+int copy_file(char *src, char *dst, uint64_t *bytes, enum copy_method *method);
+int move_file(char *src, char *dst, uint64_t *bytes, enum copy_method *method);
+const char *copy_method_name(enum copy_method method);
+
+#endif
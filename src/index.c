@@ -0,0 +1,441 @@
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "index.h"
+#include "log.h"
+#include "metrics.h"
+
+// Every regular file under the data directories, in name order, so LIST
+// never touches the disk. The files are kept in a skip list: finding the
+// start of a page is a search, the page itself is a walk along the bottom
+// level, and a file appearing or going away costs a search and a few
+// pointer updates however many files there are. The tree is scanned once at
+// startup; after that a thread follows inotify events for every directory
+// and updates only the names they mention. Names starting with a dot are
+// left out, along with everything under such directories. With several
+// data directories each name is listed once, and a file going away from
+// one of them doesn't remove the same name that was seen in another.
+
+#define INDEX_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+    IN_CLOSE_WRITE | IN_ATTRIB | IN_ONLYDIR | IN_DONT_FOLLOW)
+
+static pthread_rwlock_t index_lock = PTHREAD_RWLOCK_INITIALIZER;
+static struct index_node *head = NULL;
+static int top = 1;          // levels in use
+static unsigned int seed = 1;
+
+// the rest is only used by the watching thread (and index_init before it starts)
+static char **index_roots = NULL;
+static int num_roots = 0;
+static int inotify_fd = -1;
+// the directory each watch descriptor is for
+struct watch {
+  int root;
+  char *rel;   // relative to its data directory, NULL if the descriptor is unused
+};
+static struct watch *watches = NULL;
+static int num_watches = 0;
+static int warned_watches = 0;
+
+static int random_level(void) {
+  int levels = 1;
+  while (levels < INDEX_LEVELS && (rand_r(&seed) & 3) == 0) {
+    levels++;
+  }
+  return levels;
+}
+
+// find the first node at or after name, call with the index lock held
+// return: the node, NULL if every name sorts before name
+// update: if not NULL, set to the last node before name on each level
+static struct index_node *find(char *name, struct index_node **update) {
+  struct index_node *x = head;
+  for (int i = top - 1; i >= 0; i--) {
+    while (x->next[i] && strcmp(x->next[i]->name, name) < 0) {
+      x = x->next[i];
+    }
+    if (update) {
+      update[i] = x;
+    }
+  }
+  return x->next[0];
+}
+
+// add or update a file
+// return: 0 on success, -1 if out of memory
+// root: the data directory it's in
+static int index_put(char *name, struct stat *st, int root) {
+  pthread_rwlock_wrlock(&index_lock);
+  struct index_node *update[INDEX_LEVELS];
+  struct index_node *x = find(name, update);
+  if (x == NULL || strcmp(x->name, name) != 0) {
+    int levels = random_level();
+    size_t len = strlen(name);
+    x = malloc(sizeof(*x) + levels * sizeof(x->next[0]) + len + 1);
+    if (x == NULL) {
+      pthread_rwlock_unlock(&index_lock);
+      return -1;
+    }
+    x->levels = levels;
+    x->name = (char *) &x->next[levels];
+    memcpy(x->name, name, len + 1);
+    for (; top < levels; top++) {
+      update[top] = head;
+    }
+    for (int i = 0; i < levels; i++) {
+      x->next[i] = update[i]->next[i];
+      update[i]->next[i] = x;
+    }
+    metrics_add(M_INDEX_FILES, 1);
+  }
+  x->root = root;
+  x->size = st->st_size;
+  x->mtime_sec = st->st_mtim.tv_sec;
+  x->mtime_nsec = st->st_mtim.tv_nsec;
+  pthread_rwlock_unlock(&index_lock);
+  return 0;
+}
+
+// unlink and free a node, call with the index lock held for writing
+static void unlink_node(struct index_node *x) {
+  struct index_node *update[INDEX_LEVELS];
+  find(x->name, update);
+  for (int i = 0; i < x->levels; i++) {
+    update[i]->next[i] = x->next[i];
+  }
+  while (top > 1 && head->next[top - 1] == NULL) {
+    top--;
+  }
+  free(x);
+  metrics_sub(M_INDEX_FILES, 1);
+}
+
+// remove a file, if it's there
+// root: the data directory it went away from
+static void index_remove(char *name, int root) {
+  pthread_rwlock_wrlock(&index_lock);
+  struct index_node *x = find(name, NULL);
+  if (x && strcmp(x->name, name) == 0 && x->root == root) {
+    unlink_node(x);
+  }
+  pthread_rwlock_unlock(&index_lock);
+}
+
+// remove every file whose name starts with prefix
+// root: only those seen in this data directory, -1 for all
+static void index_remove_prefix(char *prefix, int root) {
+  size_t len = strlen(prefix);
+  pthread_rwlock_wrlock(&index_lock);
+  struct index_node *x = find(prefix, NULL);
+  while (x && strncmp(x->name, prefix, len) == 0) {
+    struct index_node *next = x->next[0];
+    if (root == -1 || x->root == root) {
+      unlink_node(x);
+    }
+    x = next;
+  }
+  pthread_rwlock_unlock(&index_lock);
+}
+
+// build a path relative to a data directory
+// return: 0 on success, -1 if it's too long
+static int join(char *out, char *dir, char *name) {
+  int n = dir[0] ? snprintf(out, PATH_MAX, "%s/%s", dir, name) :
+      snprintf(out, PATH_MAX, "%s", name);
+  return n < PATH_MAX ? 0 : -1;
+}
+
+// start watching a directory
+// root: the data directory
+// rel: the directory, relative to the data directory
+static void add_watch(int root, char *rel) {
+  char full[PATH_MAX];
+  if (join(full, index_roots[root], rel)) {
+    return;
+  }
+  int wd = inotify_add_watch(inotify_fd, full, INDEX_EVENTS);
+  if (wd == -1) {
+    if (errno == ENOSPC && !warned_watches) {
+      log_msg(LOG_WARN, "Out of inotify watches, raise fs.inotify.max_user_watches; "
+          "listings of new directories may be stale.");
+      warned_watches = 1;
+    } else if (errno != ENOSPC && errno != ENOENT) {
+      log_msg(LOG_ERROR, "inotify_add_watch %s: %s", full, strerror(errno));
+    }
+    return;
+  }
+  if (wd >= num_watches) {
+    int n = num_watches ? num_watches : 64;
+    while (n <= wd) {
+      n *= 2;
+    }
+    struct watch *grown = realloc(watches, n * sizeof(*watches));
+    if (grown == NULL) {
+      inotify_rm_watch(inotify_fd, wd);
+      return;
+    }
+    memset(grown + num_watches, 0, (n - num_watches) * sizeof(*watches));
+    watches = grown;
+    num_watches = n;
+  }
+  // a directory seen twice keeps its descriptor, under the newest name
+  free(watches[wd].rel);
+  watches[wd].root = root;
+  watches[wd].rel = strdup(rel);
+}
+
+// stop watching a directory and everything under it
+static void drop_watches(int root, char *rel) {
+  size_t len = strlen(rel);
+  for (int wd = 0; wd < num_watches; wd++) {
+    char *dir = watches[wd].rel;
+    if (dir && watches[wd].root == root && strncmp(dir, rel, len) == 0 &&
+        (dir[len] == '\0' || dir[len] == '/')) {
+      inotify_rm_watch(inotify_fd, wd);
+      free(dir);
+      watches[wd].rel = NULL;
+    }
+  }
+}
+
+// watch a directory and add every file under it; the watch goes first so
+// nothing created during the scan is missed
+// root: the data directory
+// rel: the directory, relative to the data directory, "" for the top
+static void scan(int root, char *rel) {
+  char full[PATH_MAX];
+  if (join(full, index_roots[root], rel)) {
+    return;
+  }
+  add_watch(root, rel);
+  DIR *dir = opendir(full);
+  if (dir == NULL) {
+    if (errno != ENOENT) {
+      log_msg(LOG_ERROR, "opendir %s: %s", full, strerror(errno));
+    }
+    return;
+  }
+  struct dirent *ent;
+  while ((ent = readdir(dir))) {
+    char path[PATH_MAX];
+    // also skips . and ..
+    if (ent->d_name[0] == '.' || join(path, rel, ent->d_name)) {
+      continue;
+    }
+    struct stat st;
+    if (fstatat(dirfd(dir), ent->d_name, &st, AT_SYMLINK_NOFOLLOW)) {
+      continue;
+    }
+    if (S_ISDIR(st.st_mode)) {
+      scan(root, path);
+    } else if (S_ISREG(st.st_mode) && index_put(path, &st, root)) {
+      log_msg(LOG_ERROR, "Out of memory indexing %s.", path);
+    }
+  }
+  closedir(dir);
+}
+
+// look at a file again after an event
+static void refresh(int root, char *rel) {
+  char full[PATH_MAX];
+  struct stat st;
+  if (join(full, index_roots[root], rel) == 0 && lstat(full, &st) == 0 &&
+      S_ISREG(st.st_mode)) {
+    if (index_put(rel, &st, root)) {
+      log_msg(LOG_ERROR, "Out of memory indexing %s.", rel);
+    }
+  } else {
+    index_remove(rel, root);
+  }
+}
+
+// drop everything and scan again, after the kernel lost events
+static void rescan(void) {
+  log_msg(LOG_WARN, "inotify queue overflowed, rescanning.");
+  index_remove_prefix("", -1);
+  for (int wd = 0; wd < num_watches; wd++) {
+    if (watches[wd].rel) {
+      inotify_rm_watch(inotify_fd, wd);
+      free(watches[wd].rel);
+      watches[wd].rel = NULL;
+    }
+  }
+  for (int root = 0; root < num_roots; root++) {
+    scan(root, "");
+  }
+}
+
+// apply one inotify event
+static void handle_event(struct inotify_event *ev) {
+  if (ev->mask & IN_Q_OVERFLOW) {
+    rescan();
+    return;
+  }
+  if (ev->wd < 0 || ev->wd >= num_watches || watches[ev->wd].rel == NULL) {
+    return;
+  }
+  if (ev->mask & IN_IGNORED) {
+    // the directory is gone, its files went with their own events
+    free(watches[ev->wd].rel);
+    watches[ev->wd].rel = NULL;
+    return;
+  }
+  if (ev->len == 0 || ev->name[0] == '.') {
+    return;
+  }
+
+  int root = watches[ev->wd].root;
+  char rel[PATH_MAX];
+  if (join(rel, watches[ev->wd].rel, ev->name)) {
+    return;
+  }
+  if (ev->mask & IN_ISDIR) {
+    if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+      scan(root, rel);
+    } else if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+      // moved away or deleted, either way its old names are gone
+      char prefix[PATH_MAX + 1];
+      snprintf(prefix, sizeof(prefix), "%s/", rel);
+      index_remove_prefix(prefix, root);
+      drop_watches(root, rel);
+    }
+  } else if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+    index_remove(rel, root);
+  } else {
+    refresh(root, rel);
+  }
+}
+
+// keep the index current
+static void *watch_events(void *arg) {
+  (void) arg;
+  char buf[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+  for (;;) {
+    ssize_t len = read(inotify_fd, buf, sizeof(buf));
+    if (len <= 0) {
+      if (len == -1 && errno == EINTR) {
+        continue;
+      }
+      log_msg(LOG_ERROR, "inotify read: %s; the file index is no longer updated.",
+          len ? strerror(errno) : "end of file");
+      return NULL;
+    }
+    struct inotify_event *ev;
+    for (char *p = buf; p < buf + len; p += sizeof(*ev) + ev->len) {
+      ev = (struct inotify_event *) p;
+      handle_event(ev);
+    }
+  }
+  return NULL;
+}
+
+// index the data directories and start following changes to them
+// return: 0 on success, -1 on error (index_list then always fails)
+// roots: the data directories
+// count: how many
+int index_init(char **roots, int count) {
+  index_roots = roots;
+  num_roots = count;
+  inotify_fd = inotify_init1(IN_CLOEXEC);
+  if (inotify_fd == -1) {
+    log_msg(LOG_ERROR, "inotify_init: %s", strerror(errno));
+    return -1;
+  }
+  struct index_node *first = calloc(1, sizeof(*first) + INDEX_LEVELS * sizeof(first->next[0]));
+  if (first == NULL) {
+    return -1;
+  }
+  first->levels = INDEX_LEVELS;
+  first->name = "";
+
+  uint64_t start = now_ns();
+  head = first;
+  for (int root = 0; root < num_roots; root++) {
+    scan(root, "");
+  }
+  struct metrics_snapshot snap;
+  metrics_snapshot(&snap);
+  log_msg(LOG_INFO, "Indexed %llu files in %.3f s.",
+      (unsigned long long) snap.counters[M_INDEX_FILES], (now_ns() - start) / 1e9);
+
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, watch_events, NULL)) {
+    log_msg(LOG_ERROR, "Failed to start the index thread.");
+    return -1;
+  }
+  pthread_detach(thread);
+  return 0;
+}
+
+// copy out one page of the listing in wire format: a list_header, then a
+// list_entry and name for each file
+// return: a malloc'd page, NULL if there is no index or no memory
+// prefix: only names starting with this
+// after: the last name of the previous page, "" for the first page
+// limit: most entries in the page
+// headroom: bytes left free before the page, so the caller can send its
+//           response header and the page together
+// len: set to the length of the page, including headroom
+char *index_list(char *prefix, char *after, uint32_t limit, size_t headroom, size_t *len) {
+  if (head == NULL) {
+    return NULL;
+  }
+  size_t cap = 4096;
+  size_t used = headroom + sizeof(struct list_header);
+  char *page = malloc(cap);
+  if (page == NULL) {
+    return NULL;
+  }
+  size_t prefix_len = strlen(prefix);
+  uint32_t count = 0;
+
+  pthread_rwlock_rdlock(&index_lock);
+  struct index_node *x = find(strcmp(after, prefix) > 0 ? after : prefix, NULL);
+  if (x && strcmp(x->name, after) == 0) {
+    x = x->next[0];
+  }
+  for (; x && count < limit && strncmp(x->name, prefix, prefix_len) == 0; x = x->next[0]) {
+    size_t name_len = strlen(x->name);
+    size_t need = sizeof(struct list_entry) + name_len;
+    if (used + need > cap) {
+      while (used + need > cap) {
+        cap *= 2;
+      }
+      char *grown = realloc(page, cap);
+      if (grown == NULL) {
+        pthread_rwlock_unlock(&index_lock);
+        free(page);
+        return NULL;
+      }
+      page = grown;
+    }
+    struct list_entry entry;
+    entry.size = htobe64(x->size);
+    entry.mtime_sec = htobe64(x->mtime_sec);
+    entry.mtime_nsec = htonl(x->mtime_nsec);
+    entry.name_len = htonl(name_len);
+    memcpy(page + used, &entry, sizeof(entry));
+    memcpy(page + used + sizeof(entry), x->name, name_len);
+    used += need;
+    count++;
+  }
+  int more = x && strncmp(x->name, prefix, prefix_len) == 0;
+  pthread_rwlock_unlock(&index_lock);
+
+  struct list_header header = { htonl(count), htonl(more) };
+  memcpy(page + headroom, &header, sizeof(header));
+  *len = used;
+  return page;
+}
@@ -0,0 +1,24 @@
+#ifndef INDEX_H
+#define INDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// most levels in the skip list, plenty for hundreds of millions of files
+#define INDEX_LEVELS 24
+
+// one regular file, linked into levels lists
+struct index_node {
+  uint64_t size;
+  int64_t mtime_sec;
+  uint32_t mtime_nsec;
+  int levels;
+  int root;    // the data directory it was seen in
+  char *name;  // relative to the data directories, stored after next
+  struct index_node *next[];
+};
+
+int index_init(char **roots, int count);
+char *index_list(char *prefix, char *after, uint32_t limit, size_t headroom, size_t *len);
+
+#endif
@@ -0,0 +1,300 @@
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include "log.h"
+#include "metrics.h"
+
+// Threads format their message straight into their own ring and, after the
+// first message, never take a lock or make a syscall to log. A background
+// thread drains all the rings to stdout/stderr. When a ring is full the
+// message is dropped and counted, so a slow terminal or pipe can never stall
+// a transfer.
+//
+// Each drain pass takes what is in every ring at its start and merges the
+// rings by timestamp through a heap, so a pass costs O(n log rings) for n
+// messages. A ring whose thread has exited is kept for the next thread, up
+// to LOG_IDLE_RINGS of them; the drainer frees the rest once they are empty.
+
+#define DRAIN_INTERVAL_US 5000
+
+// rings kept for reuse after their threads exit
+#define LOG_IDLE_RINGS 16
+
+static struct log_ring *rings = NULL;
+static pthread_key_t ring_key;
+static __thread struct log_ring *my_ring = NULL;
+static enum log_level log_min_level = LOG_INFO;
+
+// guards the list of rings: claiming, adding and freeing them
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// only one consumer may drain at a time (the drainer or log_flush)
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// one ring's share of a drain pass
+struct drain_src {
+  struct log_ring *ring;
+  uint64_t next;  // next entry to write
+  uint64_t end;   // the ring's head when the pass started
+};
+
+// the merge heap, ordered by the timestamp of each source's next entry;
+// only touched under drain_lock
+static struct drain_src *heap = NULL;
+static size_t heap_cap = 0;
+
+// the stream written last, flushed before switching to the other one
+static FILE *last_out = NULL;
+
+static const char *level_names[] = { "DEBUG", "INFO", "WARN", "ERROR" };
+
+static void *log_drainer(void *arg);
+
+// give the ring back when its thread exits, the drainer still empties it
+static void ring_release(void *arg) {
+  struct log_ring *ring = arg;
+  // the drainer may free it from here on, anything this thread still logs
+  // goes to a ring claimed afresh
+  my_ring = NULL;
+  pthread_mutex_lock(&rings_lock);
+  ring->in_use = 0;
+  pthread_mutex_unlock(&rings_lock);
+}
+
+// set up the logger and start the drain thread
+// return: 0 on success, -1 on error
+// min_level: messages below this level are discarded
+int log_init(enum log_level min_level) {
+  log_min_level = min_level;
+  if (pthread_key_create(&ring_key, ring_release)) {
+    return -1;
+  }
+  pthread_t thread;
+  int err = pthread_create(&thread, NULL, log_drainer, NULL);
+  if (err) {
+    fprintf(stderr, "pthread_create: %s\n", strerror(err));
+    return -1;
+  }
+  pthread_detach(thread);
+  return 0;
+}
+
+// look up a level by name
+// return: 0 on success, -1 if the name is unknown
+int log_parse_level(char *name, enum log_level *level) {
+  for (size_t i = 0; i < sizeof(level_names) / sizeof(level_names[0]); i++) {
+    if (strcasecmp(name, level_names[i]) == 0) {
+      *level = i;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+// find this thread's ring, claiming a free one or adding a new one
+// return: the ring, NULL if out of memory
+static struct log_ring *ring_get(void) {
+  if (my_ring) {
+    return my_ring;
+  }
+  pthread_mutex_lock(&rings_lock);
+  struct log_ring *ring = rings;
+  while (ring && ring->in_use) {
+    ring = ring->next;
+  }
+  if (ring == NULL) {
+    ring = calloc(1, sizeof(*ring));
+    if (ring == NULL) {
+      pthread_mutex_unlock(&rings_lock);
+      return NULL;
+    }
+    ring->next = rings;
+    rings = ring;
+  }
+  ring->in_use = 1;
+  pthread_mutex_unlock(&rings_lock);
+  ring->tid = syscall(SYS_gettid);
+  pthread_setspecific(ring_key, ring);
+  my_ring = ring;
+  return ring;
+}
+
+// log a message; never blocks
+// level: severity, messages below the configured level are discarded
+// fmt: printf-style format, no trailing newline
+void log_msg(enum log_level level, const char *fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  log_vmsg(level, fmt, args);
+  va_end(args);
+}
+
+// log_msg with the arguments in a va_list
+void log_vmsg(enum log_level level, const char *fmt, va_list args) {
+  if (level < log_min_level) {
+    return;
+  }
+  struct log_ring *ring = ring_get();
+  if (ring == NULL) {
+    metrics_add(M_LOG_DROPPED, 1);
+    return;
+  }
+
+  uint64_t head = ring->head; // we are the only writer
+  uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+  if (head - tail >= LOG_RING_ENTRIES) {
+    metrics_add(M_LOG_DROPPED, 1);
+    return;
+  }
+
+  struct log_entry *entry = &ring->entries[head % LOG_RING_ENTRIES];
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  entry->sec = ts.tv_sec;
+  entry->nsec = ts.tv_nsec;
+  entry->level = level;
+  entry->tid = ring->tid;
+
+  vsnprintf(entry->msg, sizeof(entry->msg), fmt, args);
+
+  // publish the entry
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+// write one entry to stdout (info and below) or stderr (warnings and errors)
+static void write_entry(struct log_entry *entry) {
+  struct tm tm;
+  time_t sec = entry->sec;
+  gmtime_r(&sec, &tm);
+  char stamp[32];
+  strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &tm);
+  FILE *out = entry->level >= LOG_WARN ? stderr : stdout;
+  // keep the two streams in order when they go to the same place
+  if (last_out && out != last_out) {
+    fflush(last_out);
+  }
+  last_out = out;
+  fprintf(out, "%s.%06uZ %-5s [%llu] %s\n", stamp, entry->nsec / 1000,
+      level_names[entry->level], (unsigned long long) entry->tid, entry->msg);
+}
+
+// the entry a drain source writes next
+static struct log_entry *src_entry(struct drain_src *src) {
+  return &src->ring->entries[src->next % LOG_RING_ENTRIES];
+}
+
+// return: 1 if a's next entry was logged before b's
+static int src_before(struct drain_src *a, struct drain_src *b) {
+  struct log_entry *x = src_entry(a);
+  struct log_entry *y = src_entry(b);
+  return x->sec < y->sec || (x->sec == y->sec && x->nsec < y->nsec);
+}
+
+// restore the heap order below slot i
+static void heap_down(size_t n, size_t i) {
+  for (;;) {
+    size_t min = i;
+    size_t l = 2 * i + 1;
+    size_t r = l + 1;
+    if (l < n && src_before(&heap[l], &heap[min])) {
+      min = l;
+    }
+    if (r < n && src_before(&heap[r], &heap[min])) {
+      min = r;
+    }
+    if (min == i) {
+      return;
+    }
+    struct drain_src tmp = heap[i];
+    heap[i] = heap[min];
+    heap[min] = tmp;
+    i = min;
+  }
+}
+
+// take what every ring has right now, and free the idle rings
+// past the ones kept for reuse
+// return: number of rings in the heap
+static size_t drain_collect(void) {
+  pthread_mutex_lock(&rings_lock);
+  size_t count = 0;
+  for (struct log_ring *ring = rings; ring; ring = ring->next) {
+    count++;
+  }
+  if (count > heap_cap) {
+    struct drain_src *grown = realloc(heap, count * sizeof(*heap));
+    if (grown) {
+      heap = grown;
+      heap_cap = count;
+    }
+  }
+
+  size_t n = 0;
+  int idle = 0;
+  struct log_ring **link = &rings;
+  while (*link) {
+    struct log_ring *ring = *link;
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    if (ring->tail != head) {
+      // a ring that doesn't fit waits for the next pass
+      if (n < heap_cap) {
+        heap[n++] = (struct drain_src) { ring, ring->tail, head };
+      }
+    } else if (!ring->in_use && ++idle > LOG_IDLE_RINGS) {
+      *link = ring->next;
+      free(ring);
+      continue;
+    }
+    link = &ring->next;
+  }
+  pthread_mutex_unlock(&rings_lock);
+  return n;
+}
+
+// write out everything that is in the rings right now, merged by timestamp
+// return: number of entries written
+static int drain_once(void) {
+  int drained = 0;
+  pthread_mutex_lock(&drain_lock);
+  size_t n = drain_collect();
+  for (size_t i = n; i-- > 0;) {
+    heap_down(n, i);
+  }
+  while (n > 0) {
+    struct drain_src *src = &heap[0];
+    write_entry(src_entry(src));
+    drained++;
+    // hand the entry back to the producer
+    __atomic_store_n(&src->ring->tail, ++src->next, __ATOMIC_RELEASE);
+    if (src->next == src->end) {
+      heap[0] = heap[--n];
+    }
+    heap_down(n, 0);
+  }
+  if (drained) {
+    fflush(last_out);
+  }
+  pthread_mutex_unlock(&drain_lock);
+  return drained;
+}
+
+// background thread that empties the rings
+static void *log_drainer(void *arg) {
+  (void) arg;
+  for (;;) {
+    if (drain_once() == 0) {
+      usleep(DRAIN_INTERVAL_US);
+    }
+  }
+  return NULL;
+}
+
+// write out all pending messages before returning, e.g. before exiting
+void log_flush(void) {
+  drain_once();
+}
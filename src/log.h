@@ -0,0 +1,39 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdarg.h>
+#include <stdint.h>
+
+enum log_level { LOG_DEBUG, LOG_INFO, LOG_WARN, LOG_ERROR };
+
+// each thread gets a ring of this many fixed-size entries
+#define LOG_RING_ENTRIES 256
+#define LOG_MSG_LEN 200
+
+struct log_entry {
+  uint64_t sec;
+  uint32_t nsec;
+  uint32_t level;
+  uint64_t tid;
+  char msg[LOG_MSG_LEN];
+};
+
+// single producer (the owning thread), single consumer (the drainer)
+struct log_ring {
+  struct log_ring *next;
+  int in_use;
+  uint64_t tid;
+  uint64_t head; // written by the producer
+  uint64_t tail; // written by the consumer
+  struct log_entry entries[LOG_RING_ENTRIES];
+};
+
+int log_init(enum log_level min_level);
+int log_parse_level(char *name, enum log_level *level);
+void log_msg(enum log_level level, const char *fmt, ...)
+  __attribute__((format(printf, 2, 3)));
+void log_vmsg(enum log_level level, const char *fmt, va_list args)
+  __attribute__((format(printf, 2, 0)));
+void log_flush(void);
+
+#endif
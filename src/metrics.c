@@ -0,0 +1,242 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "metrics.h"
+
+// Every thread writes only to its own slot, so updates are plain relaxed
+// stores with no lock or atomic read-modify-write. Readers walk the slot list
+// and sum. Slots are never freed: a thread releases its slot when it exits and
+// the next thread to start reuses it, so totals stay monotonic and the list is
+// bounded by the peak number of threads.
+
+static struct metrics_slot *slots = NULL;
+static pthread_key_t slot_key;
+static __thread struct metrics_slot *my_slot = NULL;
+
+static const char *counter_names[NUM_COUNTERS] = {
+  "tiger_bytes_in_total", "tiger_bytes_out_total", "tiger_sessions_total",
+  "tiger_sessions_active", "tiger_auth_success_total", "tiger_auth_failure_total",
+  "tiger_get_total", "tiger_put_total", "tiger_errors_total",
+  "tiger_log_dropped_total", "tiger_rejected_total", "tiger_timeouts_total",
+  "tiger_list_total", "tiger_index_files", "tiger_copy_total", "tiger_move_total",
+  "tiger_flushes_total", "tiger_flushed_files_total", "tiger_relay_fetches_total",
+  "tiger_relay_coalesced_total", "tiger_tls_ktls_total", "tiger_tls_userspace_total",
+  "tiger_get_follow_total", "tiger_getdir_total", "tiger_putdir_total"
+};
+
+static const char *counter_help[NUM_COUNTERS] = {
+  "Payload bytes received from clients.", "Payload bytes sent to clients.",
+  "Sessions accepted.", "Sessions currently open.", "Successful logins.",
+  "Rejected logins.", "GET requests.", "PUT requests.", "Sessions ended by an error.",
+  "Log messages dropped because a log ring was full.",
+  "Sessions turned away by a session limit.",
+  "Sessions closed for being idle or too slow.", "LIST requests.",
+  "Files in the listing index.", "COPY requests.", "MOVE requests.",
+  "Group commits made by the durability flusher.", "Uploads made durable by group commits.",
+  "Files fetched from the upstream server.", "GET misses that joined a fetch in progress.",
+  "TLS sessions with the record layer in the kernel.",
+  "TLS sessions with the record layer in user space.",
+  "GETs that streamed an upload still in progress.", "GETDIR requests.", "PUTDIR requests."
+};
+
+static const char *hist_names[NUM_HISTS] = { "auth", "get", "put", "getdir", "putdir" };
+
+// give the slot back when its thread exits
+static void slot_release(void *arg) {
+  struct metrics_slot *slot = arg;
+  __atomic_store_n(&slot->in_use, 0, __ATOMIC_RELEASE);
+}
+
+// set up the registry, call once before starting threads
+// return: 0 on success, -1 on error
+int metrics_init(void) {
+  if (pthread_key_create(&slot_key, slot_release)) {
+    return -1;
+  }
+  return 0;
+}
+
+// find this thread's slot, claiming a free one or adding a new one
+// return: the slot, NULL if out of memory
+static struct metrics_slot *slot_get(void) {
+  if (my_slot) {
+    return my_slot;
+  }
+  struct metrics_slot *slot;
+  for (slot = __atomic_load_n(&slots, __ATOMIC_ACQUIRE); slot; slot = slot->next) {
+    int expected = 0;
+    if (__atomic_compare_exchange_n(&slot->in_use, &expected, 1, 0,
+          __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+      break;
+    }
+  }
+  if (slot == NULL) {
+    slot = calloc(1, sizeof(*slot));
+    if (slot == NULL) {
+      return NULL;
+    }
+    slot->in_use = 1;
+    slot->next = __atomic_load_n(&slots, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&slots, &slot->next, slot, 1,
+          __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+      // slot->next was updated with the current head, try again
+    }
+  }
+  pthread_setspecific(slot_key, slot);
+  my_slot = slot;
+  return slot;
+}
+
+// single writer per slot, so a relaxed load and store is enough
+static inline void slot_bump(uint64_t *val, uint64_t n) {
+  __atomic_store_n(val, __atomic_load_n(val, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+// add to a counter
+void metrics_add(enum metric_counter c, uint64_t n) {
+  struct metrics_slot *slot = slot_get();
+  if (slot) {
+    slot_bump(&slot->counters[c], n);
+  }
+}
+
+// subtract from a counter (gauges like active sessions); the sum over all
+// slots is correct even if an individual slot wraps below zero
+void metrics_sub(enum metric_counter c, uint64_t n) {
+  metrics_add(c, -n);
+}
+
+// histogram bucket index for a value
+static int hist_index(uint64_t v) {
+  if (v < (1 << HIST_SUB_BITS)) {
+    return v;
+  }
+  int msb = 63 - __builtin_clzll(v);
+  int shift = msb - (HIST_SUB_BITS - 1);
+  if (shift > HIST_MAX_SHIFT) {
+    return HIST_BUCKETS - 1;
+  }
+  return shift * HIST_HALF + (v >> shift);
+}
+
+// largest value that falls in a bucket
+static uint64_t hist_upper(int idx) {
+  if (idx < (1 << HIST_SUB_BITS)) {
+    return idx;
+  }
+  int shift = idx / HIST_HALF - 1;
+  uint64_t mant = idx - shift * HIST_HALF;
+  return ((mant + 1) << shift) - 1;
+}
+
+// record an operation latency
+// ns: duration in nanoseconds
+void metrics_record(enum metric_hist h, uint64_t ns) {
+  struct metrics_slot *slot = slot_get();
+  if (slot) {
+    slot_bump(&slot->hist[h][hist_index(ns)], 1);
+    slot_bump(&slot->hist_sum[h], ns);
+  }
+}
+
+// merge every slot into a snapshot
+void metrics_snapshot(struct metrics_snapshot *snap) {
+  memset(snap, 0, sizeof(*snap));
+  for (struct metrics_slot *slot = __atomic_load_n(&slots, __ATOMIC_ACQUIRE);
+      slot; slot = slot->next) {
+    for (int c = 0; c < NUM_COUNTERS; c++) {
+      snap->counters[c] += __atomic_load_n(&slot->counters[c], __ATOMIC_RELAXED);
+    }
+    for (int h = 0; h < NUM_HISTS; h++) {
+      for (int b = 0; b < HIST_BUCKETS; b++) {
+        uint64_t n = __atomic_load_n(&slot->hist[h][b], __ATOMIC_RELAXED);
+        snap->hist[h][b] += n;
+        snap->hist_count[h] += n;
+      }
+      snap->hist_sum[h] += __atomic_load_n(&slot->hist_sum[h], __ATOMIC_RELAXED);
+    }
+  }
+}
+
+// latency percentile from a snapshot
+// return: upper bound of the bucket holding percentile p, in nanoseconds
+uint64_t metrics_percentile(struct metrics_snapshot *snap, enum metric_hist h, double p) {
+  if (snap->hist_count[h] == 0) {
+    return 0;
+  }
+  uint64_t rank = (uint64_t) (p * snap->hist_count[h]);
+  uint64_t seen = 0;
+  for (int b = 0; b < HIST_BUCKETS; b++) {
+    seen += snap->hist[h][b];
+    if (seen > rank) {
+      return hist_upper(b);
+    }
+  }
+  return hist_upper(HIST_BUCKETS - 1);
+}
+
+// render all metrics in Prometheus text exposition format
+// return: malloc'd text, NULL on error
+// len: set to the length of the text
+char *metrics_format(size_t *len) {
+  struct metrics_snapshot *snap = malloc(sizeof(*snap));
+  if (snap == NULL) {
+    return NULL;
+  }
+  metrics_snapshot(snap);
+
+  char *text;
+  FILE *out = open_memstream(&text, len);
+  if (out == NULL) {
+    free(snap);
+    return NULL;
+  }
+
+  for (int c = 0; c < NUM_COUNTERS; c++) {
+    fprintf(out, "# HELP %s %s\n", counter_names[c], counter_help[c]);
+    fprintf(out, "# TYPE %s %s\n", counter_names[c],
+        c == M_SESSIONS_ACTIVE || c == M_INDEX_FILES ? "gauge" : "counter");
+    fprintf(out, "%s %lld\n", counter_names[c], (long long) snap->counters[c]);
+  }
+
+  // power of two buckets line up exactly with the log-linear ones
+  fprintf(out, "# HELP tiger_request_duration_seconds Request latency.\n");
+  fprintf(out, "# TYPE tiger_request_duration_seconds histogram\n");
+  for (int h = 0; h < NUM_HISTS; h++) {
+    uint64_t cumulative = 0;
+    int b = 0;
+    for (int k = 10; k <= HIST_MAX_SHIFT; k += 2) {
+      for (; b < HIST_BUCKETS && hist_upper(b) < (1ULL << k); b++) {
+        cumulative += snap->hist[h][b];
+      }
+      fprintf(out, "tiger_request_duration_seconds_bucket{op=\"%s\",le=\"%g\"} %llu\n",
+          hist_names[h], (1ULL << k) / 1e9, (unsigned long long) cumulative);
+    }
+    fprintf(out, "tiger_request_duration_seconds_bucket{op=\"%s\",le=\"+Inf\"} %llu\n",
+        hist_names[h], (unsigned long long) snap->hist_count[h]);
+    fprintf(out, "tiger_request_duration_seconds_sum{op=\"%s\"} %g\n",
+        hist_names[h], snap->hist_sum[h] / 1e9);
+    fprintf(out, "tiger_request_duration_seconds_count{op=\"%s\"} %llu\n",
+        hist_names[h], (unsigned long long) snap->hist_count[h]);
+  }
+
+  // the full-resolution percentiles, which the coarse buckets above can't give
+  static const double quantiles[] = { 0.5, 0.99, 0.999 };
+  fprintf(out, "# HELP tiger_request_duration_quantile_seconds Request latency percentiles.\n");
+  fprintf(out, "# TYPE tiger_request_duration_quantile_seconds gauge\n");
+  for (int h = 0; h < NUM_HISTS; h++) {
+    for (size_t q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++) {
+      fprintf(out, "tiger_request_duration_quantile_seconds{op=\"%s\",quantile=\"%g\"} %g\n",
+          hist_names[h], quantiles[q], metrics_percentile(snap, h, quantiles[q]) / 1e9);
+    }
+  }
+
+  free(snap);
+  if (fclose(out)) {
+    free(text);
+    return NULL;
+  }
+  return text;
+}
+
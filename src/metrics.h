@@ -0,0 +1,52 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// counters, summed over all threads when read
+enum metric_counter {
+  M_BYTES_IN, M_BYTES_OUT, M_SESSIONS, M_SESSIONS_ACTIVE,
+  M_AUTH_SUCCESS, M_AUTH_FAILURE, M_GET, M_PUT, M_ERRORS, M_LOG_DROPPED, M_REJECTED, M_TIMEOUTS,
+  M_LIST, M_INDEX_FILES, M_COPY, M_MOVE,
+  M_FLUSHES, M_FLUSHED, M_RELAY_FETCHES, M_RELAY_COALESCED, M_TLS_KTLS, M_TLS_USERSPACE,
+  M_GET_FOLLOW, M_GETDIR, M_PUTDIR,
+  NUM_COUNTERS
+};
+
+// operations with latency histograms; directory transfers have their own,
+// so a tree doesn't pass for one slow file in the GET and PUT percentiles
+enum metric_hist { H_AUTH, H_GET, H_PUT, H_GETDIR, H_PUTDIR, NUM_HISTS };
+
+// log-linear (HDR-style) buckets: values below 2^SUB_BITS are exact,
+// above that every power of two is split into 2^(SUB_BITS-1) buckets
+#define HIST_SUB_BITS 5
+#define HIST_HALF (1 << (HIST_SUB_BITS - 1))
+#define HIST_MAX_SHIFT 36
+#define HIST_BUCKETS ((HIST_MAX_SHIFT + 2) * HIST_HALF)
+
+struct metrics_slot {
+  struct metrics_slot *next;
+  int in_use;
+  uint64_t counters[NUM_COUNTERS];
+  uint64_t hist[NUM_HISTS][HIST_BUCKETS];
+  uint64_t hist_sum[NUM_HISTS];
+};
+
+// snapshot of all slots merged together
+struct metrics_snapshot {
+  uint64_t counters[NUM_COUNTERS];
+  uint64_t hist[NUM_HISTS][HIST_BUCKETS];
+  uint64_t hist_count[NUM_HISTS];
+  uint64_t hist_sum[NUM_HISTS];
+};
+
+int metrics_init(void);
+void metrics_add(enum metric_counter c, uint64_t n);
+void metrics_sub(enum metric_counter c, uint64_t n);
+void metrics_record(enum metric_hist h, uint64_t ns);
+void metrics_snapshot(struct metrics_snapshot *snap);
+uint64_t metrics_percentile(struct metrics_snapshot *snap, enum metric_hist h, double p);
+char *metrics_format(size_t *len);
+
+#endif
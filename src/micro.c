@@ -0,0 +1,215 @@
+
+// Data & Communication Networks
+// Project 1 - Socket Programming
+// Peter Fabinski (pnf9945)
+// TigerMicro - small-message path microbenchmarks
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "bench.h"
+#include "log.h"
+#include "users.h"
+
+// every measurement is repeated and the median reported, for stable output
+#define REPS 5
+
+static char *host = "127.0.0.1";
+static char *user = "user";
+static char *pass = "pass";
+static int iterations = 2000;
+
+static int micro_churn(void);
+static int micro_auth(void);
+static int micro_rtt(void);
+static int cmp_double(const void *a, const void *b);
+static double median(double *vals, int n);
+
+int main(int argc, char **argv) {
+  int opt;
+  while ((opt = getopt(argc, argv, "h:u:p:n:")) != -1) {
+    switch (opt) {
+      case 'h': host = optarg; break;
+      case 'u': user = optarg; break;
+      case 'p': pass = optarg; break;
+      case 'n': iterations = atoi(optarg); break;
+      default:
+        micro_usage();
+        return 1;
+    }
+  }
+  if (optind != argc - 1 || iterations < 1) {
+    micro_usage();
+    return 1;
+  }
+
+  char *mode = argv[optind];
+  if (strcmp(mode, "churn") == 0) {
+    return micro_churn();
+  } else if (strcmp(mode, "auth") == 0) {
+    return micro_auth();
+  } else if (strcmp(mode, "rtt") == 0) {
+    return micro_rtt();
+  }
+  micro_usage();
+  return 1;
+}
+
+// connect + auth + END + close cycles per second
+static int micro_churn(void) {
+  double rates[REPS];
+  for (int rep = 0; rep < REPS; rep++) {
+    uint64_t start = now_ns();
+    for (int i = 0; i < iterations; i++) {
+      int sockfd = bench_connect(host, user, pass);
+      if (sockfd == -1) {
+        fprintf(stderr, "Could not connect to server.\n");
+        return 1;
+      }
+      send_close(sockfd);
+      close_conn(sockfd);
+    }
+    rates[rep] = iterations / ((now_ns() - start) / 1e9);
+  }
+  printf("{\"bench\": \"churn\", \"iterations\": %d, \"reps\": %d, "
+      "\"cycles_per_s\": %.1f}\n", iterations, REPS, median(rates, REPS));
+  return 0;
+}
+
+// check_auth cost against users files of increasing length
+// the matching user is on the last line, the worst case for a linear scan
+static int micro_auth(void) {
+  // check_auth reports through the server's log
+  if (log_init(LOG_WARN)) {
+    return 1;
+  }
+  char dir[] = "/tmp/tigermicro.XXXXXX";
+  if (mkdtemp(dir) == NULL) {
+    fprintf(stderr, "mkdtemp: %s\n", strerror(errno));
+    return 1;
+  }
+  if (chdir(dir)) {
+    fprintf(stderr, "chdir: %s\n", strerror(errno));
+    return 1;
+  }
+
+  int status = 0;
+  static const int lines[] = { 10, 100, 1000, 10000, 100000 };
+  for (size_t l = 0; l < sizeof(lines) / sizeof(lines[0]); l++) {
+    FILE *users = fopen("users.txt", "w");
+    if (!users) {
+      fprintf(stderr, "fopen: %s\n", strerror(errno));
+      status = 1;
+      break;
+    }
+    for (int i = 0; i < lines[l]; i++) {
+      fprintf(users, "user%d pass%d\n", i, i);
+    }
+    fclose(users);
+
+    char last_user[32], last_pass[32];
+    snprintf(last_user, sizeof(last_user), "user%d", lines[l] - 1);
+    snprintf(last_pass, sizeof(last_pass), "pass%d", lines[l] - 1);
+
+    // keep the total work per rep roughly constant across file sizes
+    int n = iterations * 10 / lines[l];
+    if (n < 10) {
+      n = 10;
+    }
+
+    double hit_ns[REPS], miss_ns[REPS];
+    for (int rep = 0; rep < REPS; rep++) {
+      uint64_t start = now_ns();
+      for (int i = 0; i < n; i++) {
+        if (check_auth(last_user, last_pass, NULL) != 1) {
+          fprintf(stderr, "check_auth failed for %s.\n", last_user);
+          status = 1;
+        }
+      }
+      hit_ns[rep] = (double) (now_ns() - start) / n;
+
+      start = now_ns();
+      for (int i = 0; i < n; i++) {
+        if (check_auth("nosuchuser", "nosuchpass", NULL) != 0) {
+          status = 1;
+        }
+      }
+      miss_ns[rep] = (double) (now_ns() - start) / n;
+    }
+    printf("{\"bench\": \"auth\", \"lines\": %d, \"lookups\": %d, \"reps\": %d, "
+        "\"hit_ns\": %.0f, \"miss_ns\": %.0f}\n", lines[l], n, REPS,
+        median(hit_ns, REPS), median(miss_ns, REPS));
+  }
+
+  unlink("users.txt");
+  chdir("/");
+  rmdir(dir);
+  return status;
+}
+
+// round trip latency of a GET for an empty file
+static int micro_rtt(void) {
+  int sockfd = bench_connect(host, user, pass);
+  if (sockfd == -1) {
+    fprintf(stderr, "Could not connect to server.\n");
+    return 1;
+  }
+  uint64_t bytes = 0;
+  if (bench_put(sockfd, "bench_0.dat", 0, &bytes)) {
+    fprintf(stderr, "Failed to upload bench_0.dat.\n");
+    return 1;
+  }
+
+  double p50[REPS], p99[REPS], p999[REPS];
+  for (int rep = 0; rep < REPS; rep++) {
+    struct lat_samples s = {0};
+    for (int i = 0; i < iterations; i++) {
+      uint64_t t0 = now_ns();
+      if (bench_get(sockfd, "bench_0.dat", &bytes)) {
+        return 1;
+      }
+      lat_add(&s, now_ns() - t0);
+    }
+    p50[rep] = lat_percentile(&s, 0.50) / 1e3;
+    p99[rep] = lat_percentile(&s, 0.99) / 1e3;
+    p999[rep] = lat_percentile(&s, 0.999) / 1e3;
+    free(s.ns);
+  }
+  send_close(sockfd);
+  close_conn(sockfd);
+
+  printf("{\"bench\": \"rtt\", \"iterations\": %d, \"reps\": %d, "
+      "\"p50_us\": %.1f, \"p99_us\": %.1f, \"p999_us\": %.1f}\n", iterations, REPS,
+      median(p50, REPS), median(p99, REPS), median(p999, REPS));
+  return 0;
+}
+
+static int cmp_double(const void *a, const void *b) {
+  double x = *(const double *) a;
+  double y = *(const double *) b;
+  return (x > y) - (x < y);
+}
+
+// median of the values (sorts them in place)
+static double median(double *vals, int n) {
+  qsort(vals, n, sizeof(*vals), cmp_double);
+  return vals[n / 2];
+}
+
+// print usage message
+void micro_usage(void) {
+  fprintf(stderr, "Usage: TigerMicro [options] <churn|auth|rtt>\n");
+  fprintf(stderr, "  churn          connect + auth + close cycles per second\n");
+  fprintf(stderr, "  auth           check_auth cost for 10 to 100k line users files\n");
+  fprintf(stderr, "  rtt            round trip latency of a zero-byte GET\n");
+  fprintf(stderr, "  -h <host>      server address, optionally host:port (default 127.0.0.1)\n");
+  fprintf(stderr, "  -u <user>      username (default user)\n");
+  fprintf(stderr, "  -p <pass>      password (default pass)\n");
+  fprintf(stderr, "  -n <count>     iterations per repetition (default 2000)\n");
+}
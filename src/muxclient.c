@@ -0,0 +1,350 @@
+// Data & Communication Networks
+// Project 1 - Socket Programming
+// Peter Fabinski (pnf9945)
+// TigerC - multiplexed transfers
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include "client.h"
+#include "muxclient.h"
+#include "trace.h"
+
+// Client side of a multiplexed session. mux_run keeps up to max_streams
+// transfers open at once and drives them from one thread: it reads frames
+// whenever the server has sent some, and otherwise sends the next chunk of
+// the upload with the least left to go. The server always keeps reading, so
+// blocking sends here can't deadlock with its sends.
+
+struct mux_cstream {
+  int in_use;
+  uint32_t id;
+  enum ftp_req_type type;  // GET or PUT
+  int opened;              // the server accepted the stream
+  FILE *file;
+  char *filename;
+  void *job;
+  uint64_t remaining;      // bytes still to receive (GET) or send (PUT)
+  uint64_t window;         // PUT: bytes the server will still accept
+  uint64_t consumed;       // GET: bytes written since the last WINDOW
+  uint64_t trace_start;
+};
+
+// stream numbers are never reused on a connection, so a late frame for a
+// finished stream can't be mistaken for a new one
+static __thread uint32_t next_stream = 0;
+
+// switch a logged in connection to multiplexed mode
+// return: 0 on success, -1 on error
+int mux_start(int sockfd) {
+  struct ftp_file_request req = {0};
+  req.type = htonl(MUX);
+  if (send_all(sockfd, &req, sizeof(req)) == -1) {
+    fprintf(stderr, "Error sending mux request.\n");
+    return -1;
+  }
+
+  struct ftp_file_response resp = {0};
+  ssize_t received = recv(sockfd, &resp, sizeof(resp), MSG_WAITALL);
+  if (received != sizeof(resp)) {
+    fprintf(stderr, "Server doesn't support multiplexing.\n");
+    return -1;
+  }
+  if (ntohl(resp.type) != MUX || ntohl(resp.result) != SUCCESS) {
+    fprintf(stderr, "Server refused multiplexing.\n");
+    return -1;
+  }
+  next_stream = 0;
+
+  // every frame goes out in a single send
+  int nodelay = 1;
+  setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+  // and uploads are picked as late as possible, like on the server
+  int lowat = MUX_LOWAT;
+  setsockopt(sockfd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat));
+  return 0;
+}
+
+// end a multiplexed session
+// return: 0 on success, -1 on error
+int mux_end(int sockfd) {
+  struct mux_frame frame = { MUX_END, 0, 0, 0, 0 };
+  mux_hton(&frame);
+  if (send_all(sockfd, &frame, sizeof(frame)) == -1) {
+    return -1;
+  }
+  return 0;
+}
+
+// send a frame and its payload
+// return: 0 on success, -1 on error
+// payload: at most MUX_CHUNK bytes
+static int send_frame(int sockfd, uint32_t type, uint32_t stream, uint64_t size,
+    void *payload, uint32_t len) {
+  // one send, so Nagle doesn't hold the payload back behind the header
+  static __thread char msg[sizeof(struct mux_frame) + MUX_CHUNK];
+  struct mux_frame frame = { type, stream, 0, len, size };
+  mux_hton(&frame);
+  memcpy(msg, &frame, sizeof(frame));
+  if (len) {
+    memcpy(msg + sizeof(frame), payload, len);
+  }
+  if (send_all(sockfd, msg, sizeof(frame) + len) == -1) {
+    return -1;
+  }
+  return 0;
+}
+
+// report a finished stream and free its slot
+static void finish(struct mux_cstream *s, int err, mux_done_fn done, void *arg, int *active) {
+  if (s->file && fclose(s->file)) {
+    fprintf(stderr, "fclose: %s\n", strerror(errno));
+    err = -1;
+  }
+  if (err == 0) {
+    trace_end(s->type == GET ? "get" : "put", s->trace_start, conn_id, s->filename);
+  }
+  done(arg, s->job, err);
+  memset(s, 0, sizeof(*s));
+  (*active)--;
+}
+
+// open a stream for the next transfer
+// return: 0 on success (or a local failure already reported), -1 on a connection error
+static int open_stream(int sockfd, struct mux_cstream *s, enum ftp_req_type type,
+    char *filename, void *job, mux_done_fn done, void *arg, int *active) {
+  memset(s, 0, sizeof(*s));
+  s->in_use = 1;
+  s->id = ++next_stream;
+  s->type = type;
+  s->filename = filename;
+  s->job = job;
+  s->trace_start = trace_begin();
+  (*active)++;
+
+  if (strlen(filename) > MUX_CHUNK) {
+    fprintf(stderr, "Filename too long.\n");
+    finish(s, -1, done, arg, active);
+    return 0;
+  }
+  uint64_t size = 0;
+  if (type == PUT) {
+    // uploads are read from the start, so open before asking
+    s->file = fopen(filename, "r");
+    struct stat stats;
+    if (!s->file || fstat(fileno(s->file), &stats)) {
+      fprintf(stderr, "Failed to open %s for reading.\n", filename);
+      finish(s, -1, done, arg, active);
+      return 0;
+    }
+    size = stats.st_size;
+    s->remaining = size;
+  }
+  return send_frame(sockfd, type == GET ? MUX_GET : MUX_PUT, s->id, size, filename,
+      strlen(filename));
+}
+
+// act on one frame from the server
+// return: 0 on success, -1 on a connection error
+static int read_frame(int sockfd, struct mux_cstream *streams, mux_done_fn done,
+    void *arg, int *active) {
+  static __thread char buf[MUX_CHUNK];
+  struct mux_frame frame;
+  ssize_t received = recv(sockfd, &frame, sizeof(frame), MSG_WAITALL);
+  if (received != sizeof(frame)) {
+    fprintf(stderr, "Connection closed.\n");
+    return -1;
+  }
+  mux_ntoh(&frame);
+  if (frame.len > MUX_CHUNK || (frame.type != MUX_DATA && frame.len)) {
+    fprintf(stderr, "Bad frame from server.\n");
+    return -1;
+  }
+  if (frame.len && recv(sockfd, buf, frame.len, MSG_WAITALL) != (ssize_t) frame.len) {
+    fprintf(stderr, "Connection closed.\n");
+    return -1;
+  }
+
+  struct mux_cstream *s = NULL;
+  for (int i = 0; i < MUX_MAX_STREAMS; i++) {
+    if (streams[i].in_use && streams[i].id == frame.stream) {
+      s = &streams[i];
+    }
+  }
+  if (s == NULL) {
+    // a stream we already gave up on
+    return 0;
+  }
+
+  switch (frame.type) {
+    case MUX_RESP:
+      if (frame.result != SUCCESS) {
+        fprintf(stderr, frame.result == BUSY ? "Server has too many streams open.\n" :
+            s->type == GET ? "Server failed to read file.\n" : "Server failed to create file.\n");
+        finish(s, -1, done, arg, active);
+      } else if (s->type == GET) {
+        s->file = fopen(s->filename, "w");
+        if (!s->file) {
+          fprintf(stderr, "Failed to open %s for writing.\n", s->filename);
+          finish(s, -1, done, arg, active);
+          return send_frame(sockfd, MUX_RESET, frame.stream, 0, NULL, 0);
+        }
+        s->opened = 1;
+        s->remaining = frame.size;
+        if (s->remaining == 0) {
+          finish(s, 0, done, arg, active);
+        }
+      } else {
+        s->opened = 1;
+        s->window = MUX_WINDOW_INIT;
+      }
+      break;
+    case MUX_DATA:
+      if (s->type != GET || !s->opened || frame.len > s->remaining) {
+        fprintf(stderr, "Unexpected data from server.\n");
+        return -1;
+      }
+      fwrite(buf, 1, frame.len, s->file);
+      if (ferror(s->file)) {
+        fprintf(stderr, "fwrite: %s\n", strerror(errno));
+        finish(s, -1, done, arg, active);
+        return send_frame(sockfd, MUX_RESET, frame.stream, 0, NULL, 0);
+      }
+      s->remaining -= frame.len;
+      s->consumed += frame.len;
+      if (s->remaining == 0) {
+        finish(s, 0, done, arg, active);
+      } else if (s->consumed >= MUX_WINDOW_INIT / 2) {
+        uint64_t credit = s->consumed;
+        s->consumed = 0;
+        return send_frame(sockfd, MUX_WINDOW, frame.stream, credit, NULL, 0);
+      }
+      break;
+    case MUX_WINDOW:
+      s->window += frame.size;
+      break;
+    case MUX_DONE:
+      if (frame.result != SUCCESS) {
+        fprintf(stderr, "Server failed to write file.\n");
+      }
+      finish(s, frame.result == SUCCESS ? 0 : -1, done, arg, active);
+      break;
+    case MUX_RESET:
+      fprintf(stderr, "Server aborted transfer of %s.\n", s->filename);
+      finish(s, -1, done, arg, active);
+      break;
+    default:
+      fprintf(stderr, "Unknown frame type %u.\n", frame.type);
+      return -1;
+  }
+  return 0;
+}
+
+// send one chunk of an upload
+// return: 0 on success, -1 on a connection error
+static int send_chunk(int sockfd, struct mux_cstream *s, mux_done_fn done, void *arg,
+    int *active) {
+  static __thread char buf[MUX_CHUNK];
+  size_t len = MUX_CHUNK;
+  if (len > s->remaining) {
+    len = s->remaining;
+  }
+  if (len > s->window) {
+    len = s->window;
+  }
+  size_t num_read = fread(buf, 1, len, s->file);
+  if (num_read != len) {
+    fprintf(stderr, "fread: %s\n", ferror(s->file) ? strerror(errno) : "file shrank");
+    uint32_t id = s->id;
+    finish(s, -1, done, arg, active);
+    return send_frame(sockfd, MUX_RESET, id, 0, NULL, 0);
+  }
+  s->remaining -= len;
+  s->window -= len;
+  // the upload is done when the server says so with DONE
+  return send_frame(sockfd, MUX_DATA, s->id, 0, buf, len);
+}
+
+// run transfers over a multiplexed connection until next runs out
+// return: 0 if the connection is still usable, -1 if it failed (every
+//         transfer still open has been reported as failed)
+// max_streams: transfers to keep open at once
+// next: where transfers come from
+// done: called as each one finishes
+// arg: passed to next and done
+int mux_run(int sockfd, int max_streams, mux_next_fn next, mux_done_fn done, void *arg) {
+  struct mux_cstream streams[MUX_MAX_STREAMS];
+  memset(streams, 0, sizeof(streams));
+  if (max_streams > MUX_MAX_STREAMS) {
+    max_streams = MUX_MAX_STREAMS;
+  }
+
+  int active = 0;
+  int more = 1;
+  int err = 0;
+  while (err == 0) {
+    // keep the pipe full
+    for (int i = 0; i < MUX_MAX_STREAMS && more && active < max_streams && err == 0; i++) {
+      if (streams[i].in_use) {
+        continue;
+      }
+      enum ftp_req_type type;
+      char *filename;
+      void *job;
+      more = next(arg, &type, &filename, &job);
+      if (more) {
+        err = open_stream(sockfd, &streams[i], type, filename, job, done, arg, &active);
+      }
+    }
+    if (err || active == 0) {
+      break;
+    }
+
+    // smallest upload first, same as the server does for downloads
+    struct mux_cstream *best = NULL;
+    for (int i = 0; i < MUX_MAX_STREAMS; i++) {
+      struct mux_cstream *s = &streams[i];
+      if (s->in_use && s->type == PUT && s->opened && s->window > 0 && s->remaining > 0 &&
+          (best == NULL || s->remaining < best->remaining)) {
+        best = s;
+      }
+    }
+
+    struct pollfd pfd = { sockfd, POLLIN, 0 };
+    if (best) {
+      pfd.events |= POLLOUT;
+    }
+    if (poll(&pfd, 1, -1) == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      fprintf(stderr, "poll: %s\n", strerror(errno));
+      err = -1;
+      break;
+    }
+    if (pfd.revents & (POLLIN | POLLHUP | POLLERR)) {
+      err = read_frame(sockfd, streams, done, arg, &active);
+    } else if (best && (pfd.revents & POLLOUT)) {
+      err = send_chunk(sockfd, best, done, arg, &active);
+    }
+  }
+
+  if (err) {
+    for (int i = 0; i < MUX_MAX_STREAMS; i++) {
+      if (streams[i].in_use) {
+        finish(&streams[i], -1, done, arg, &active);
+      }
+    }
+    return -1;
+  }
+  return 0;
+}
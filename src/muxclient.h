@@ -0,0 +1,22 @@
+#ifndef MUXCLIENT_H
+#define MUXCLIENT_H
+
+#include "common.h"
+
+// hands out the next transfer to start
+// return: 1 if there is one, 0 when there are no more
+// arg: the argument passed to mux_run
+// type: set to GET or PUT
+// filename: set to the file to transfer
+// job: set to a pointer handed back to mux_done_fn
+typedef int (*mux_next_fn)(void *arg, enum ftp_req_type *type, char **filename, void **job);
+
+// called once for each transfer mux_next_fn handed out
+// err: 0 if the transfer completed, -1 otherwise
+typedef void (*mux_done_fn)(void *arg, void *job, int err);
+
+int mux_start(int sockfd);
+int mux_run(int sockfd, int max_streams, mux_next_fn next, mux_done_fn done, void *arg);
+int mux_end(int sockfd);
+
+#endif
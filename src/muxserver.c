@@ -0,0 +1,592 @@
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "metrics.h"
+#include "server.h"
+#include "stage.h"
+#include "store.h"
+#include "trace.h"
+
+// Multiplexed sessions. One thread still serves the whole connection, but
+// instead of blocking on one transfer it polls the socket: incoming frames
+// are handled as they arrive and outgoing DATA is produced one chunk at a
+// time from whichever download has the fewest bytes left, so a small file
+// finishes ahead of a large one that started earlier. Writes never block;
+// frames wait in an output buffer until the socket takes them, which keeps
+// the thread reading (and the client making progress) at all times.
+//
+// Uploads don't touch the disk from the thread either. Each PUT stream
+// fills the two halves of a window-sized buffer in turn, and a full half
+// goes to the data directory's I/O threads (store_submit); the finished
+// upload goes to the stage flusher. Both signal an eventfd the loop polls
+// along with the socket, and the client is credited with each half once
+// it is on disk, in file order, so a half is always written before the
+// client may send the bytes that reuse it.
+
+// stop reading new frames while this much output is waiting
+#define MUX_OUT_MAX (1024 * 1024)
+// one half of a PUT stream's buffer
+#define MUX_PUT_HALF (MUX_WINDOW_INIT / 2)
+
+struct mux_stream {
+  int in_use;
+  uint32_t id;
+  enum ftp_req_type type;  // GET or PUT
+  FILE *file;
+  struct stage stage;      // PUT: file is stage.file until the upload is published
+  char *filename;
+  uint64_t remaining;      // bytes still to send (GET) or receive (PUT)
+  uint64_t window;         // GET: bytes the client will still accept
+  uint64_t size;           // PUT: the upload's size
+  uint64_t written;        // PUT: bytes on disk, in file order, all credited back
+  int disk;                // PUT: the data directory the upload goes to
+  char *buf;               // PUT: two halves of MUX_PUT_HALF, filled in turn
+  struct store_io io[2];   // PUT: the write of each half, in flight while len != 0
+  int committing;          // PUT: handed to the stage flusher
+  uint64_t start;
+  uint64_t trace_start;
+};
+
+struct mux_conn {
+  struct session *sess;
+  int wakefd;              // eventfd, signalled when a write or commit is done
+  struct mux_stream streams[MUX_MAX_STREAMS];
+  int active;
+  char *out;
+  size_t out_len;
+  size_t out_off;
+  size_t out_cap;
+  struct shape_transfer shaper;
+  struct rate_window window;
+};
+
+// make room for len more bytes of output
+// return: pointer to the free space, NULL if out of memory
+static char *out_reserve(struct mux_conn *c, size_t len) {
+  if (c->out_len + len > c->out_cap) {
+    size_t cap = c->out_cap ? c->out_cap : 2 * (sizeof(struct mux_frame) + MUX_CHUNK);
+    while (cap < c->out_len + len) {
+      cap *= 2;
+    }
+    char *bigger = realloc(c->out, cap);
+    if (bigger == NULL) {
+      log_msg(LOG_ERROR, "Out of memory.");
+      return NULL;
+    }
+    c->out = bigger;
+    c->out_cap = cap;
+  }
+  return c->out + c->out_len;
+}
+
+// queue a frame with no payload
+// return: 0 on success, -1 if out of memory
+static int queue_frame(struct mux_conn *c, uint32_t type, uint32_t stream,
+    uint32_t result, uint64_t size) {
+  struct mux_frame frame = { type, stream, result, 0, size };
+  char *space = out_reserve(c, sizeof(frame));
+  if (space == NULL) {
+    return -1;
+  }
+  mux_hton(&frame);
+  memcpy(space, &frame, sizeof(frame));
+  c->out_len += sizeof(frame);
+  return 0;
+}
+
+// send as much queued output as the socket will take without blocking
+// return: 0 on success, -1 on error
+static int flush_out(struct mux_conn *c) {
+  while (c->out_off < c->out_len) {
+    ssize_t n = send(c->sess->connfd, c->out + c->out_off, c->out_len - c->out_off,
+        MSG_DONTWAIT);
+    if (n == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return 0;
+      } else if (errno == EINTR) {
+        continue;
+      }
+      log_msg(LOG_ERROR, "send: %s", strerror(errno));
+      return -1;
+    }
+    c->out_off += n;
+  }
+  c->out_off = c->out_len = 0;
+  return 0;
+}
+
+static struct mux_stream *find_stream(struct mux_conn *c, uint32_t id) {
+  for (int i = 0; i < MUX_MAX_STREAMS; i++) {
+    if (c->streams[i].in_use && c->streams[i].id == id) {
+      return &c->streams[i];
+    }
+  }
+  return NULL;
+}
+
+// store and stage notify hook: wake the session's poll loop
+static void wake(void *arg) {
+  struct mux_conn *c = arg;
+  uint64_t one = 1;
+  // never blocks, a counter that is already set is still a wakeup
+  ssize_t n = write(c->wakefd, &one, sizeof(one));
+  (void) n;
+}
+
+// finish a stream and free its slot
+// ok: whether the transfer completed
+static void close_stream(struct mux_conn *c, struct mux_stream *s, int ok) {
+  if (s->type == PUT) {
+    // only a stream torn down mid-write waits here, for the I/O threads to
+    // let go of its buffer and for a commit already handed over
+    for (int i = 0; i < 2; i++) {
+      if (s->io[i].len) {
+        store_wait(s->disk, &s->io[i]);
+      }
+    }
+    if (s->committing) {
+      stage_commit_end(&s->stage);
+      s->file = NULL;
+    }
+    free(s->buf);
+  }
+  if (s->file && s->type == PUT) {
+    // an unfinished upload
+    stage_abort(&s->stage);
+  } else if (s->file && fclose(s->file)) {
+    log_msg(LOG_ERROR, "fclose: %s", strerror(errno));
+  }
+  if (ok) {
+    metrics_add(s->type == GET ? M_GET : M_PUT, 1);
+    metrics_record(s->type == GET ? H_GET : H_PUT, now_ns() - s->start);
+    trace_end(s->type == GET ? "get" : "put", s->trace_start, c->sess->id, s->filename);
+  } else {
+    log_msg(LOG_WARN, "%s %s (stream %u) failed.", s->type == GET ? "GET" : "PUT",
+        s->filename, s->id);
+  }
+  free(s->filename);
+  memset(s, 0, sizeof(*s));
+  if (--c->active == 0) {
+    shape_finish(&c->shaper);
+  }
+}
+
+// hand a PUT that is all on disk to the stage flusher
+// return: 0 on success, -1 if out of memory
+static int commit_put(struct mux_conn *c, struct mux_stream *s) {
+  if (stage_commit_start(&s->stage, wake, c)) {
+    // already discarded
+    s->file = NULL;
+    uint32_t id = s->id;
+    close_stream(c, s, 0);
+    return queue_frame(c, MUX_DONE, id, FAILURE, 0);
+  }
+  s->committing = 1;
+  return 0;
+}
+
+// move a PUT stream along after a wakeup: credit the client with the
+// halves that are on disk, then publish the upload once all of it is
+// return: 0 on success, -1 if out of memory
+static int put_progress(struct mux_conn *c, struct mux_stream *s) {
+  if (s->committing) {
+    if (!stage_commit_done(&s->stage)) {
+      return 0;
+    }
+    uint32_t id = s->id;
+    int ok = stage_commit_end(&s->stage) == 0;
+    s->file = NULL;
+    s->committing = 0;
+    close_stream(c, s, ok);
+    return queue_frame(c, MUX_DONE, id, ok ? SUCCESS : FAILURE, 0);
+  }
+
+  for (;;) {
+    struct store_io *io = &s->io[(s->written / MUX_PUT_HALF) % 2];
+    if (io->len == 0 || !store_done(s->disk, io)) {
+      break;
+    }
+    if (store_wait(s->disk, io) == -1) {
+      log_msg(LOG_ERROR, "pwrite: %s", strerror(errno));
+      uint32_t id = s->id;
+      io->len = 0;
+      close_stream(c, s, 0);
+      return queue_frame(c, MUX_DONE, id, FAILURE, 0);
+    }
+    uint64_t len = io->len;
+    io->len = 0;
+    s->written += len;
+    // on disk, so the client may send that much more
+    if (s->remaining > 0 && queue_frame(c, MUX_WINDOW, s->id, 0, len)) {
+      return -1;
+    }
+  }
+  if (s->written == s->size) {
+    return commit_put(c, s);
+  }
+  return 0;
+}
+
+// open a stream for a GET or PUT frame
+// return: 0 on success, -1 on error
+// frame: the request
+// filename: the payload, owned by the stream from here on
+static int open_stream(struct mux_conn *c, struct mux_frame *frame, char *filename) {
+  if (find_stream(c, frame->stream)) {
+    log_msg(LOG_ERROR, "Stream %u is already open.", frame->stream);
+    free(filename);
+    return -1;
+  }
+  struct mux_stream *s = NULL;
+  for (int i = 0; i < MUX_MAX_STREAMS && s == NULL; i++) {
+    if (!c->streams[i].in_use) {
+      s = &c->streams[i];
+    }
+  }
+  if (s == NULL) {
+    free(filename);
+    return queue_frame(c, MUX_RESP, frame->stream, BUSY, 0);
+  }
+
+  int get = frame->type == MUX_GET;
+  log_msg(LOG_INFO, "%s %s (stream %u)", get ? "GET" : "PUT", filename, frame->stream);
+  uint64_t trace_start = trace_begin();
+  FILE *file = NULL;
+  char path[PATH_MAX];
+  if (get) {
+    file = store_find(filename, path) == -1 ? NULL : fopen(path, "r");
+  } else if (store_mkdirs(filename) == 0 && (s->disk = store_path(filename, path)) != -1 &&
+      stage_open(&s->stage, path, 0) == 0) {
+    file = s->stage.file;
+    s->buf = malloc(2 * MUX_PUT_HALF);
+    if (s->buf == NULL) {
+      log_msg(LOG_ERROR, "Out of memory.");
+      stage_abort(&s->stage);
+      file = NULL;
+    }
+  }
+  struct stat stats;
+  if (file && get && fstat(fileno(file), &stats)) {
+    log_msg(LOG_ERROR, "stat: %s", strerror(errno));
+    fclose(file);
+    file = NULL;
+  }
+  if (!file) {
+    log_msg(LOG_ERROR, "Failed to open requested file for %s.", get ? "reading" : "writing");
+    free(filename);
+    return queue_frame(c, MUX_RESP, frame->stream, FAILURE, 0);
+  }
+
+  s->in_use = 1;
+  s->id = frame->stream;
+  s->type = get ? GET : PUT;
+  s->file = file;
+  s->filename = filename;
+  s->remaining = get ? (uint64_t) stats.st_size : frame->size;
+  s->size = s->remaining;
+  s->window = MUX_WINDOW_INIT;
+  s->start = now_ns();
+  s->trace_start = trace_start;
+  if (c->active++ == 0) {
+    shape_start(&c->shaper, c->sess->user, c->sess->conn_rate);
+    rate_start(&c->window, c->sess, SO_SNDTIMEO);
+  }
+
+  if (queue_frame(c, MUX_RESP, s->id, SUCCESS, s->remaining)) {
+    return -1;
+  }
+  if (s->remaining == 0) {
+    // nothing to move: an empty GET is already complete
+    if (get) {
+      close_stream(c, s, 1);
+      return 0;
+    }
+    return commit_put(c, s);
+  }
+  return 0;
+}
+
+// queue one DATA frame from the download with the least left to send
+// return: 0 on success, -1 if the connection should be closed
+static int fill_out(struct mux_conn *c) {
+  struct mux_stream *best = NULL;
+  for (int i = 0; i < MUX_MAX_STREAMS; i++) {
+    struct mux_stream *s = &c->streams[i];
+    if (s->in_use && s->type == GET && s->window > 0 &&
+        (best == NULL || s->remaining < best->remaining)) {
+      best = s;
+    }
+  }
+  if (best == NULL) {
+    return 0;
+  }
+
+  size_t len = MUX_CHUNK;
+  if (len > best->remaining) {
+    len = best->remaining;
+  }
+  if (len > best->window) {
+    len = best->window;
+  }
+  char *space = out_reserve(c, sizeof(struct mux_frame) + len);
+  if (space == NULL) {
+    return -1;
+  }
+  // a file that shrank since it was opened can't deliver what we announced
+  size_t num_read = fread(space + sizeof(struct mux_frame), 1, len, best->file);
+  if (num_read != len) {
+    log_msg(LOG_ERROR, "fread: %s", ferror(best->file) ? strerror(errno) : "short read");
+    uint32_t id = best->id;
+    close_stream(c, best, 0);
+    return queue_frame(c, MUX_RESET, id, FAILURE, 0);
+  }
+  uint64_t slept = shape_wait(&c->shaper, len);
+  struct mux_frame frame = { MUX_DATA, best->id, 0, len, 0 };
+  mux_hton(&frame);
+  memcpy(space, &frame, sizeof(frame));
+  c->out_len += sizeof(frame) + len;
+  metrics_add(M_BYTES_OUT, len);
+
+  best->remaining -= len;
+  best->window -= len;
+  if (best->remaining == 0) {
+    close_stream(c, best, 1);
+  }
+  return rate_check(&c->window, len, slept);
+}
+
+// take upload bytes for a stream
+// return: 0 on success, -1 if the connection should be closed
+static int take_data(struct mux_conn *c, struct mux_frame *frame, char *buf) {
+  struct mux_stream *s = find_stream(c, frame->stream);
+  if (s == NULL || s->type != PUT) {
+    // the stream failed or was reset while this was in flight
+    return 0;
+  }
+  if (frame->len > s->remaining) {
+    log_msg(LOG_ERROR, "Stream %u sent more than its file size.", s->id);
+    return -1;
+  }
+  metrics_add(M_BYTES_IN, frame->len);
+  uint64_t slept = shape_wait(&c->shaper, frame->len);
+
+  uint64_t off = s->size - s->remaining;
+  size_t done = 0;
+  while (done < frame->len) {
+    int half = (off / MUX_PUT_HALF) % 2;
+    size_t at = off % MUX_PUT_HALF;
+    if (s->io[half].len) {
+      log_msg(LOG_ERROR, "Stream %u sent more than its window.", s->id);
+      return -1;
+    }
+    size_t len = MUX_PUT_HALF - at;
+    if (len > frame->len - done) {
+      len = frame->len - done;
+    }
+    memcpy(s->buf + half * MUX_PUT_HALF + at, buf + done, len);
+    done += len;
+    off += len;
+    // a full half, or the end of the upload, goes to the disk
+    if (at + len == MUX_PUT_HALF || off == s->size) {
+      s->io[half] = (struct store_io) { .fd = fileno(s->file), .op = STORE_WRITE,
+        .buf = s->buf + half * MUX_PUT_HALF, .len = at + len, .off = off - (at + len),
+        .notify = wake, .arg = c };
+      store_submit(s->disk, &s->io[half]);
+    }
+  }
+  s->remaining -= frame->len;
+  return rate_check(&c->window, frame->len, slept);
+}
+
+// read and act on one frame
+// return: 0 to keep going, 1 after END, -1 on error (connection already closed
+//         if recv failed)
+static int read_frame(struct mux_conn *c, int *closed) {
+  static __thread char buf[MUX_CHUNK];
+  uint64_t deadline = header_timeout ? now_ns() + header_timeout : 0;
+  struct mux_frame frame;
+  if (recv_msg(c->sess, &frame, sizeof(frame), "frame", deadline)) {
+    *closed = 1;
+    return -1;
+  }
+  mux_ntoh(&frame);
+
+  switch (frame.type) {
+    case MUX_GET:
+    case MUX_PUT: {
+      if (frame.len == 0 || frame.len > MAX_NAME_LEN) {
+        log_msg(LOG_ERROR, "Bad filename length.");
+        return -1;
+      }
+      char *filename = malloc(frame.len + 1);
+      if (filename == NULL) {
+        log_msg(LOG_ERROR, "Out of memory.");
+        return -1;
+      }
+      filename[frame.len] = '\0';
+      if (recv_msg(c->sess, filename, frame.len, "filename", deadline)) {
+        free(filename);
+        *closed = 1;
+        return -1;
+      }
+      return open_stream(c, &frame, filename);
+    }
+    case MUX_DATA:
+      if (frame.len > MUX_CHUNK) {
+        log_msg(LOG_ERROR, "DATA frame too large.");
+        return -1;
+      }
+      if (recv_msg(c->sess, buf, frame.len, "data", deadline)) {
+        *closed = 1;
+        return -1;
+      }
+      return take_data(c, &frame, buf);
+    case MUX_WINDOW: {
+      struct mux_stream *s = find_stream(c, frame.stream);
+      if (s && s->type == GET) {
+        s->window += frame.size;
+      }
+      break;
+    }
+    case MUX_RESET: {
+      struct mux_stream *s = find_stream(c, frame.stream);
+      if (s) {
+        close_stream(c, s, 0);
+      }
+      break;
+    }
+    case MUX_END:
+      return 1;
+    default:
+      log_msg(LOG_ERROR, "Unknown frame type %u.", frame.type);
+      return -1;
+  }
+  if (frame.len) {
+    log_msg(LOG_ERROR, "Unexpected payload.");
+    return -1;
+  }
+  return 0;
+}
+
+// serve a session in multiplexed mode until END
+// return: 0 after a clean END, -1 if the connection was closed on error
+// sess: the session, after the MUX request has been answered
+int serve_mux(struct session *sess) {
+  struct mux_conn *c = calloc(1, sizeof(*c));
+  if (c == NULL) {
+    log_msg(LOG_ERROR, "Out of memory.");
+    close_conn(sess->connfd);
+    return -1;
+  }
+  c->sess = sess;
+  c->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (c->wakefd == -1) {
+    log_msg(LOG_ERROR, "eventfd: %s", strerror(errno));
+    free(c);
+    close_conn(sess->connfd);
+    return -1;
+  }
+
+  // frames are written whole from the output buffer, so Nagle only adds delay
+  int nodelay = 1;
+  setsockopt(sess->connfd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+  // keep little unsent data in the kernel, or a small stream opened later
+  // waits behind megabytes of a large one that were already handed over
+  int lowat = MUX_LOWAT;
+  setsockopt(sess->connfd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat));
+
+  int closed = 0;
+  int err = 0;
+  for (;;) {
+    if (c->out_len == 0) {
+      err = fill_out(c);
+      if (err) {
+        break;
+      }
+    }
+
+    // wait for the idle timeout between transfers, and give up on a stalled
+    // transfer the same way serve_get and serve_put do
+    uint64_t timeout = c->active ? (min_rate ? RATE_WINDOW_NS : idle_timeout) : idle_timeout;
+    struct pollfd fds[2] = { { sess->connfd, 0, 0 }, { c->wakefd, POLLIN, 0 } };
+    struct pollfd *pfd = &fds[0];
+    if (c->out_len - c->out_off < MUX_OUT_MAX) {
+      pfd->events |= POLLIN;
+    }
+    if (c->out_len > c->out_off) {
+      pfd->events |= POLLOUT;
+    }
+    int n = poll(fds, 2, timeout ? (int) (timeout / 1000000) : -1);
+    if (n == -1 && errno == EINTR) {
+      continue;
+    } else if (n == -1) {
+      log_msg(LOG_ERROR, "poll: %s", strerror(errno));
+      err = -1;
+      break;
+    } else if (n == 0) {
+      log_msg(LOG_WARN, c->active ? "Timed out moving stream data." :
+          "Timed out waiting for file request.");
+      metrics_add(M_TIMEOUTS, 1);
+      err = -1;
+      break;
+    }
+
+    if (fds[1].revents & POLLIN) {
+      // writes or commits are done, see which
+      uint64_t count;
+      ssize_t got = read(c->wakefd, &count, sizeof(count));
+      (void) got;
+      for (int i = 0; i < MUX_MAX_STREAMS && err == 0; i++) {
+        if (c->streams[i].in_use && c->streams[i].type == PUT) {
+          err = put_progress(c, &c->streams[i]);
+        }
+      }
+      if (err) {
+        break;
+      }
+    }
+    if (pfd->revents & POLLOUT) {
+      err = flush_out(c);
+      if (err) {
+        break;
+      }
+    }
+    if (pfd->revents & (POLLIN | POLLHUP | POLLERR)) {
+      err = read_frame(c, &closed);
+      if (err) {
+        break;
+      }
+    }
+  }
+
+  // anything still open didn't finish
+  for (int i = 0; i < MUX_MAX_STREAMS; i++) {
+    if (c->streams[i].in_use) {
+      close_stream(c, &c->streams[i], 0);
+    }
+  }
+  if (err == 1 && c->out_len > c->out_off) {
+    // END: deliver the last DONE frames before closing
+    send_all(sess->connfd, c->out + c->out_off, c->out_len - c->out_off);
+  }
+  // nothing can signal it any more, close_stream waited for every write
+  close(c->wakefd);
+  free(c->out);
+  free(c);
+  if (closed) {
+    return -1;
+  }
+  close_conn(sess->connfd);
+  log_msg(LOG_INFO, "Connection closed.");
+  return err == 1 ? 0 : -1;
+}
@@ -0,0 +1,170 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "progress.h"
+
+// Files being written that other sessions want to read before they're
+// done: relay fetches, and uploads that a GET may follow. The writer
+// registers the name, says how big the file will be and reports each piece
+// as it lands; readers wait for the bytes they need and read them from the
+// writer's file. An entry leaves the registry when the
+// writer finishes, and is freed when the last reader lets go of it.
+
+static pthread_mutex_t progress_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct progress *active = NULL;
+
+// find the file being written under name, or start a new one
+// return: a reference to the entry, NULL if out of memory
+// name: the file's name
+// created: set to 1 if the caller is now the writer, 0 if it's a reader
+struct progress *progress_claim(char *name, int *created) {
+  pthread_mutex_lock(&progress_lock);
+  struct progress *p;
+  for (p = active; p; p = p->next) {
+    if (strcmp(p->name, name) == 0) {
+      p->refs++;
+      *created = 0;
+      pthread_mutex_unlock(&progress_lock);
+      return p;
+    }
+  }
+  p = calloc(1, sizeof(*p));
+  if (p == NULL || (p->name = strdup(name)) == NULL) {
+    log_msg(LOG_ERROR, "Out of memory.");
+    free(p);
+    pthread_mutex_unlock(&progress_lock);
+    return NULL;
+  }
+  // one reference for the caller, one for the registry until it finishes
+  p->refs = 2;
+  p->fd = -1;
+  p->state = PROGRESS_STARTING;
+  pthread_cond_init(&p->changed, NULL);
+  p->next = active;
+  active = p;
+  *created = 1;
+  pthread_mutex_unlock(&progress_lock);
+  return p;
+}
+
+// find the file being written under name, without starting one
+// return: a reference to the entry, NULL if nothing is writing it
+// name: the file's name
+struct progress *progress_find(char *name) {
+  pthread_mutex_lock(&progress_lock);
+  struct progress *p;
+  for (p = active; p; p = p->next) {
+    if (strcmp(p->name, name) == 0) {
+      p->refs++;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&progress_lock);
+  return p;
+}
+
+// the writer knows the size and has a file for readers to read
+// fd: the file being written, duplicated so the writer may close it
+// size: the final size
+void progress_ready(struct progress *p, int fd, uint64_t size) {
+  int copy = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+  if (copy == -1) {
+    log_msg(LOG_ERROR, "dup: %s", strerror(errno));
+  }
+  pthread_mutex_lock(&progress_lock);
+  p->fd = copy;
+  p->size = size;
+  p->state = copy == -1 ? PROGRESS_FAILED : PROGRESS_RUNNING;
+  pthread_cond_broadcast(&p->changed);
+  pthread_mutex_unlock(&progress_lock);
+}
+
+// the writer has written this much of the file
+void progress_advance(struct progress *p, uint64_t have) {
+  pthread_mutex_lock(&progress_lock);
+  p->have = have;
+  pthread_cond_broadcast(&p->changed);
+  pthread_mutex_unlock(&progress_lock);
+}
+
+// the writer is done; later claims of the name start over. This drops the
+// registry's reference, so p may be gone once it returns unless the caller
+// holds its own.
+// ok: the whole file was written
+void progress_finish(struct progress *p, int ok) {
+  pthread_mutex_lock(&progress_lock);
+  if (p->state != PROGRESS_FAILED) {
+    p->state = ok ? PROGRESS_DONE : PROGRESS_FAILED;
+  }
+  pthread_cond_broadcast(&p->changed);
+  int listed = 0;
+  for (struct progress **q = &active; *q; q = &(*q)->next) {
+    if (*q == p) {
+      *q = p->next;
+      listed = 1;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&progress_lock);
+  if (listed) {
+    progress_put(p);
+  }
+}
+
+// wait until the file is ready and at least want bytes are written
+// return: 0 on success, -1 if the writer failed first
+// want: bytes needed, 0 to wait only for the size
+// have: set to the bytes written so far
+int progress_wait(struct progress *p, uint64_t want, uint64_t *have) {
+  pthread_mutex_lock(&progress_lock);
+  for (;;) {
+    if (p->state == PROGRESS_FAILED) {
+      pthread_mutex_unlock(&progress_lock);
+      return -1;
+    }
+    if (p->state != PROGRESS_STARTING && (p->have >= want || p->have >= p->size)) {
+      break;
+    }
+    if (p->state == PROGRESS_DONE) {
+      // finished short of what was announced
+      pthread_mutex_unlock(&progress_lock);
+      return -1;
+    }
+    pthread_cond_wait(&p->changed, &progress_lock);
+  }
+  *have = p->have;
+  pthread_mutex_unlock(&progress_lock);
+  return 0;
+}
+
+// wait until the writer is done
+// return: 0 if it wrote the whole file, -1 if it failed
+int progress_done(struct progress *p) {
+  pthread_mutex_lock(&progress_lock);
+  while (p->state == PROGRESS_STARTING || p->state == PROGRESS_RUNNING) {
+    pthread_cond_wait(&p->changed, &progress_lock);
+  }
+  int ok = p->state == PROGRESS_DONE;
+  pthread_mutex_unlock(&progress_lock);
+  return ok ? 0 : -1;
+}
+
+// let go of a reference from progress_claim or progress_find
+void progress_put(struct progress *p) {
+  pthread_mutex_lock(&progress_lock);
+  int last = --p->refs == 0;
+  pthread_mutex_unlock(&progress_lock);
+  if (last) {
+    if (p->fd != -1) {
+      close(p->fd);
+    }
+    pthread_cond_destroy(&p->changed);
+    free(p->name);
+    free(p);
+  }
+}
@@ -0,0 +1,30 @@
+#ifndef PROGRESS_H
+#define PROGRESS_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+// a file being written that readers can follow as it grows
+struct progress {
+  struct progress *next;
+  char *name;
+  int refs;
+  int fd;         // readable copy of the writer's file, -1 until ready
+  uint64_t size;  // final size, known once ready
+  uint64_t have;  // bytes written so far
+  int state;
+  pthread_cond_t changed;
+};
+
+enum progress_state { PROGRESS_STARTING, PROGRESS_RUNNING, PROGRESS_DONE, PROGRESS_FAILED };
+
+struct progress *progress_claim(char *name, int *created);
+void progress_ready(struct progress *p, int fd, uint64_t size);
+void progress_advance(struct progress *p, uint64_t have);
+void progress_finish(struct progress *p, int ok);
+int progress_wait(struct progress *p, uint64_t want, uint64_t *have);
+int progress_done(struct progress *p);
+struct progress *progress_find(char *name);
+void progress_put(struct progress *p);
+
+#endif
@@ -0,0 +1,193 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "affinity.h"
+#include "clientlib.h"
+#include "log.h"
+#include "metrics.h"
+#include "progress.h"
+#include "relay.h"
+#include "stage.h"
+#include "store.h"
+#include "trace.h"
+
+// Relaying: a GET for a file we don't have is fetched from an upstream
+// TigerS with the client's own code and kept, so the next GET is local.
+// The first miss starts a fetcher thread that writes the upstream's data
+// to a staged file and reports its progress; every requester for the file,
+// including the first, streams from that staged file as it fills, so a
+// burst of misses for one file costs one upstream transfer and nobody
+// waits for the whole file before their first byte.
+
+static char *upstream_host = NULL;
+static char *upstream_user = NULL;
+static char *upstream_pass = NULL;
+
+// set up relaying to an upstream server
+// return: 0 on success, -1 if spec is malformed
+// spec: user:pass@host[:port]
+int relay_init(char *spec) {
+  char *copy = strdup(spec);
+  if (copy == NULL) {
+    return -1;
+  }
+  // the password may hold an @, the host can't
+  char *at = strrchr(copy, '@');
+  char *colon = strchr(copy, ':');
+  if (at == NULL || colon == NULL || colon > at || at[1] == '\0') {
+    free(copy);
+    return -1;
+  }
+  *at = '\0';
+  *colon = '\0';
+  upstream_user = copy;
+  upstream_pass = colon + 1;
+  upstream_host = at + 1;
+  return 0;
+}
+
+// return: 1 if misses go to an upstream server
+int relay_enabled(void) {
+  return upstream_host != NULL;
+}
+
+// offer a file that showed up locally since the miss
+// return: 0 on success, -1 if it isn't here
+static int fetch_local(struct progress *p) {
+  char path[PATH_MAX];
+  FILE *file = store_find(p->name, path) == -1 ? NULL : fopen(path, "r");
+  if (file == NULL) {
+    return -1;
+  }
+  struct stat stats;
+  if (fstat(fileno(file), &stats) || !S_ISREG(stats.st_mode)) {
+    fclose(file);
+    return -1;
+  }
+  progress_ready(p, fileno(file), stats.st_size);
+  progress_advance(p, stats.st_size);
+  fclose(file);
+  return 0;
+}
+
+// copy a file from the upstream into a staged local file
+// return: 0 on success, -1 on error
+static int fetch_upstream(struct progress *p) {
+  int sockfd = open_conn(upstream_host);
+  if (sockfd == -1) {
+    log_msg(LOG_ERROR, "Failed to connect to upstream %s.", upstream_host);
+    return -1;
+  }
+  // a stalled upstream fails the fetch rather than hanging its readers
+  set_timeout(sockfd, SO_RCVTIMEO, idle_timeout);
+  int err = do_auth(sockfd, upstream_user, upstream_pass);
+  if (err) {
+    log_msg(LOG_ERROR, "Upstream %s refused login (%d).", upstream_host, err);
+    close_conn(sockfd);
+    return -1;
+  }
+  uint64_t filesize;
+  err = get_request(sockfd, p->name, 0, &filesize);
+  if (err) {
+    log_msg(LOG_INFO, "Upstream failed to get %s.", p->name);
+    close_conn(sockfd);
+    return -1;
+  }
+  char path[PATH_MAX];
+  struct stage stage;
+  if (store_mkdirs(p->name) || store_path(p->name, path) == -1 ||
+      stage_open(&stage, path, 0)) {
+    close_conn(sockfd);
+    return -1;
+  }
+  progress_ready(p, fileno(stage.file), filesize);
+
+  char *buf = affinity_alloc(RELAY_BUF);
+  if (buf == NULL) {
+    log_msg(LOG_ERROR, "Failed to allocate a buffer for %s.", p->name);
+  }
+  uint64_t have = 0;
+  while (buf && have < filesize) {
+    size_t to_receive = filesize - have < RELAY_BUF ? filesize - have : RELAY_BUF;
+    ssize_t received = recv(sockfd, buf, to_receive, 0);
+    if (received == 0) {
+      log_msg(LOG_ERROR, "Upstream closed the connection during %s.", p->name);
+      break;
+    } else if (received == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      log_msg(LOG_ERROR, "recv from upstream: %s", strerror(errno));
+      break;
+    }
+    // readers sendfile from the file, so it must be past stdio before they hear
+    if (fwrite(buf, 1, received, stage.file) != (size_t) received || fflush(stage.file)) {
+      log_msg(LOG_ERROR, "fwrite: %s", strerror(errno));
+      break;
+    }
+    have += received;
+    metrics_add(M_BYTES_IN, received);
+    progress_advance(p, have);
+  }
+  affinity_free(buf, RELAY_BUF);
+  if (have < filesize) {
+    stage_abort(&stage);
+    close_conn(sockfd);
+    return -1;
+  }
+  send_close(sockfd);
+  close_conn(sockfd);
+  // committed before the entry goes, so a later miss finds the file
+  return stage_commit(&stage);
+}
+
+// fetcher thread, p lives on the registry's reference until it finishes
+static void *fetch(void *arg) {
+  struct progress *p = arg;
+  uint64_t trace_start = trace_begin();
+  int err = fetch_local(p);
+  if (err) {
+    log_msg(LOG_INFO, "RELAY %s from %s", p->name, upstream_host);
+    metrics_add(M_RELAY_FETCHES, 1);
+    err = fetch_upstream(p);
+    trace_end("relay", trace_start, 0, p->name);
+  }
+  progress_finish(p, err == 0);
+  return NULL;
+}
+
+// serve a GET for a file we don't have from the upstream
+// return: 0 on success, -1 if the connection was closed
+// filename: the file requested
+// follow: the request was a GET_FOLLOW, see common.h
+int relay_get(struct session *sess, char *filename, int follow) {
+  int connfd = sess->connfd;
+  uint64_t start = now_ns();
+  uint64_t trace_request = trace_begin();
+
+  int created;
+  struct progress *p = progress_claim(filename, &created);
+  if (p == NULL) {
+    return send_fail(connfd, GET);
+  }
+  if (created) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, fetch, p)) {
+      log_msg(LOG_ERROR, "Failed to start a relay fetch.");
+      progress_finish(p, 0);
+    } else {
+      pthread_detach(thread);
+    }
+  } else {
+    metrics_add(M_RELAY_COALESCED, 1);
+  }
+
+  return serve_follow(sess, p, filename, follow, start, trace_request);
+}
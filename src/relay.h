@@ -0,0 +1,13 @@
+#ifndef RELAY_H
+#define RELAY_H
+
+#include "server.h"
+
+// bytes read from the upstream at once
+#define RELAY_BUF (64 * 1024)
+
+int relay_init(char *spec);
+int relay_enabled(void);
+int relay_get(struct session *sess, char *filename, int follow);
+
+#endif
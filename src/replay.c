@@ -0,0 +1,545 @@
+// Data & Communication Networks
+// Project 1 - Socket Programming
+// Peter Fabinski (pnf9945)
+// TigerReplay - replays a capture (TigerS -W) against a server
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "bench.h"
+#include "capture.h"
+#include "tls.h"
+
+// the capture format is described in capture.h; each captured session is
+// replayed by its own thread, connecting at the time it connected and
+// sending each request at the time it arrived, or as soon as the previous
+// one is done if the server is behind. Files the capture only reads are
+// uploaded first with the sizes their GETs saw, filled with zeros; PUTs
+// upload zeros. Sessions that didn't log in, and requests that failed, are
+// skipped, since what was missing on the captured server is unknown.
+
+#define TABLE_MIN 1024
+
+// what a capture line records; the results are kept per kind, with the
+// login timed as "connect"
+enum replay_kind { R_OPEN, R_AUTH, R_GET, R_PUT, R_LIST, R_COPY, R_MOVE, R_STATS, R_END, R_CLOSE,
+  R_OTHER, R_NUM };
+
+static const char *kinds[R_NUM] = { "OPEN", "AUTH", "GET", "PUT", "LIST", "COPY", "MOVE", "STATS",
+  "END", "CLOSE" };
+static const char *op_names[R_NUM] = { "open", "connect", "get", "put", "list", "copy", "move",
+  "stats", "end", "close", "other" };
+
+// one captured event
+struct replay_event {
+  uint64_t time_us;
+  unsigned long long pid;
+  unsigned long long conn;
+  enum replay_kind op;
+  uint64_t size;
+  int ok;
+  char *name;     // NUL terminated, and may contain NULs for COPY and MOVE
+  size_t name_len;
+};
+
+// one captured session and, after the run, its results
+struct replay_session {
+  pthread_t thread;
+  struct replay_event *events;
+  size_t count;
+  struct lat_samples lat[R_NUM];
+  struct lat_samples lag;
+  uint64_t bytes;
+  uint64_t requests;
+  uint64_t skipped;
+  uint64_t errors;
+};
+
+// a file the replay touches, to find what to upload first
+struct replay_name {
+  char *name;
+  uint64_t size;
+  int seen;
+};
+
+static char *host = "127.0.0.1";
+static char *user = "user";
+static char *pass = "pass";
+static double speed = 1.0;
+static int setup = 1;
+static uint64_t capture_start_us; // first event in the capture
+static uint64_t replay_start;     // now_ns() when the replay began
+
+static int load_capture(char *path, struct replay_event **events, size_t *count);
+static int parse_event(char *line, struct replay_event *e);
+static int cmp_session(const void *a, const void *b);
+static int cmp_time(const void *a, const void *b);
+static int upload_files(struct replay_event *events, size_t count);
+static void *replay_session(void *arg);
+static void wait_until(uint64_t ns);
+
+int main(int argc, char **argv) {
+  int opt;
+  while ((opt = getopt(argc, argv, "h:u:p:x:e:S")) != -1) {
+    switch (opt) {
+      case 'h': host = optarg; break;
+      case 'u': user = optarg; break;
+      case 'p': pass = optarg; break;
+      case 'x': speed = atof(optarg); break;
+      case 'S': setup = 0; break;
+      case 'e':
+        if (tls_client_init(optarg)) {
+          return 1;
+        }
+        break;
+      default:
+        replay_usage();
+        return 1;
+    }
+  }
+  if (optind != argc - 1 || !(speed > 0)) {
+    replay_usage();
+    return 1;
+  }
+
+  struct replay_event *events;
+  size_t count;
+  if (load_capture(argv[optind], &events, &count)) {
+    return 1;
+  }
+  if (count == 0) {
+    fprintf(stderr, "Nothing in the capture.\n");
+    return 1;
+  }
+
+  // sessions still transferring when the server goes away see EPIPE
+  signal(SIGPIPE, SIG_IGN);
+
+  if (setup && upload_files(events, count)) {
+    return 1;
+  }
+
+  // group the events by session, each in time order
+  qsort(events, count, sizeof(*events), cmp_session);
+  size_t num_sessions = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (i == 0 || events[i].pid != events[i - 1].pid || events[i].conn != events[i - 1].conn) {
+      num_sessions++;
+    }
+  }
+  struct replay_session *sessions = calloc(num_sessions, sizeof(*sessions));
+  if (sessions == NULL) {
+    fprintf(stderr, "Out of memory.\n");
+    return 1;
+  }
+  size_t s = 0;
+  for (size_t i = 0; i < count; s++) {
+    size_t j = i + 1;
+    while (j < count && events[j].pid == events[i].pid && events[j].conn == events[i].conn) {
+      j++;
+    }
+    sessions[s].events = &events[i];
+    sessions[s].count = j - i;
+    i = j;
+  }
+  // and start them in the order they connected
+  qsort(sessions, num_sessions, sizeof(*sessions), cmp_time);
+
+  replay_start = now_ns();
+  for (size_t i = 0; i < num_sessions; i++) {
+    uint64_t offset = sessions[i].events[0].time_us - capture_start_us;
+    wait_until(replay_start + (uint64_t) (offset * 1000 / speed));
+    int err = pthread_create(&sessions[i].thread, NULL, replay_session, &sessions[i]);
+    if (err) {
+      fprintf(stderr, "pthread_create: %s\n", strerror(err));
+      return 1;
+    }
+  }
+
+  // merge the per-session results
+  struct replay_session total = {0};
+  for (size_t i = 0; i < num_sessions; i++) {
+    pthread_join(sessions[i].thread, NULL);
+    total.bytes += sessions[i].bytes;
+    total.requests += sessions[i].requests;
+    total.skipped += sessions[i].skipped;
+    total.errors += sessions[i].errors;
+    for (int op = 0; op < R_NUM; op++) {
+      struct lat_samples *l = &sessions[i].lat[op];
+      for (size_t j = 0; j < l->count; j++) {
+        lat_add(&total.lat[op], l->ns[j]);
+      }
+      free(l->ns);
+    }
+    for (size_t j = 0; j < sessions[i].lag.count; j++) {
+      lat_add(&total.lag, sessions[i].lag.ns[j]);
+    }
+    free(sessions[i].lag.ns);
+  }
+  double elapsed = (now_ns() - replay_start) / 1e9;
+  uint64_t last_us = capture_start_us;
+  for (size_t i = 0; i < count; i++) {
+    if (events[i].time_us > last_us) {
+      last_us = events[i].time_us;
+    }
+  }
+  double captured = (last_us - capture_start_us) / 1e6;
+
+  // one JSON object on stdout, like TigerBench's
+  printf("{\"sessions\": %zu, \"speed\": %.3f, \"captured_s\": %.3f, \"duration_s\": %.3f,\n",
+      num_sessions, speed, captured, elapsed);
+  printf(" \"requests\": %llu, \"skipped\": %llu, \"bytes\": %llu, \"throughput_MBps\": %.3f, "
+      "\"errors\": %llu,\n",
+      (unsigned long long) total.requests, (unsigned long long) total.skipped,
+      (unsigned long long) total.bytes, total.bytes / elapsed / 1e6,
+      (unsigned long long) total.errors);
+  printf(" \"lag_us\": {\"p50\": %.1f, \"p99\": %.1f, \"max\": %.1f},\n",
+      lat_percentile(&total.lag, 0.50) / 1e3, lat_percentile(&total.lag, 0.99) / 1e3,
+      lat_percentile(&total.lag, 1.0) / 1e3);
+  printf(" \"latency_us\": {");
+  int first = 1;
+  for (int op = 0; op < R_NUM; op++) {
+    struct lat_samples *l = &total.lat[op];
+    if (l->count == 0) {
+      continue;
+    }
+    printf("%s\n  \"%s\": {\"count\": %zu, \"p50\": %.1f, \"p99\": %.1f, \"p999\": %.1f}",
+        first ? "" : ",", op_names[op], l->count,
+        lat_percentile(l, 0.50) / 1e3, lat_percentile(l, 0.99) / 1e3,
+        lat_percentile(l, 0.999) / 1e3);
+    first = 0;
+  }
+  printf("\n }\n}\n");
+
+  free(sessions);
+  return total.errors ? 2 : 0;
+}
+
+// read every event in a capture
+// return: 0 on success, -1 on error
+// events: set to the events, in file order
+// count: set to how many there are
+static int load_capture(char *path, struct replay_event **events, size_t *count) {
+  FILE *f = fopen(path, "r");
+  if (f == NULL) {
+    fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  char *line = malloc(CAPTURE_LINE);
+  size_t cap = 0;
+  *events = NULL;
+  *count = 0;
+  int lineno = 0;
+  capture_start_us = UINT64_MAX;
+  while (line && fgets(line, CAPTURE_LINE, f)) {
+    lineno++;
+    if (line[0] == '#' || line[0] == '\n') {
+      continue;
+    }
+    if (*count == cap) {
+      cap = cap ? 2 * cap : TABLE_MIN;
+      struct replay_event *bigger = realloc(*events, cap * sizeof(**events));
+      if (bigger == NULL) {
+        fprintf(stderr, "Out of memory.\n");
+        fclose(f);
+        free(line);
+        return -1;
+      }
+      *events = bigger;
+    }
+    struct replay_event *e = &(*events)[*count];
+    if (parse_event(line, e)) {
+      fprintf(stderr, "%s:%d: not a capture line\n", path, lineno);
+      fclose(f);
+      free(line);
+      return -1;
+    }
+    if (e->time_us < capture_start_us) {
+      capture_start_us = e->time_us;
+    }
+    (*count)++;
+  }
+  int failed = line == NULL || ferror(f);
+  fclose(f);
+  free(line);
+  if (failed) {
+    fprintf(stderr, "Failed to read %s.\n", path);
+    return -1;
+  }
+  return 0;
+}
+
+// parse one line of a capture
+// return: 0 on success, -1 if malformed
+// line: the line, changed in place
+static int parse_event(char *line, struct replay_event *e) {
+  char *fields[7];
+  char *state;
+  char *token = strtok_r(line, " \n", &state);
+  for (int i = 0; i < 7; i++) {
+    if (token == NULL) {
+      return -1;
+    }
+    fields[i] = token;
+    token = strtok_r(NULL, " \n", &state);
+  }
+
+  char *end;
+  e->time_us = strtoull(fields[0], &end, 10);
+  if (*end || sscanf(fields[1], "%llu.%llu", &e->pid, &e->conn) != 2) {
+    return -1;
+  }
+  e->op = R_OTHER;
+  for (int op = 0; op < R_OTHER; op++) {
+    if (strcmp(fields[2], kinds[op]) == 0) {
+      e->op = op;
+    }
+  }
+  e->size = strcmp(fields[3], "-") ? strtoull(fields[3], NULL, 10) : 0;
+  e->ok = strcmp(fields[5], "ok") == 0;
+
+  // unescape the name in place
+  char *name = fields[6];
+  size_t len = 0;
+  if (strcmp(name, "-")) {
+    for (char *p = name; *p; p++) {
+      unsigned int c;
+      if (*p == '%' && sscanf(p + 1, "%2x", &c) == 1) {
+        name[len++] = c;
+        p += 2;
+      } else {
+        name[len++] = *p;
+      }
+    }
+  }
+  e->name = malloc(len + 1);
+  if (e->name == NULL) {
+    return -1;
+  }
+  memcpy(e->name, name, len);
+  e->name[len] = '\0';
+  e->name_len = len;
+  return 0;
+}
+
+// where an event goes among others with the same timestamp
+static int rank(enum replay_kind op) {
+  return op == R_OPEN ? 0 : op == R_AUTH ? 1 : op == R_CLOSE ? 3 : 2;
+}
+
+// order events by session, then time
+static int cmp_session(const void *a, const void *b) {
+  const struct replay_event *x = a;
+  const struct replay_event *y = b;
+  if (x->pid != y->pid) {
+    return x->pid < y->pid ? -1 : 1;
+  }
+  if (x->conn != y->conn) {
+    return x->conn < y->conn ? -1 : 1;
+  }
+  if (x->time_us != y->time_us) {
+    return x->time_us < y->time_us ? -1 : 1;
+  }
+  // the clock may not tell a session's first or last events from the rest
+  return rank(x->op) - rank(y->op);
+}
+
+// order sessions by when they connected
+static int cmp_time(const void *a, const void *b) {
+  const struct replay_session *x = a;
+  const struct replay_session *y = b;
+  uint64_t tx = x->events[0].time_us;
+  uint64_t ty = y->events[0].time_us;
+  return tx < ty ? -1 : tx > ty;
+}
+
+// order pointers to events by time
+static int cmp_event_time(const void *a, const void *b) {
+  const struct replay_event *x = *(struct replay_event * const *) a;
+  const struct replay_event *y = *(struct replay_event * const *) b;
+  return x->time_us < y->time_us ? -1 : x->time_us > y->time_us;
+}
+
+// find a name in the table, adding it if it's new
+// return: its entry
+static struct replay_name *find_name(struct replay_name *table, size_t size, char *name) {
+  uint64_t hash = 14695981039346656037ULL; // FNV-1a
+  for (char *p = name; *p; p++) {
+    hash = (hash ^ (unsigned char) *p) * 1099511628211ULL;
+  }
+  size_t i = hash & (size - 1);
+  while (table[i].name && strcmp(table[i].name, name)) {
+    i = (i + 1) & (size - 1);
+  }
+  table[i].name = name;
+  return &table[i];
+}
+
+// upload every file the capture reads before writing it, so its GETs find
+// a file of the size they saw
+// return: 0 on success, -1 on error
+static int upload_files(struct replay_event *events, size_t count) {
+  // a name per event at most, at most half full
+  size_t size = TABLE_MIN;
+  while (size < 2 * count) {
+    size *= 2;
+  }
+  struct replay_name *table = calloc(size, sizeof(*table));
+  struct replay_event **order = malloc(count * sizeof(*order));
+  if (table == NULL || order == NULL) {
+    fprintf(stderr, "Out of memory.\n");
+    free(table);
+    free(order);
+    return -1;
+  }
+  for (size_t i = 0; i < count; i++) {
+    order[i] = &events[i];
+    if (events[i].op == R_GET && events[i].ok) {
+      find_name(table, size, events[i].name)->size = events[i].size;
+    }
+  }
+  qsort(order, count, sizeof(*order), cmp_event_time);
+
+  int sockfd = bench_connect(host, user, pass);
+  if (sockfd == -1) {
+    fprintf(stderr, "Could not connect to server.\n");
+    free(table);
+    free(order);
+    return -1;
+  }
+  int err = 0;
+  size_t files = 0;
+  uint64_t bytes = 0;
+  for (size_t i = 0; i < count && !err; i++) {
+    struct replay_event *e = order[i];
+    if (!e->ok || (e->op != R_GET && e->op != R_PUT && e->op != R_COPY && e->op != R_MOVE)) {
+      continue;
+    }
+    // the name read or written first; for COPY and MOVE the source
+    struct replay_name *n = find_name(table, size, e->name);
+    if (!n->seen && e->op != R_PUT) {
+      err = bench_put(sockfd, e->name, n->size, &bytes);
+      files++;
+    }
+    n->seen = 1;
+    if (e->op == R_COPY || e->op == R_MOVE) {
+      size_t src_len = strlen(e->name);
+      if (src_len < e->name_len) {
+        find_name(table, size, e->name + src_len + 1)->seen = 1;
+      }
+    }
+  }
+  if (!err) {
+    send_close(sockfd);
+  }
+  close_conn(sockfd);
+  free(table);
+  free(order);
+  if (err) {
+    fprintf(stderr, "Failed to upload the files the capture reads.\n");
+    return -1;
+  }
+  fprintf(stderr, "Uploaded %zu files, %llu bytes.\n", files, (unsigned long long) bytes);
+  return 0;
+}
+
+// sleep until a now_ns() time
+static void wait_until(uint64_t ns) {
+  uint64_t now = now_ns();
+  if (ns > now) {
+    struct timespec ts = { (ns - now) / 1000000000ULL, (ns - now) % 1000000000ULL };
+    while (nanosleep(&ts, &ts) == -1 && errno == EINTR) {
+    }
+  }
+}
+
+// replay one session's requests on its schedule
+// arg: this session's struct replay_session
+static void *replay_session(void *arg) {
+  struct replay_session *s = arg;
+
+  // only sessions that logged in did anything worth replaying
+  int logged_in = 0;
+  for (size_t i = 0; i < s->count; i++) {
+    if (s->events[i].op == R_AUTH && s->events[i].ok) {
+      logged_in = 1;
+    }
+  }
+  if (!logged_in) {
+    s->skipped++;
+    return NULL;
+  }
+
+  uint64_t t0 = now_ns();
+  int sockfd = bench_connect(host, user, pass);
+  if (sockfd == -1) {
+    s->errors++;
+    return NULL;
+  }
+  lat_add(&s->lat[R_AUTH], now_ns() - t0);
+
+  int ended = 0;
+  for (size_t i = 0; i < s->count && !ended; i++) {
+    struct replay_event *e = &s->events[i];
+    if (e->op == R_OPEN || e->op == R_AUTH) {
+      continue;
+    }
+    if (e->op == R_CLOSE) {
+      break;
+    }
+    if (e->op == R_END) {
+      send_close(sockfd);
+      break;
+    }
+    if (!e->ok || e->op == R_OTHER) {
+      // GETDIR, PUTDIR, MUX (whose streams aren't captured) and failures
+      s->skipped++;
+      continue;
+    }
+
+    uint64_t due = replay_start + (uint64_t) ((e->time_us - capture_start_us) * 1000 / speed);
+    wait_until(due);
+    t0 = now_ns();
+    lat_add(&s->lag, t0 - due);
+
+    int err = 0;
+    switch (e->op) {
+      case R_GET: err = bench_get(sockfd, e->name, &s->bytes); break;
+      case R_PUT: err = bench_put(sockfd, e->name, e->size, &s->bytes); break;
+      case R_LIST: err = bench_list(sockfd, e->name, e->name_len, e->size, &s->bytes); break;
+      case R_COPY: err = bench_copy(sockfd, COPY, e->name, e->name_len); break;
+      case R_MOVE: err = bench_copy(sockfd, MOVE, e->name, e->name_len); break;
+      case R_STATS: err = bench_stats(sockfd, &s->bytes); break;
+      default: break;
+    }
+    if (err) {
+      s->errors++;
+      ended = 1;
+    } else {
+      lat_add(&s->lat[e->op], now_ns() - t0);
+      s->requests++;
+    }
+  }
+  close_conn(sockfd);
+  return NULL;
+}
+
+// print usage message
+void replay_usage(void) {
+  fprintf(stderr, "Usage: TigerReplay [options] <capture>\n");
+  fprintf(stderr, "  <capture>      file written by TigerS -W\n");
+  fprintf(stderr, "  -h <host>      server address, optionally host:port (default 127.0.0.1)\n");
+  fprintf(stderr, "  -u <user>      username (default user)\n");
+  fprintf(stderr, "  -p <pass>      password (default pass)\n");
+  fprintf(stderr, "  -x <speed>     replay this many times faster, e.g. 10 or 0.5 (default 1)\n");
+  fprintf(stderr, "  -S             don't upload the files the capture reads first\n");
+  fprintf(stderr, "  -e <cafile>    connect with TLS, trusting the CAs in this PEM file\n");
+}
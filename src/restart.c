@@ -0,0 +1,199 @@
+// close_range and execvpe need this
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "restart.h"
+
+// Hot restart. On SIGUSR2 the server execs its binary again, by the path
+// and arguments it was started with so a new build installed over it is
+// what runs, and hands the new process its listening socket over a Unix
+// socketpair (SCM_RIGHTS). The old server keeps accepting until the new one
+// reports it is accepting too, then stops and drains its sessions. Both
+// accept from the same socket, so connections queued in its backlog carry
+// over and none are refused.
+
+extern char **environ;
+
+static int chan_fd = -1;  // to the old server, in a new one until it's ready
+static pid_t child = -1;  // the new server, in the old one while it starts
+
+// block SIGUSR2 so it can be waited for with poll; call before starting
+// any threads, which inherit the mask
+// return: a descriptor that becomes readable on SIGUSR2, -1 on error
+int restart_signal_fd(void) {
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGUSR2);
+  if (pthread_sigmask(SIG_BLOCK, &set, NULL)) {
+    return -1;
+  }
+  return signalfd(-1, &set, SFD_CLOEXEC | SFD_NONBLOCK);
+}
+
+// take over the listening socket when started by a hot restart
+// return: the listening socket, -1 if this isn't a hot restart, -2 on error
+int restart_inherit(void) {
+  char *env = getenv(RESTART_ENV);
+  if (env == NULL) {
+    return -1;
+  }
+  chan_fd = atoi(env);
+  unsetenv(RESTART_ENV);
+
+  char byte;
+  char ctrl[CMSG_SPACE(sizeof(int))];
+  struct iovec iov = { &byte, 1 };
+  struct msghdr msg = {0};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = ctrl;
+  msg.msg_controllen = sizeof(ctrl);
+  ssize_t n;
+  do {
+    n = recvmsg(chan_fd, &msg, MSG_CMSG_CLOEXEC);
+  } while (n == -1 && errno == EINTR);
+  struct cmsghdr *cmsg = n == 1 ? CMSG_FIRSTHDR(&msg) : NULL;
+  if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+    log_msg(LOG_ERROR, "Failed to receive the listening socket from the old server.");
+    close(chan_fd);
+    chan_fd = -1;
+    return -2;
+  }
+  int fd;
+  memcpy(&fd, CMSG_DATA(cmsg), sizeof(fd));
+  return fd;
+}
+
+// tell the old server this one is accepting, so it can stop
+void restart_ready(void) {
+  if (chan_fd == -1) {
+    return;
+  }
+  if (write(chan_fd, "R", 1) != 1) {
+    log_msg(LOG_ERROR, "Failed to tell the old server to stop: %s", strerror(errno));
+  }
+  close(chan_fd);
+  chan_fd = -1;
+}
+
+// start a new server and hand it the listening socket
+// return: a descriptor that becomes readable once it has started or failed,
+//         to pass to restart_done; -1 on error
+// listenfd: the listening socket, which stays open here
+// argv: the arguments this server was started with
+int restart_begin(int listenfd, char **argv) {
+  if (child != -1) {
+    log_msg(LOG_WARN, "A restart is already in progress.");
+    return -1;
+  }
+
+  // everything the child does between fork and exec must be async-signal
+  // safe, so its environment is built here
+  size_t count = 0;
+  while (environ[count]) {
+    count++;
+  }
+  char **envp = malloc((count + 2) * sizeof(*envp));
+  if (envp == NULL) {
+    log_msg(LOG_ERROR, "Failed to restart: out of memory");
+    return -1;
+  }
+  size_t j = 0;
+  size_t prefix = strlen(RESTART_ENV);
+  for (size_t i = 0; i < count; i++) {
+    if (strncmp(environ[i], RESTART_ENV, prefix) || environ[i][prefix] != '=') {
+      envp[j++] = environ[i];
+    }
+  }
+  envp[j++] = RESTART_ENV "=3";
+  envp[j] = NULL;
+
+  int pair[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair)) {
+    log_msg(LOG_ERROR, "Failed to restart: socketpair: %s", strerror(errno));
+    free(envp);
+    return -1;
+  }
+  pid_t pid = fork();
+  if (pid == -1) {
+    log_msg(LOG_ERROR, "Failed to restart: fork: %s", strerror(errno));
+    close(pair[0]);
+    close(pair[1]);
+    free(envp);
+    return -1;
+  }
+  if (pid == 0) {
+    // only the channel crosses the exec; the listening socket comes over it,
+    // and sessions and files stay with the old server
+    if (dup2(pair[1], 3) == -1 || fcntl(3, F_SETFD, 0) == -1) {
+      _exit(127);
+    }
+    close_range(4, ~0U, 0);
+    sigset_t none;
+    sigemptyset(&none);
+    sigprocmask(SIG_SETMASK, &none, NULL);
+    execvpe(argv[0], argv, envp);
+    _exit(127);
+  }
+  free(envp);
+  close(pair[1]);
+
+  char byte = 'L';
+  char ctrl[CMSG_SPACE(sizeof(int))] = {0};
+  struct iovec iov = { &byte, 1 };
+  struct msghdr msg = {0};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = ctrl;
+  msg.msg_controllen = sizeof(ctrl);
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &listenfd, sizeof(int));
+  if (sendmsg(pair[0], &msg, MSG_NOSIGNAL) != 1) {
+    // it died before taking the socket
+    log_msg(LOG_ERROR, "Failed to hand over the listening socket: %s", strerror(errno));
+    close(pair[0]);
+    waitpid(pid, NULL, 0);
+    return -1;
+  }
+  child = pid;
+  log_msg(LOG_INFO, "Started new server %d, waiting for it to accept connections.", (int) pid);
+  return pair[0];
+}
+
+// find out how the new server's start went; closes chan
+// return: 0 if it's accepting and this server should stop, -1 if it failed
+//         and this server carries on
+// chan: from restart_begin, once readable
+int restart_done(int chan) {
+  char byte;
+  ssize_t n;
+  do {
+    n = read(chan, &byte, 1);
+  } while (n == -1 && errno == EINTR);
+  close(chan);
+  pid_t pid = child;
+  child = -1;
+  if (n == 1) {
+    log_msg(LOG_INFO, "New server %d is accepting connections.", (int) pid);
+    return 0;
+  }
+  // closed without a word: it exited, or exec failed
+  int status;
+  waitpid(pid, &status, 0);
+  log_msg(LOG_ERROR, "New server %d failed to start (exit status %d), carrying on.", (int) pid,
+      WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+  return -1;
+}
@@ -0,0 +1,16 @@
+#ifndef RESTART_H
+#define RESTART_H
+
+// environment variable telling a new server which descriptor the old one
+// is handing its listening socket over
+#define RESTART_ENV "TIGER_HANDOFF_FD"
+// how long the old server waits for the new one to start accepting
+#define RESTART_START_TIMEOUT 60
+
+int restart_signal_fd(void);
+int restart_inherit(void);
+void restart_ready(void);
+int restart_begin(int listenfd, char **argv);
+int restart_done(int chan);
+
+#endif
@@ -4,24 +4,324 @@
 // TigerS - server
 
 #include <arpa/inet.h>
+#include <endian.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <netdb.h>
+#include <poll.h>
 #include <pthread.h>
+#include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/sendfile.h>
+#include <sys/signalfd.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <unistd.h>
 
+#include "affinity.h"
+#include "archive.h"
+#include "capture.h"
 #include "common.h"
+#include "copy.h"
+#include "index.h"
+#include "log.h"
+#include "metrics.h"
+#include "progress.h"
+#include "relay.h"
+#include "restart.h"
 #include "server.h"
+#include "shape.h"
+#include "stage.h"
+#include "store.h"
+#include "tls.h"
+#include "trace.h"
+#include "users.h"
 
 #define MAX_USERS 128
+// how long a refused client gets to hang up before the connection is closed
+#define REFUSE_LINGER (1000000000ULL)
 
-int main(void) {
+// connection number for log and trace output
+static uint64_t next_conn_id = 0;
 
+// admission control and timeouts, 0 turns each one off
+static int max_sessions = 0;                  // -m
+static int max_user_sessions = 0;             // -M
+static int durable = 0;                       // -D, fsync uploads before acknowledging
+static char *data_dirs[STORE_MAX_DIRS];       // -d, files are spread over these
+static int num_data_dirs = 0;
+uint64_t header_timeout = 10 * 1000000000ULL; // -H, for login and filename
+uint64_t idle_timeout = 300 * 1000000000ULL;  // -I, between requests
+uint64_t min_rate = 0;                        // -R, bytes/sec during transfers
+static uint64_t drain_timeout = 60 * 1000000000ULL; // -G, after a hot restart
+static int active_sessions = 0;
+
+// set by send_fail, so the capture can tell a refused request from a served one
+static __thread int request_failed = 0;
+
+// tls log hook, a failed handshake is the client's problem more than ours
+static void log_tls(const char *fmt, va_list args) {
+  log_vmsg(LOG_WARN, fmt, args);
+}
+
+int main(int argc, char **argv) {
+
+  int err;
+
+  // parse options
+  enum log_level level = LOG_INFO;
+  int opt;
+  uint64_t global_rate = 0;
+  char *port = STR(FTP_PORT);
+  char *cert = NULL;
+  char *key = NULL;
+  char *cpus = NULL;
+  int follow_rx = 0;
+  while ((opt = getopt(argc, argv, "l:T:W:B:m:M:H:I:R:DP:U:d:C:K:G:A:N")) != -1) {
+    switch (opt) {
+      case 'C':
+        cert = optarg;
+        break;
+      case 'K':
+        key = optarg;
+        break;
+      case 'm':
+        max_sessions = atoi(optarg);
+        break;
+      case 'D':
+        durable = 1;
+        break;
+      case 'P':
+        port = optarg;
+        break;
+      case 'd':
+        if (num_data_dirs == STORE_MAX_DIRS) {
+          fprintf(stderr, "At most %d data directories.\n", STORE_MAX_DIRS);
+          return -1;
+        }
+        data_dirs[num_data_dirs++] = optarg;
+        break;
+      case 'U':
+        if (relay_init(optarg)) {
+          fprintf(stderr, "Bad upstream, expected user:pass@host[:port]: %s\n", optarg);
+          return -1;
+        }
+        break;
+      case 'M':
+        max_user_sessions = atoi(optarg);
+        break;
+      case 'H':
+        header_timeout = strtoull(optarg, NULL, 10) * 1000000000ULL;
+        break;
+      case 'I':
+        idle_timeout = strtoull(optarg, NULL, 10) * 1000000000ULL;
+        break;
+      case 'A':
+        cpus = optarg;
+        break;
+      case 'N':
+        follow_rx = 1;
+        break;
+      case 'G':
+        drain_timeout = strtoull(optarg, NULL, 10) * 1000000000ULL;
+        break;
+      case 'R':
+        if (parse_rate(optarg, &min_rate)) {
+          fprintf(stderr, "Bad rate: %s\n", optarg);
+          return -1;
+        }
+        break;
+      case 'B':
+        if (parse_rate(optarg, &global_rate)) {
+          fprintf(stderr, "Bad rate: %s\n", optarg);
+          return -1;
+        }
+        break;
+      case 'T':
+        if (trace_open(optarg, "server")) {
+          fprintf(stderr, "Failed to open trace file %s\n", optarg);
+          return -1;
+        }
+        break;
+      case 'W':
+        if (capture_open(optarg)) {
+          fprintf(stderr, "Failed to open capture file %s\n", optarg);
+          return -1;
+        }
+        break;
+      case 'l':
+        if (log_parse_level(optarg, &level)) {
+          fprintf(stderr, "Unknown log level: %s\n", optarg);
+          usage();
+          return -1;
+        }
+        break;
+      default:
+        usage();
+        return -1;
+    }
+  }
+
+  // SIGUSR2 starts a hot restart; blocked before any threads start, so
+  // only the accept loop sees it
+  int restartfd = restart_signal_fd();
+  if (restartfd == -1) {
+    fprintf(stderr, "Failed to set up restart signal: %s\n", strerror(errno));
+    return -1;
+  }
+
+  // every thread started from here on inherits the CPU set
+  if (affinity_init(cpus, follow_rx)) {
+    return -1;
+  }
+
+  err = metrics_init();
+  if (err) {
+    fprintf(stderr, "Failed to set up metrics.\n");
+    return -1;
+  }
+
+  shape_init(global_rate);
+
+  // a client that disconnects mid-transfer must not kill the whole server
+  signal(SIGPIPE, SIG_IGN);
+
+  err = log_init(level);
+  if (err) {
+    fprintf(stderr, "Failed to start logger.\n");
+    return -1;
+  }
+
+  if (stage_init(durable)) {
+    return -1;
+  }
+
+  if ((cert == NULL) != (key == NULL)) {
+    fprintf(stderr, "TLS needs both a certificate (-C) and a key (-K).\n");
+    return -1;
+  }
+  if (cert && tls_server_init(cert, key)) {
+    return -1;
+  }
+  tls_set_log(log_tls);
+
+  // without -d, files are served from the working directory
+  if (num_data_dirs == 0) {
+    data_dirs[num_data_dirs++] = ".";
+  }
+  if (store_init(data_dirs, num_data_dirs)) {
+    return -1;
+  }
+
+  // LIST is answered from memory; without the index it just fails
+  if (index_init(data_dirs, num_data_dirs)) {
+    log_msg(LOG_ERROR, "Failed to index the data directories, LIST is unavailable.");
+  }
+  // files left where an earlier set of data directories put them
+  store_rebalance();
+
+  // after a hot restart the old server's socket, with whatever is queued
+  // on it, is already listening
+  int listenfd = restart_inherit();
+  if (listenfd == -2) {
+    return -1;
+  }
+  if (listenfd == -1) {
+    listenfd = open_listener(port);
+    if (listenfd == -1) {
+      return -1;
+    }
+  }
+
+  log_msg(LOG_INFO, "Now accepting connections.");
+  restart_ready();
+  // accept connections and handle the work for each one, until a new
+  // server has taken over the listening socket
+  int handoff = -1;
+  for (;;) {
+    struct pollfd fds[3] = {
+      { listenfd, POLLIN, 0 }, { restartfd, POLLIN, 0 }, { handoff, POLLIN, 0 }
+    };
+    if (poll(fds, 3, -1) == -1) {
+      continue;
+    }
+    if (fds[2].revents) {
+      if (restart_done(handoff) == 0) {
+        break;
+      }
+      handoff = -1;
+    }
+    if (fds[1].revents & POLLIN) {
+      struct signalfd_siginfo info;
+      while (read(restartfd, &info, sizeof(info)) == sizeof(info)) {
+      }
+      if (handoff == -1) {
+        handoff = restart_begin(listenfd, argv);
+      }
+    }
+    if (!(fds[0].revents & POLLIN)) {
+      continue;
+    }
+    int connfd = accept(listenfd, NULL, NULL); // don't care about their address
+    if (connfd == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      // the other server got it, during a restart
+      continue;
+    }
+    if (connfd == -1) {
+      log_msg(LOG_ERROR, "accept: %s", strerror(errno));
+      if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+        // out of descriptors or memory: back off instead of spinning
+        usleep(100000);
+      }
+      continue;
+    }
+    log_msg(LOG_INFO, "Connection opened.");
+
+    // far over the limit, don't even spend a thread on telling them so
+    if (max_sessions && __atomic_load_n(&active_sessions, __ATOMIC_RELAXED) >= 2 * max_sessions) {
+      log_msg(LOG_WARN, "Too many sessions, dropping connection.");
+      metrics_add(M_REJECTED, 1);
+      drop_conn(connfd);
+      continue;
+    }
+
+    // create a thread for this connection
+    pthread_t thread;
+    err = pthread_create(&thread, NULL, handle_client, (void *) (intptr_t) connfd);
+    if (err) {
+      log_msg(LOG_ERROR, "pthread_create: %s", strerror(err));
+      close(connfd);
+      continue;
+    }
+    // let it go off on its own
+    pthread_detach(thread);
+  }
+
+  // the new server accepts everything from here; let sessions here finish
+  close(listenfd);
+  uint64_t deadline = now_ns() + drain_timeout;
+  int left = __atomic_load_n(&active_sessions, __ATOMIC_RELAXED);
+  log_msg(LOG_INFO, "Handed over, draining %d sessions.", left);
+  while (left > 0 && now_ns() < deadline) {
+    usleep(100000);
+    left = __atomic_load_n(&active_sessions, __ATOMIC_RELAXED);
+  }
+  if (left > 0) {
+    log_msg(LOG_WARN, "Drain deadline passed, closing %d sessions.", left);
+  }
+  log_msg(LOG_INFO, "Quitting");
+  log_flush();
+  return 0;
+}
+
+// open the listening socket
+// return: the socket, -1 on error
+// port: the port to listen on
+int open_listener(char *port) {
   int err;
 
   // get the addrinfo for listening on the local machine
@@ -35,14 +335,17 @@ int main(void) {
   hints.ai_protocol = IPPROTO_TCP;  // TCP
 
   // call getaddrinfo
-  err = getaddrinfo(NULL, STR(FTP_PORT), &hints, &hostinfo);
+  err = getaddrinfo(NULL, port, &hints, &hostinfo);
   if (err) {
     fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(err));
     return -1;
   }
 
   // get a socket for listening with the first provided address
-  int listenfd = socket(hostinfo->ai_family, hostinfo->ai_socktype, hostinfo->ai_protocol);
+  // a hot restart hands it over explicitly rather than through exec, and
+  // while both servers poll it only one of them gets each connection
+  int listenfd = socket(hostinfo->ai_family,
+      hostinfo->ai_socktype | SOCK_CLOEXEC | SOCK_NONBLOCK, hostinfo->ai_protocol);
   if (listenfd == -1) {
     fprintf(stderr, "socket: %s\n", strerror(errno));
     return -1;
@@ -68,44 +371,90 @@ int main(void) {
     return -1;
   }
 
-  printf("Now accepting connections.\n");
-  // accept connections and handle the work for each one
-  for (;;) {
-    int connfd = accept(listenfd, NULL, NULL); // don't care about their address
-    printf("Connection opened.\n");
+  return listenfd;
+}
 
-    // create a thread for this connection
-    pthread_t thread;
-    err = pthread_create(&thread, NULL, handle_client, (void *) (intptr_t) connfd);
-    if (err) {
-      fprintf(stderr, "pthread_create: %s\n", strerror(err));
-    }
-    // let it go off on its own
-    pthread_detach(thread);
+void *handle_client(void *arg) {
+  struct session sess = {0};
+  sess.connfd = (intptr_t) arg;
+  sess.id = __atomic_add_fetch(&next_conn_id, 1, __ATOMIC_RELAXED);
+  int active = __atomic_add_fetch(&active_sessions, 1, __ATOMIC_RELAXED);
+  sess.reject = max_sessions && active > max_sessions;
+
+  affinity_place(sess.connfd);
+
+  metrics_add(M_SESSIONS, 1);
+  metrics_add(M_SESSIONS_ACTIVE, 1);
+  uint64_t trace_start = trace_begin();
+  capture_event(sess.id, "OPEN", capture_begin(), CAPTURE_NONE, CAPTURE_OK, NULL, 0);
+  void *ret = (void *) -1;
+  // a client over the limit still gets the handshake: it speaks TLS from
+  // its first byte, so the FAILURE reply is only readable encrypted. That
+  // is paid only up to twice the limit; past that the accept loop closes
+  // the connection before any handshake (drop_conn)
+  if (!tls_server_enabled() || start_tls(&sess) == 0) {
+    ret = serve_client(&sess);
+  }
+  trace_end("session", trace_start, sess.id, NULL);
+  capture_event(sess.id, "CLOSE", capture_begin(), CAPTURE_NONE,
+      ret == (void *) 0 ? CAPTURE_OK : CAPTURE_FAIL, NULL, 0);
+  trace_flush();
+  if (sess.user) {
+    shape_user_put(sess.user);
+  }
+  metrics_sub(M_SESSIONS_ACTIVE, 1);
+  __atomic_sub_fetch(&active_sessions, 1, __ATOMIC_RELAXED);
+  if (ret != (void *) 0) {
+    metrics_add(M_ERRORS, 1);
   }
+  return ret;
+}
 
-  printf("Quitting\n");
+// encrypt a new connection; from here on the session uses sess->connfd
+// the same way as a plain one
+// return: 0 on success, -1 if the connection was closed
+// sess: the session
+int start_tls(struct session *sess) {
+  // the handshake counts as part of the login
+  set_timeout(sess->connfd, SO_RCVTIMEO, header_timeout);
+  set_timeout(sess->connfd, SO_SNDTIMEO, header_timeout);
+  int offloaded;
+  int fd = tls_accept(sess->connfd, &offloaded);
+  if (fd == -1) {
+    close(sess->connfd);
+    return -1;
+  }
+  sess->connfd = fd;
+  metrics_add(offloaded ? M_TLS_KTLS : M_TLS_USERSPACE, 1);
+  log_msg(LOG_DEBUG, "TLS record layer in %s.", offloaded ? "the kernel" : "user space");
   return 0;
 }
 
-void *handle_client(void *arg) {
+// run one client session: authenticate, then serve requests until END
+// return: 0 after a clean END, -1 otherwise
+// sess: the session, its connection is closed before returning
+void *serve_client(struct session *sess) {
   int err;
+  int connfd = sess->connfd;
+
+  // over the global session limit: turn them away before reading the
+  // login, so a rejected client costs no more than the reply
+  if (sess->reject) {
+    log_msg(LOG_WARN, "Rejecting a connection: too many sessions.");
+    metrics_add(M_REJECTED, 1);
+    refuse_login(connfd);
+    capture_event(sess->id, "AUTH", capture_begin(), CAPTURE_NONE, CAPTURE_BUSY, NULL, 0);
+    return (void *) 0;
+  }
+
+  // the whole login must arrive within the header timeout
+  uint64_t deadline = header_timeout ? now_ns() + header_timeout : 0;
 
-  int connfd = (intptr_t) arg;
   // receive the initial request from the client
+  uint64_t trace_start = trace_begin();
+  uint64_t capture_start = capture_begin();
   struct ftp_auth_request auth_req = {0};
-  ssize_t received = recv(connfd, &auth_req, sizeof(auth_req), MSG_WAITALL);
-  if (received == 0) {
-    fprintf(stderr, "Connection closed.\n");
-    close_conn(connfd);
-    return (void *)-1;
-  } else if (received == -1) {
-    fprintf(stderr, "recv: %s\n", strerror(errno));
-    close_conn(connfd);
-    return (void *)-1;
-  } else if ((size_t) received < sizeof(auth_req)) {
-    fprintf(stderr, "Not enough data received for authentication request.\n");
-    close_conn(connfd);
+  if (recv_msg(sess, &auth_req, sizeof(auth_req), "authentication request", deadline)) {
     return (void *)-1;
   }
 
@@ -113,77 +462,71 @@ void *handle_client(void *arg) {
 
   // check request type
   if (auth_req.type != AUTH_REQ) {
-    fprintf(stderr, "Sequence error: expected AUTH_REQ\n");
+    log_msg(LOG_ERROR, "Sequence error: expected AUTH_REQ");
     err = close_conn(connfd);
     if (err) {
-      fprintf(stderr, "Error closing connection.\n");
+      log_msg(LOG_ERROR, "Error closing connection.");
     }
+    return (void *)-1;
   }
 
   auth_req.username_len = ntohl(auth_req.username_len);
   auth_req.password_len = ntohl(auth_req.password_len);
-
-  // make space for and receive the username
-  char *username = malloc(auth_req.username_len + 1);
-  if (username == NULL) {
-    fprintf(stderr, "Out of memory.\n");
-  }
-  username[auth_req.username_len] = '\0';
-
-  // make space for and receive the password
-  received = recv(connfd, username, auth_req.username_len, MSG_WAITALL);
-  if (received == 0) {
-    fprintf(stderr, "Connection closed during receive of username.\n");
-    close_conn(connfd);
-    return (void *)-1;
-  } else if (received == -1) {
-    fprintf(stderr, "recv: %s\n", strerror(errno));
-    close_conn(connfd);
-    return (void *)-1;
-  } else if ((size_t) received < auth_req.username_len) {
-    fprintf(stderr, "Not enough data received for username.\n");
+  if (auth_req.username_len > MAX_NAME_LEN || auth_req.password_len > MAX_NAME_LEN) {
+    log_msg(LOG_ERROR, "Username or password too long.");
     close_conn(connfd);
     return (void *)-1;
   }
 
-  char *password = malloc(auth_req.password_len + 1);
-  if (password == NULL) {
-    fprintf(stderr, "Out of memory.\n");
-  }
+  // receive the username and password
+  char username[MAX_NAME_LEN + 1];
+  char password[MAX_NAME_LEN + 1];
+  username[auth_req.username_len] = '\0';
   password[auth_req.password_len] = '\0';
-
-  received = recv(connfd, password, auth_req.password_len, MSG_WAITALL);
-  if (received == 0) {
-    fprintf(stderr, "Connection closed during receive of password.\n");
-    close_conn(connfd);
-    return (void *)-1;
-  } else if (received == -1) {
-    fprintf(stderr, "recv: %s\n", strerror(errno));
-    close_conn(connfd);
-    return (void *)-1;
-  } else if ((size_t) received < auth_req.password_len) {
-    fprintf(stderr, "Not enough data received for password.\n");
-    close_conn(connfd);
+  if (recv_msg(sess, username, auth_req.username_len, "username", deadline) ||
+      recv_msg(sess, password, auth_req.password_len, "password", deadline)) {
     return (void *)-1;
   }
 
-  int auth_result = check_auth(username, password);
+  trace_end("recv_auth", trace_start, sess->id, NULL);
+
+  uint64_t auth_start = now_ns();
+  trace_start = trace_begin();
+  struct user_limits limits = {0};
+  int auth_result = check_auth(username, password, &limits);
+  trace_end("check_auth", trace_start, sess->id, username);
   if (auth_result == 1) {
+    metrics_add(M_AUTH_SUCCESS, 1);
+    int sessions = 0;
+    sess->user = shape_user_get(username, limits.user_rate, &sessions);
+    sess->conn_rate = limits.conn_rate;
+    if (max_user_sessions && sessions > max_user_sessions) {
+      log_msg(LOG_WARN, "Rejecting %s: too many sessions for this user.", username);
+      metrics_add(M_REJECTED, 1);
+      refuse_login(connfd);
+      metrics_record(H_AUTH, now_ns() - auth_start);
+      capture_event(sess->id, "AUTH", capture_start, CAPTURE_NONE, CAPTURE_BUSY, NULL, 0);
+      return (void *) 0;
+    }
+
     // good password, send the acknowledge with success
     struct ftp_auth_response resp = {0};
     resp.type = htonl(AUTH_RESP);
     resp.result = htonl(SUCCESS);
 
-    printf("Successful login by: %s\n", username);
+    log_msg(LOG_INFO, "Successful login by: %s", username);
 
     int err = send_all(connfd, &resp, sizeof(resp));
     if (err == -1) {
-      fprintf(stderr, "Error sending auth response.\n");
+      log_msg(LOG_ERROR, "Error sending auth response.");
     }
   } else if (auth_result == 0) {
     // bad password, deny and close
-    printf("Bad password provided by: %s\n", username);
+    log_msg(LOG_INFO, "Bad password provided by: %s", username);
+    metrics_add(M_AUTH_FAILURE, 1);
     deny_auth(connfd);
+    metrics_record(H_AUTH, now_ns() - auth_start);
+    capture_event(sess->id, "AUTH", capture_start, CAPTURE_NONE, CAPTURE_FAIL, NULL, 0);
     return (void *) 0;
   } else {
     // error
@@ -193,221 +536,857 @@ void *handle_client(void *arg) {
 
     int err = send_all(connfd, &resp, sizeof(resp));
     if (err == -1) {
-      fprintf(stderr, "Error sending auth response.\n");
+      log_msg(LOG_ERROR, "Error sending auth response.");
     }
+    // the client gives up after an UNKNOWN result
+    metrics_record(H_AUTH, now_ns() - auth_start);
+    capture_event(sess->id, "AUTH", capture_start, CAPTURE_NONE, CAPTURE_FAIL, NULL, 0);
+    close_conn(connfd);
+    return (void *)-1;
   }
-  free(username);
-  free(password);
+  metrics_record(H_AUTH, now_ns() - auth_start);
+  capture_event(sess->id, "AUTH", capture_start, CAPTURE_NONE, CAPTURE_OK, NULL, 0);
 
   // process user requests
   for (;;) {
     struct ftp_file_request file_req = {0};
 
-    received = recv(connfd, &file_req, sizeof(file_req), MSG_WAITALL);
-    if (received == 0) {
-      fprintf(stderr, "Connection closed.\n");
-      close_conn(connfd);
-      return (void *)-1;
-    } else if (received == -1) {
-      fprintf(stderr, "recv: %s\n", strerror(errno));
-      close_conn(connfd);
-      return (void *)-1;
-    } else if ((size_t) received < sizeof(file_req)) {
-      fprintf(stderr, "Not enough data received for file request.\n");
-      close_conn(connfd);
+    // wait up to the idle timeout for the next request
+    trace_start = trace_begin();
+    deadline = idle_timeout ? now_ns() + idle_timeout : 0;
+    if (recv_msg(sess, &file_req, sizeof(file_req), "file request", deadline)) {
       return (void *)-1;
     }
 
+    trace_end("idle", trace_start, sess->id, NULL);
+    capture_start = capture_begin();
+
     file_req.type = ntohl(file_req.type);
     // if it is an END request, nothing more to read. Close connection.
     if (file_req.type == END) {
+      capture_event(sess->id, "END", capture_start, CAPTURE_NONE, CAPTURE_OK, NULL, 0);
       err = close_conn(connfd);
       if (err) {
-        fprintf(stderr, "Error closing connection.\n");
+        log_msg(LOG_ERROR, "Error closing connection.");
         return (void *) -1;
       }
-      printf("Connection closed.\n");
+      log_msg(LOG_INFO, "Connection closed.");
       return (void *) 0;
-    } else if (file_req.type != GET && file_req.type != PUT) {
+    } else if (file_req.type == STATS) {
+      // no filename, just send the current metrics
+      request_failed = 0;
+      int result = send_stats(connfd);
+      capture_event(sess->id, "STATS", capture_start, CAPTURE_NONE,
+          result || request_failed ? CAPTURE_FAIL : CAPTURE_OK, NULL, 0);
+      if (result) {
+        return (void *)-1;
+      }
+      continue;
+    } else if (file_req.type == MUX && relay_enabled()) {
+      // a mux stream can't wait on an origin fetch without stalling every
+      // other stream on the connection, so a relay doesn't multiplex
+      log_msg(LOG_WARN, "Refusing to multiplex: relay is on.");
+      int result = send_fail(connfd, MUX);
+      capture_event(sess->id, "MUX", capture_start, CAPTURE_NONE, CAPTURE_FAIL, NULL, 0);
+      if (result) {
+        return (void *)-1;
+      }
+      continue;
+    } else if (file_req.type == MUX) {
+      // switch to frames for the rest of the session
+      struct ftp_file_response resp = {0};
+      resp.type = htonl(MUX);
+      resp.result = htonl(SUCCESS);
+      if (send_all(connfd, &resp, sizeof(resp)) == -1) {
+        log_msg(LOG_ERROR, "Error sending MUX response.");
+        close_conn(connfd);
+        return (void *)-1;
+      }
+      log_msg(LOG_DEBUG, "Multiplexing session.");
+      // the capture doesn't follow the streams of a multiplexed session
+      capture_event(sess->id, "MUX", capture_start, CAPTURE_NONE, CAPTURE_OK, NULL, 0);
+      return (void *) (intptr_t) serve_mux(sess);
+    } else if (file_req.type != GET && file_req.type != PUT &&
+        file_req.type != GETDIR && file_req.type != PUTDIR && file_req.type != LIST &&
+        file_req.type != COPY && file_req.type != MOVE) {
       // unknown request type
-      fprintf(stderr, "Sequence error: expected GET, PUT, or END\n");
+      log_msg(LOG_ERROR, "Sequence error: expected GET, PUT, GETDIR, PUTDIR, LIST, COPY, "
+          "MOVE, STATS, MUX, or END");
       err = close_conn(connfd);
       if (err) {
-        fprintf(stderr, "Error closing connection.\n");
+        log_msg(LOG_ERROR, "Error closing connection.");
       }
+      return (void *)-1;
     }
 
-    // otherwise, it's a GET or PUT. Get the filename.
+    // otherwise, it's a GET, PUT or directory transfer. Get the filename.
     file_req.filename_len = ntohl(file_req.filename_len);
     // and size, if needed
     file_req.filesize = ntohl(file_req.filesize);
+    if (file_req.filename_len > MAX_NAME_LEN) {
+      log_msg(LOG_ERROR, "Filename too long.");
+      close_conn(connfd);
+      return (void *)-1;
+    }
 
+    // the rest of the request gets the header timeout
     char *filename = malloc(file_req.filename_len + 1);
-    filename[file_req.filename_len] = '\0';
-
-    received = recv(connfd, filename, file_req.filename_len, MSG_WAITALL);
-    if (received == 0) {
-      fprintf(stderr, "Connection closed.\n");
+    if (filename == NULL) {
+      log_msg(LOG_ERROR, "Out of memory.");
       close_conn(connfd);
       return (void *)-1;
-    } else if (received == -1) {
-      fprintf(stderr, "recv: %s\n", strerror(errno));
-      close_conn(connfd);
+    }
+    filename[file_req.filename_len] = '\0';
+    deadline = header_timeout ? now_ns() + header_timeout : 0;
+    if (recv_msg(sess, filename, file_req.filename_len, "filename", deadline)) {
+      free(filename);
       return (void *)-1;
-    } else if ((size_t) received < file_req.filename_len) {
-      fprintf(stderr, "Not enough data received for filename.\n");
-      close_conn(connfd);
+    }
+
+    int result;
+    request_failed = 0;
+    sess->size = CAPTURE_NONE;
+    if (file_req.type == GET) {
+      result = serve_get(sess, filename, file_req.filesize == GET_FOLLOW);
+    } else if (file_req.type == PUT) {
+      result = serve_put(sess, filename, file_req.filesize);
+    } else if (file_req.type == COPY || file_req.type == MOVE) {
+      result = serve_copy(sess, file_req.type, filename, file_req.filename_len);
+    } else if (file_req.type == LIST) {
+      result = serve_list(sess, filename, file_req.filename_len, file_req.filesize);
+    } else if (file_req.type == GETDIR) {
+      result = serve_getdir(sess, filename);
+    } else {
+      result = serve_putdir(sess, filename);
+    }
+    if (capture_enabled) {
+      if (file_req.type == PUT || file_req.type == LIST) {
+        sess->size = file_req.filesize;
+      }
+      capture_event(sess->id, request_name(file_req.type), capture_start, sess->size,
+          result || request_failed ? CAPTURE_FAIL : CAPTURE_OK,
+          filename, file_req.filename_len);
+    }
+    free(filename);
+    if (result) {
+      // the connection was closed
       return (void *)-1;
     }
+  }
+  return (void *) -1;
+}
 
-    // set up a buffer for file operations
-    char buf[512];
+// send a successful GET response
+// return: 0 on success, -1 on error
+// connfd: client connection
+// filesize: size of the file that follows
+// follow: the request was a GET_FOLLOW, whose response carries a 64-bit size
+// flags: for send, e.g. MSG_MORE
+static int send_get_resp(int connfd, uint64_t filesize, int follow, int flags) {
+  struct {
+    struct ftp_file_response resp;
+    uint64_t size;
+  } msg = {0};
+  msg.resp.type = htonl(GET);
+  msg.resp.result = htonl(SUCCESS);
+  msg.resp.filesize = htonl(filesize);
+  msg.size = htobe64(filesize);
+  ssize_t len = follow ? sizeof(msg) : sizeof(msg.resp);
+  return send(connfd, &msg, len, flags) == len ? 0 : -1;
+}
 
-    // *********** GET REQUEST
+// send a file to the client
+// return: 0 if the session can continue, -1 if the connection was closed
+// sess: the session
+// filename: the file to send
+// follow: if the file is being uploaded, send the upload as it arrives
+int serve_get(struct session *sess, char *filename, int follow) {
+  int err;
+  int connfd = sess->connfd;
 
-    if (file_req.type == GET) {
-      // send the file to the client
-      printf("GET %s\n", filename);
-
-      FILE *file = fopen(filename, "r");
-      if (!file) {
-        fprintf(stderr, "Failed to open requested file for reading.\n");
-        if (send_fail(connfd, GET)) {
-          return (void *)-1;
-        }
-        continue;
-      }
-      // we have a good FILE handle - file exists
-      // determine the size and send to client
+  // latency is measured from the complete request to the last byte
+  uint64_t start = now_ns();
+  uint64_t trace_request = trace_begin();
 
-      struct stat stats;
-      err = stat(filename, &stats);
-      if (err) {
-        fprintf(stderr, "stat: %s\n", strerror(errno));
-        // tell the client there was a problem
-        if (send_fail(connfd, GET)) {
-          return (void *)-1;
-        }
-        continue;
-      }
-      off_t filesize = stats.st_size;
-      // send file size in a successful response
-      struct ftp_file_response resp = {0};
-      resp.type = htonl(GET);
-      resp.result = htonl(SUCCESS);
-      resp.filesize = htonl(filesize);
+  log_msg(LOG_INFO, "GET %s", filename);
 
-      err = send_all(connfd, &resp, sizeof(resp));
-      if (err == -1) {
-        fprintf(stderr, "Error sending filesize.\n");
-        close_conn(connfd);
-        printf("Connection closed.\n");
-        return (void *)-1;
-      } 
-
-      // send the file
-      for (;;) {
-        size_t num_read = fread(buf, 1, sizeof(buf), file);
-        if (num_read != 0) {
-          err = send_all(connfd, buf, num_read);
-          if (err == -1) {
-            fprintf(stderr, "Error sending file data.\n");
-            close_conn(connfd);
-            printf("Connection closed.\n");
-            return (void *)-1;
-          } 
-        } else {
-          if (ferror(file)) {
-            fprintf(stderr, "fread: %s\n", strerror(errno));
-            close_conn(connfd);
-            printf("Connection closed.\n");
-            return (void *)-1;
-          } else {
-            // read 0 and no ferror, so we're finished
-            break;
-          }
-        }
-      }
-      // done sending file
-      err = fclose(file);
-      if (err) {
-        fprintf(stderr, "fclose: %s\n", strerror(errno));
+  struct progress *upload = follow ? progress_find(filename) : NULL;
+  if (upload) {
+    log_msg(LOG_DEBUG, "Following the upload of %s.", filename);
+    metrics_add(M_GET_FOLLOW, 1);
+    return serve_follow(sess, upload, filename, follow, start, trace_request);
+  }
+
+  uint64_t trace_start = trace_begin();
+  char path[PATH_MAX];
+  int disk = store_find(filename, path);
+  int fd = disk == -1 ? -1 : open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1 && errno == ENOENT && relay_enabled()) {
+    // not cached here yet
+    return relay_get(sess, filename, follow);
+  }
+  if (fd == -1) {
+    log_msg(LOG_ERROR, "Failed to open requested file for reading.");
+    return send_fail(connfd, GET);
+  }
+  // we have a good file descriptor - file exists
+  // determine the size and send to client
+
+  struct stat stats;
+  err = fstat(fd, &stats);
+  if (err) {
+    log_msg(LOG_ERROR, "stat: %s", strerror(errno));
+    close(fd);
+    // tell the client there was a problem
+    return send_fail(connfd, GET);
+  }
+  off_t filesize = stats.st_size;
+  sess->size = filesize;
+  trace_end("open", trace_start, sess->id, filename);
+  // send file size in a successful response. MSG_MORE holds the header
+  // back to go out with the first of the data instead of in a packet of its
+  // own that the data then waits to be ACKed
+  err = send_get_resp(connfd, filesize, follow, filesize ? MSG_MORE : 0);
+  if (err == -1) {
+    log_msg(LOG_ERROR, "Error sending filesize.");
+    close(fd);
+    close_conn(connfd);
+    log_msg(LOG_INFO, "Connection closed.");
+    return -1;
+  }
+
+  // send the file, paced by this user's share of the bandwidth. sendfile
+  // goes from the page cache to the socket, encrypted by the kernel on a
+  // TLS connection; the disk's I/O threads read the next chunk into the
+  // cache while this one is sent
+  struct shape_transfer shaper;
+  shape_start(&shaper, sess->user, sess->conn_rate);
+  struct rate_window window;
+  rate_start(&window, sess, SO_SNDTIMEO);
+  trace_start = trace_begin();
+  struct store_io ahead = { .fd = fd, .op = STORE_READAHEAD, .off = 0 };
+  ahead.len = filesize < STORE_CHUNK ? (size_t) filesize : STORE_CHUNK;
+  int pending = 0;
+  if (filesize > 0) {
+    store_submit(disk, &ahead);
+    pending = 1;
+  }
+  // never send more than we announced, even if the file is still growing
+  off_t sent = 0;
+  err = 0;
+  while (sent < filesize) {
+    if (pending) {
+      store_wait(disk, &ahead);
+      pending = 0;
+    }
+    size_t len = ahead.len;
+    if (sent + (off_t) len < filesize) {
+      ahead.off = sent + len;
+      ahead.len = filesize - ahead.off < STORE_CHUNK ? (size_t) (filesize - ahead.off) :
+          STORE_CHUNK;
+      store_submit(disk, &ahead);
+      pending = 1;
+    }
+    uint64_t slept = shape_wait(&shaper, len);
+    err = sendfile_all(connfd, fd, sent, len);
+    if (err == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        log_msg(LOG_WARN, "Timed out sending file data.");
+        metrics_add(M_TIMEOUTS, 1);
+      } else {
+        log_msg(LOG_ERROR, "Error sending file data: %s", strerror(errno));
       }
-    // *********** PUT REQUEST
+      break;
+    } else if (err == 1) {
+      // the size was already announced
+      log_msg(LOG_ERROR, "%s shrank while being sent.", filename);
+      err = -1;
+      break;
+    }
+    err = rate_check(&window, len, slept);
+    if (err == -1) {
+      break;
+    }
+    metrics_add(M_BYTES_OUT, len);
+    if (sent == 0) {
+      trace_end("first_byte", trace_request, sess->id, filename);
+    }
+    sent += len;
+  }
+  // an early exit can leave the next readahead in flight
+  if (pending) {
+    store_wait(disk, &ahead);
+  }
+  shape_finish(&shaper);
+  // done sending file
+  if (close(fd)) {
+    log_msg(LOG_ERROR, "close: %s", strerror(errno));
+  }
+  if (err == -1) {
+    close_conn(connfd);
+    log_msg(LOG_INFO, "Connection closed.");
+    return -1;
+  }
+  trace_end("send", trace_start, sess->id, filename);
+  metrics_add(M_GET, 1);
+  metrics_record(H_GET, now_ns() - start);
+  trace_end("get", trace_request, sess->id, filename);
+  return 0;
+}
 
-    } else if (file_req.type == PUT) {
-      // receive a file from the client
-      printf("PUT %s\n", filename);
+// send a file as it is written, by an upload or a relay fetch
+// return: 0 if the session can continue, -1 if the connection was closed
+// sess: the session
+// p: the file's progress entry; the caller's reference is let go of here
+// filename: the file, for the log
+// follow: the request was a GET_FOLLOW, whose response carries a 64-bit size
+// start: now_ns() when the request was complete
+// trace_request: trace_begin() when the request was complete
+int serve_follow(struct session *sess, struct progress *p, char *filename, int follow,
+    uint64_t start, uint64_t trace_request) {
+  int err;
+  int connfd = sess->connfd;
 
-      // first send a response to the request
-      struct ftp_file_response resp = {0};
-      resp.type = htonl(PUT);
-      resp.result = htonl(SUCCESS);
-      resp.filesize = htonl(file_req.filesize); // not needed here, but why not include
+  // the size is known once the writer has started; an empty file has
+  // nothing to hold back, so wait for it to be published
+  uint64_t have;
+  if (progress_wait(p, 0, &have) || (p->size == 0 && progress_done(p))) {
+    progress_put(p);
+    return send_fail(connfd, GET);
+  }
+  uint64_t filesize = p->size;
+  sess->size = filesize;
+  trace_end("open", trace_request, sess->id, filename);
 
-      err = send_all(connfd, &resp, sizeof(resp));
-      if (err == -1) {
-        fprintf(stderr, "Error sending PUT response.\n");
-        close_conn(connfd);
-        printf("Connection closed.\n");
-        return (void *)-1;
-      } 
+  if (send_get_resp(connfd, filesize, follow, 0) == -1) {
+    log_msg(LOG_ERROR, "Error sending filesize.");
+    progress_put(p);
+    close_conn(connfd);
+    log_msg(LOG_INFO, "Connection closed.");
+    return -1;
+  }
 
-      // create new file for writing
-      FILE *file = fopen(filename, "w");
-      if (!file) {
-        fprintf(stderr, "Failed to open requested file for writing.\n");
-        close_conn(connfd);
-        printf("Connection closed.\n");
-        return (void *)-1;
+  // send what has been written, paced like any other GET, waking on the
+  // writer's progress reports
+  struct shape_transfer shaper;
+  shape_start(&shaper, sess->user, sess->conn_rate);
+  struct rate_window window;
+  rate_start(&window, sess, SO_SNDTIMEO);
+  uint64_t trace_start = trace_begin();
+  uint64_t sent = 0;
+  err = 0;
+  while (sent < filesize) {
+    if (sent == have && progress_wait(p, sent + 1, &have)) {
+      log_msg(LOG_ERROR, "Writing %s failed.", filename);
+      err = -1;
+      break;
+    }
+    size_t len = have - sent < STORE_CHUNK ? have - sent : STORE_CHUNK;
+    // the end of the file goes out only once the writer has published it,
+    // so nobody gets a whole file whose upload then fails
+    if (sent + len == filesize && progress_done(p)) {
+      log_msg(LOG_ERROR, "Writing %s failed.", filename);
+      err = -1;
+      break;
+    }
+    uint64_t slept = shape_wait(&shaper, len);
+    err = sendfile_all(connfd, p->fd, sent, len);
+    if (err == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        log_msg(LOG_WARN, "Timed out sending file data.");
+        metrics_add(M_TIMEOUTS, 1);
+      } else {
+        log_msg(LOG_ERROR, "Error sending file data: %s", strerror(errno));
       }
+      break;
+    } else if (err == 1) {
+      log_msg(LOG_ERROR, "%s shrank while being sent.", filename);
+      err = -1;
+      break;
+    }
+    err = rate_check(&window, len, slept);
+    if (err == -1) {
+      break;
+    }
+    metrics_add(M_BYTES_OUT, len);
+    if (sent == 0) {
+      trace_end("first_byte", trace_request, sess->id, filename);
+    }
+    sent += len;
+  }
+  shape_finish(&shaper);
+  progress_put(p);
+  if (err == -1) {
+    // the requester was promised the whole file, it has to see the failure
+    close_conn(connfd);
+    log_msg(LOG_INFO, "Connection closed.");
+    return -1;
+  }
+  trace_end("send", trace_start, sess->id, filename);
+  metrics_add(M_GET, 1);
+  metrics_record(H_GET, now_ns() - start);
+  trace_end("get", trace_request, sess->id, filename);
+  return 0;
+}
 
-      char buf[512];
+// a followed upload is over, let its readers know how it went
+// p: the upload's progress entry, NULL if it has none
+// ok: the file was published
+static void upload_finish(struct progress *p, int ok) {
+  if (p) {
+    progress_finish(p, ok);
+    progress_put(p);
+  }
+}
 
-      size_t num_received = 0;
-      int to_receive;
-      while (num_received < file_req.filesize) {
-        // determine how much to receive
-        if (file_req.filesize - num_received >= sizeof(buf)) {
-          to_receive = sizeof(buf);
-        } else {
-          to_receive = file_req.filesize - num_received;
-        }
-        // receive and write to buffer
-        ssize_t received = recv(connfd, buf, to_receive, 0);
-        if (received == 0) {
-          fprintf(stderr, "Connection closed.\n");
-          return (void *)-1;
-        } else if (received == -1) {
-          fprintf(stderr, "recv: %s\n", strerror(errno));
-          close_conn(connfd);
-          printf("Connection closed.\n");
-          return (void *)-1;
-        }
-        // save the written part of buffer to file
-        fwrite(buf, 1, received, file);
-        if (ferror(file)) {
-          fprintf(stderr, "fwrite: %s\n", strerror(errno));
-          close_conn(connfd);
-          printf("Connection closed.\n");
-          return (void *)-1;
-        }
-        num_received += received;
-      }
+// receive a file from the client
+// return: 0 if the session can continue, -1 if the connection was closed
+// sess: the session
+// filename: the file to create
+// filesize: number of bytes the client will send
+int serve_put(struct session *sess, char *filename, size_t filesize) {
+  int err;
+  int connfd = sess->connfd;
 
-      // close the file
-      err = fclose(file);
-      if (err) {
-        fprintf(stderr, "fclose: %s\n", strerror(errno));
-        return (void *)-1;
+  // latency is measured from the complete request to the last byte
+  uint64_t start = now_ns();
+  uint64_t trace_request = trace_begin();
+
+  log_msg(LOG_INFO, "PUT %s", filename);
+
+  // the upload goes to a temporary file until it's complete, so the
+  // old file stays whole (and readable) until then
+  uint64_t trace_start = trace_begin();
+  char path[PATH_MAX];
+  struct stage stage;
+  int disk = store_mkdirs(filename) ? -1 : store_path(filename, path);
+  if (disk == -1 || stage_open(&stage, path, 0)) {
+    log_msg(LOG_ERROR, "Failed to open requested file for writing.");
+    return send_fail(connfd, PUT);
+  }
+  int fd = fileno(stage.file);
+  // two chunks, one being received while the disk's I/O threads write the other
+  char *bufs = affinity_alloc(2 * STORE_CHUNK);
+  if (bufs == NULL) {
+    log_msg(LOG_ERROR, "Failed to allocate upload buffers.");
+    stage_abort(&stage);
+    return send_fail(connfd, PUT);
+  }
+  trace_end("open", trace_start, sess->id, filename);
+
+  // GETs may follow the upload while it arrives, unless something else
+  // (another upload, a relay fetch) is already writing the name
+  int created;
+  struct progress *p = progress_claim(filename, &created);
+  if (p && !created) {
+    progress_put(p);
+    p = NULL;
+  }
+  if (p) {
+    progress_ready(p, fd, filesize);
+  }
+
+  // then send a response to the request
+  struct ftp_file_response resp = {0};
+  resp.type = htonl(PUT);
+  resp.result = htonl(SUCCESS);
+  resp.filesize = htonl(filesize); // not needed here, but why not include
+
+  err = send_all(connfd, &resp, sizeof(resp));
+  if (err == -1) {
+    log_msg(LOG_ERROR, "Error sending PUT response.");
+    affinity_free(bufs, 2 * STORE_CHUNK);
+    upload_finish(p, 0);
+    stage_abort(&stage);
+    close_conn(connfd);
+    log_msg(LOG_INFO, "Connection closed.");
+    return -1;
+  }
+  trace_start = trace_begin();
+
+  // uploads are paced the same way as downloads
+  struct shape_transfer shaper;
+  shape_start(&shaper, sess->user, sess->conn_rate);
+  struct rate_window window;
+  rate_start(&window, sess, SO_RCVTIMEO);
+
+  struct store_io io[2];
+  int cur = 0;
+  int pending = 0;
+  size_t num_received = 0;
+  size_t filled = 0;
+  err = 0;
+  while (num_received < filesize) {
+    // determine how much to receive
+    size_t to_receive = STORE_CHUNK - filled;
+    if (filesize - num_received < to_receive) {
+      to_receive = filesize - num_received;
+    }
+    uint64_t slept = shape_wait(&shaper, to_receive);
+    // receive into the current chunk
+    char *buf = bufs + cur * STORE_CHUNK;
+    ssize_t received = recv(connfd, buf + filled, to_receive, 0);
+    if (received == 0) {
+      log_msg(LOG_INFO, "Connection closed.");
+      err = -1;
+      break;
+    } else if (received == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      log_msg(LOG_WARN, "Timed out receiving file data.");
+      metrics_add(M_TIMEOUTS, 1);
+      err = -1;
+      break;
+    } else if (received == -1) {
+      log_msg(LOG_ERROR, "recv: %s", strerror(errno));
+      err = -1;
+      break;
+    }
+    err = rate_check(&window, received, slept);
+    if (err == -1) {
+      break;
+    }
+    filled += received;
+    num_received += received;
+    metrics_add(M_BYTES_IN, received);
+    if (filled < STORE_CHUNK && num_received < filesize) {
+      continue;
+    }
+    // the chunk is full: once the other one is written, it can be refilled
+    // while this one is written
+    if (pending && store_wait(disk, &io[!cur]) == -1) {
+      log_msg(LOG_ERROR, "pwrite: %s", strerror(errno));
+      pending = 0;
+      err = -1;
+      break;
+    }
+    if (pending && p) {
+      progress_advance(p, io[!cur].off + io[!cur].len);
+    }
+    io[cur] = (struct store_io) { .fd = fd, .op = STORE_WRITE, .buf = buf, .len = filled,
+      .off = num_received - filled };
+    store_submit(disk, &io[cur]);
+    pending = 1;
+    cur = !cur;
+    filled = 0;
+  }
+  if (pending && store_wait(disk, &io[!cur]) == -1) {
+    log_msg(LOG_ERROR, "pwrite: %s", strerror(errno));
+    err = -1;
+  } else if (pending && p) {
+    progress_advance(p, io[!cur].off + io[!cur].len);
+  }
+  shape_finish(&shaper);
+  affinity_free(bufs, 2 * STORE_CHUNK);
+  if (err == -1) {
+    upload_finish(p, 0);
+    stage_abort(&stage);
+    close_conn(connfd);
+    log_msg(LOG_INFO, "Connection closed.");
+    return -1;
+  }
+  trace_end("recv", trace_start, sess->id, filename);
+
+  // publish the file (on disk first with -D), then tell the client
+  trace_start = trace_begin();
+  err = stage_commit(&stage);
+  trace_end("close", trace_start, sess->id, filename);
+  upload_finish(p, err == 0);
+  resp.result = htonl(err ? FAILURE : SUCCESS);
+  if (send_all(connfd, &resp, sizeof(resp)) == -1) {
+    log_msg(LOG_ERROR, "Error sending PUT result.");
+    close_conn(connfd);
+    log_msg(LOG_INFO, "Connection closed.");
+    return -1;
+  }
+  if (err) {
+    return 0;
+  }
+  metrics_add(M_PUT, 1);
+  metrics_record(H_PUT, now_ns() - start);
+  trace_end("put", trace_request, sess->id, filename);
+  return 0;
+}
+
+// shaping and the minimum rate for a directory transfer
+struct dir_pace {
+  struct shape_transfer shaper;
+  struct rate_window window;
+};
+
+// archive_io pace hook
+static int pace_dir(void *arg, size_t n) {
+  struct dir_pace *pace = arg;
+  uint64_t slept = shape_wait(&pace->shaper, n);
+  return rate_check(&pace->window, n, slept);
+}
+
+// archive_io log hook
+static void log_dir(const char *fmt, va_list args) {
+  log_vmsg(LOG_ERROR, fmt, args);
+}
+
+// send a directory tree to the client as an archive stream
+// return: 0 if the session can continue, -1 if the connection was closed
+// sess: the session
+// dirname: the directory to send
+int serve_getdir(struct session *sess, char *dirname) {
+  int connfd = sess->connfd;
+  uint64_t start = now_ns();
+  uint64_t trace_request = trace_begin();
+
+  log_msg(LOG_INFO, "GETDIR %s", dirname);
+
+  // the root has to stay inside the data directories, like every path in
+  // the archive
+  if (!archive_safe_path(dirname)) {
+    log_msg(LOG_WARN, "Refusing directory: %s", dirname);
+    return send_fail(connfd, GETDIR);
+  }
+
+  // the tree is spread over the data directories, any of them will do
+  int found = 0;
+  for (int i = 0; i < num_data_dirs && !found; i++) {
+    char path[PATH_MAX];
+    struct stat stats;
+    found = snprintf(path, sizeof(path), "%s/%s", data_dirs[i], dirname) < PATH_MAX &&
+        stat(path, &stats) == 0 && S_ISDIR(stats.st_mode);
+  }
+  if (!found) {
+    log_msg(LOG_ERROR, "Requested directory doesn't exist.");
+    return send_fail(connfd, GETDIR);
+  }
+
+  struct ftp_file_response resp = {0};
+  resp.type = htonl(GETDIR);
+  resp.result = htonl(SUCCESS);
+  if (send_all(connfd, &resp, sizeof(resp)) == -1) {
+    log_msg(LOG_ERROR, "Error sending GETDIR response.");
+    close_conn(connfd);
+    log_msg(LOG_INFO, "Connection closed.");
+    return -1;
+  }
+
+  struct dir_pace pace;
+  shape_start(&pace.shaper, sess->user, sess->conn_rate);
+  rate_start(&pace.window, sess, SO_SNDTIMEO);
+  struct archive_io io = { connfd, pace_dir, &pace, log_dir, 0, 0, 0, data_dirs,
+    num_data_dirs, store_disk };
+  int err = archive_send(&io, dirname);
+  shape_finish(&pace.shaper);
+  metrics_add(M_BYTES_OUT, io.bytes);
+  if (err) {
+    log_msg(LOG_ERROR, "Error sending directory.");
+    close_conn(connfd);
+    log_msg(LOG_INFO, "Connection closed.");
+    return -1;
+  }
+  if (io.failed) {
+    log_msg(LOG_WARN, "GETDIR %s: %d entries couldn't be sent.", dirname, io.failed);
+  }
+  log_msg(LOG_INFO, "GETDIR %s: %llu files, %llu bytes", dirname,
+      (unsigned long long) io.files, (unsigned long long) io.bytes);
+  metrics_add(M_GETDIR, 1);
+  metrics_record(H_GETDIR, now_ns() - start);
+  trace_end("getdir", trace_request, sess->id, dirname);
+  return 0;
+}
+
+// receive a directory tree from the client
+// return: 0 if the session can continue, -1 if the connection was closed
+// sess: the session
+// dirname: the directory to create
+int serve_putdir(struct session *sess, char *dirname) {
+  int connfd = sess->connfd;
+  uint64_t start = now_ns();
+  uint64_t trace_request = trace_begin();
+
+  log_msg(LOG_INFO, "PUTDIR %s", dirname);
+
+  // the root has to stay inside the data directories, like every path in
+  // the archive
+  if (!archive_safe_path(dirname)) {
+    log_msg(LOG_WARN, "Refusing directory: %s", dirname);
+    return send_fail(connfd, PUTDIR);
+  }
+
+  // every data directory gets the whole directory tree, and each file
+  // goes to the one it belongs in
+  for (int i = 0; i < num_data_dirs; i++) {
+    char path[PATH_MAX];
+    if (snprintf(path, sizeof(path), "%s/%s", data_dirs[i], dirname) >= PATH_MAX ||
+        (mkdir(path, 0755) && errno != EEXIST)) {
+      log_msg(LOG_ERROR, "mkdir: %s", strerror(errno));
+      return send_fail(connfd, PUTDIR);
+    }
+  }
+
+  struct ftp_file_response resp = {0};
+  resp.type = htonl(PUTDIR);
+  resp.result = htonl(SUCCESS);
+  if (send_all(connfd, &resp, sizeof(resp)) == -1) {
+    log_msg(LOG_ERROR, "Error sending PUTDIR response.");
+    close_conn(connfd);
+    log_msg(LOG_INFO, "Connection closed.");
+    return -1;
+  }
+
+  struct dir_pace pace;
+  shape_start(&pace.shaper, sess->user, sess->conn_rate);
+  rate_start(&pace.window, sess, SO_RCVTIMEO);
+  struct archive_io io = { connfd, pace_dir, &pace, log_dir, 0, 0, 0, data_dirs,
+    num_data_dirs, store_disk };
+  int err = archive_recv(&io, dirname);
+  shape_finish(&pace.shaper);
+  metrics_add(M_BYTES_IN, io.bytes);
+  if (err) {
+    log_msg(LOG_ERROR, "Error receiving directory.");
+    close_conn(connfd);
+    log_msg(LOG_INFO, "Connection closed.");
+    return -1;
+  }
+
+  // everything is on disk, tell the client how it went
+  resp.result = htonl(io.failed ? FAILURE : SUCCESS);
+  resp.filesize = htonl(io.files);
+  if (send_all(connfd, &resp, sizeof(resp)) == -1) {
+    log_msg(LOG_ERROR, "Error sending PUTDIR result.");
+    close_conn(connfd);
+    log_msg(LOG_INFO, "Connection closed.");
+    return -1;
+  }
+  if (io.failed) {
+    log_msg(LOG_WARN, "PUTDIR %s: %d files couldn't be written.", dirname, io.failed);
+  }
+  log_msg(LOG_INFO, "PUTDIR %s: %llu files, %llu bytes", dirname,
+      (unsigned long long) io.files, (unsigned long long) io.bytes);
+  metrics_add(M_PUTDIR, 1);
+  metrics_record(H_PUTDIR, now_ns() - start);
+  trace_end("putdir", trace_request, sess->id, dirname);
+  return 0;
+}
+
+// receive exactly len bytes of a request, closing the connection on failure
+// return: 0 on success, -1 if the connection was closed
+// sess: the session
+// buf: where to put the bytes
+// len: how many bytes to receive
+// what: what is being received, for the log
+// deadline: now_ns() time to give up at, 0 for never
+int recv_msg(struct session *sess, void *buf, size_t len, const char *what, uint64_t deadline) {
+  int connfd = sess->connfd;
+  size_t received = 0;
+  while (received < len) {
+    if (deadline) {
+      uint64_t now = now_ns();
+      if (now >= deadline || set_timeout(connfd, SO_RCVTIMEO, deadline - now)) {
+        errno = EAGAIN;
+        break;
       }
     }
-    free(filename);
+    // MSG_WAITALL returns early when the timeout fires, so loop for the rest
+    ssize_t n = recv(connfd, (char *) buf + received, len - received, MSG_WAITALL);
+    if (n == 0) {
+      log_msg(LOG_INFO, "Connection closed.");
+      close_conn(connfd);
+      return -1;
+    } else if (n == -1 && errno == EINTR) {
+      continue;
+    } else if (n == -1) {
+      break;
+    }
+    received += n;
   }
-  return (void *) -1;
+  if (received == len) {
+    return 0;
+  }
+  if (errno == EAGAIN || errno == EWOULDBLOCK) {
+    log_msg(LOG_WARN, "Timed out waiting for %s.", what);
+    metrics_add(M_TIMEOUTS, 1);
+  } else {
+    log_msg(LOG_ERROR, "recv: %s", strerror(errno));
+  }
+  close_conn(connfd);
+  log_msg(LOG_INFO, "Connection closed.");
+  return -1;
+}
+
+// send part of a file without copying it through user space
+// return: 0 on success, 1 if the file ended early, -1 on error
+// sockfd: the connection
+// fd: the file
+// off: where to start
+// len: bytes to send
+int sendfile_all(int sockfd, int fd, off_t off, size_t len) {
+  while (len > 0) {
+    ssize_t n = sendfile(sockfd, fd, &off, len);
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n == -1) {
+      return -1;
+    }
+    if (n == 0) {
+      return 1;
+    }
+    len -= n;
+  }
+  return 0;
+}
+
+// set a socket send or receive timeout
+// return: 0 on success, -1 on error
+// optname: SO_SNDTIMEO or SO_RCVTIMEO
+// ns: the timeout, 0 for none
+int set_timeout(int fd, int optname, uint64_t ns) {
+  struct timeval tv;
+  tv.tv_sec = ns / 1000000000ULL;
+  tv.tv_usec = (ns % 1000000000ULL) / 1000;
+  if (ns && tv.tv_sec == 0 && tv.tv_usec == 0) {
+    tv.tv_usec = 1; // a zero timeval means no timeout
+  }
+  return setsockopt(fd, SOL_SOCKET, optname, &tv, sizeof(tv));
+}
+
+// start measuring a transfer's rate
+// a stalled peer fails the blocking call after a full window (or the idle
+// timeout when there is no minimum rate)
+// optname: SO_SNDTIMEO for GET, SO_RCVTIMEO for PUT
+void rate_start(struct rate_window *w, struct session *sess, int optname) {
+  w->start = now_ns();
+  w->bytes = 0;
+  w->slept = 0;
+  set_timeout(sess->connfd, optname, min_rate ? RATE_WINDOW_NS : idle_timeout);
+}
+
+// account for transferred bytes and check the minimum rate once per window
+// return: 0 if fast enough, -1 if the client should be dropped
+// n: bytes just transferred
+// slept: time spent waiting on the bandwidth shaper, which isn't the client's fault
+int rate_check(struct rate_window *w, size_t n, uint64_t slept) {
+  w->bytes += n;
+  w->slept += slept;
+  if (min_rate == 0) {
+    return 0;
+  }
+  uint64_t now = now_ns();
+  uint64_t elapsed = now - w->start;
+  if (elapsed < RATE_WINDOW_NS) {
+    return 0;
+  }
+  elapsed -= w->slept < elapsed ? w->slept : elapsed;
+  if (elapsed >= RATE_WINDOW_NS / 2 && w->bytes * 1000000000ULL / elapsed < min_rate) {
+    log_msg(LOG_WARN, "Client too slow: %llu bytes in %.1f s.",
+        (unsigned long long) w->bytes, elapsed / 1e9);
+    metrics_add(M_TIMEOUTS, 1);
+    return -1;
+  }
+  w->start = now;
+  w->bytes = 0;
+  w->slept = 0;
+  return 0;
 }
 
 int send_fail(int connfd, enum ftp_req_type type) {
+  request_failed = 1;
   struct ftp_file_response resp = {0};
   resp.type = htonl(type);
   resp.result = htonl(FAILURE);
@@ -415,56 +1394,152 @@ int send_fail(int connfd, enum ftp_req_type type) {
 
   int err = send_all(connfd, &resp, sizeof(resp));
   if (err == -1) {
-    fprintf(stderr, "Error sending command response.\n");
+    log_msg(LOG_ERROR, "Error sending command response.");
     close_conn(connfd);
-    printf("Connection closed.\n");
+    log_msg(LOG_INFO, "Connection closed.");
     return -1;
   }
   return 0;
 }
 
-// check if a username and password are in the database
-// return: 0 if no, 1 if yes, -1 if error
-int check_auth(char *username, char *password) {
-  // open the user database
-  FILE *users = fopen("users.txt", "r");
-  if (!users) {
-    fprintf(stderr, "fopen: %s\n", strerror(errno));
-    fprintf(stdout, "Failed to open user database.\n");
-    return 0;
+// name of a request type, as written in the capture
+// return: the name, "?" for a type that isn't a request
+const char *request_name(enum ftp_req_type type) {
+  switch (type) {
+    case GET: return "GET";
+    case PUT: return "PUT";
+    case END: return "END";
+    case STATS: return "STATS";
+    case MUX: return "MUX";
+    case GETDIR: return "GETDIR";
+    case PUTDIR: return "PUTDIR";
+    case LIST: return "LIST";
+    case COPY: return "COPY";
+    case MOVE: return "MOVE";
+    default: return "?";
   }
+}
 
-  // check username and password
-  char line[256];
-  for (;;) {
-    if (fgets(line, 256, users) == NULL) {
-      if (ferror(users)) {
-        fprintf(stderr, "Error getting users line: %s\n", strerror(errno));
-        return -1;
-      } else {
-        // reached EOF with no match. Deny auth
-        return 0;
-      }
-    }
-    // check the line
-    static char *strtok_state;
-    char *token;
-    token = strtok_r(line, " \r\n", &strtok_state);
-    if (strcmp(token, username) != 0) {
-      continue;
-    }
-    // username exists, check password
-    token = strtok_r(NULL, " \r\n", &strtok_state);
-    if (strcmp(token, password) != 0) {
-      // incorrect password
-      continue;
-    }
-    // both were correct, return positively
-    return 1;
+// send the metrics text in response to a STATS request
+// return: 0 on success, -1 if the connection was closed
+int send_stats(int connfd) {
+  size_t len;
+  char *text = metrics_format(&len);
+  if (text == NULL) {
+    log_msg(LOG_ERROR, "Failed to format metrics.");
+    return send_fail(connfd, STATS);
   }
 
-  // shouldn't get here
-  return -1;
+  struct ftp_file_response resp = {0};
+  resp.type = htonl(STATS);
+  resp.result = htonl(SUCCESS);
+  resp.filesize = htonl(len);
+
+  int err = send_all(connfd, &resp, sizeof(resp));
+  if (err != -1) {
+    err = send_all(connfd, text, len);
+  }
+  free(text);
+  if (err == -1) {
+    log_msg(LOG_ERROR, "Error sending stats.");
+    close_conn(connfd);
+    log_msg(LOG_INFO, "Connection closed.");
+    return -1;
+  }
+  return 0;
+}
+
+// copy or move a file without it leaving the server
+// return: 0 if the session can continue, -1 if the connection was closed
+// sess: the session
+// type: COPY or MOVE
+// request: the source, a NUL, then the destination
+// len: length of request
+int serve_copy(struct session *sess, enum ftp_req_type type, char *request, size_t len) {
+  int connfd = sess->connfd;
+  uint64_t trace_request = trace_begin();
+  char *src = request;
+  if (strlen(src) + 1 >= len) {
+    log_msg(LOG_ERROR, "%s request without a destination.", type == COPY ? "COPY" : "MOVE");
+    return send_fail(connfd, type);
+  }
+  char *dst = src + strlen(src) + 1;
+
+  log_msg(LOG_INFO, "%s %s %s", type == COPY ? "COPY" : "MOVE", src, dst);
+  uint64_t bytes;
+  enum copy_method method;
+  // the two names may belong in different data directories
+  char src_path[PATH_MAX];
+  char dst_path[PATH_MAX];
+  int err = store_find(src, src_path) == -1 || store_mkdirs(dst) ||
+      store_path(dst, dst_path) == -1;
+  if (err == 0) {
+    err = type == COPY ? copy_file(src_path, dst_path, &bytes, &method) :
+        move_file(src_path, dst_path, &bytes, &method);
+  }
+  if (err) {
+    return send_fail(connfd, type);
+  }
+  log_msg(LOG_DEBUG, "%s done by %s, %llu bytes copied", src, copy_method_name(method),
+      (unsigned long long) bytes);
+
+  struct ftp_file_response resp = {0};
+  resp.type = htonl(type);
+  resp.result = htonl(SUCCESS);
+  resp.filesize = htonl(bytes);
+  if (send_all(connfd, &resp, sizeof(resp)) == -1) {
+    log_msg(LOG_ERROR, "Error sending %s response.", type == COPY ? "COPY" : "MOVE");
+    close_conn(connfd);
+    log_msg(LOG_INFO, "Connection closed.");
+    return -1;
+  }
+  metrics_add(type == COPY ? M_COPY : M_MOVE, 1);
+  trace_end(type == COPY ? "copy" : "move", trace_request, sess->id, src);
+  return 0;
+}
+
+// send a page of the file listing
+// return: 0 if the session can continue, -1 if the connection was closed
+// sess: the session
+// request: the prefix, then optionally a NUL and the name to start after
+// len: length of request
+// limit: most entries, 0 for the default page
+int serve_list(struct session *sess, char *request, size_t len, size_t limit) {
+  int connfd = sess->connfd;
+  char *prefix = request;
+  char *after = strlen(request) < len ? request + strlen(request) + 1 : "";
+  if (limit == 0) {
+    limit = LIST_PAGE;
+  } else if (limit > LIST_PAGE_MAX) {
+    limit = LIST_PAGE_MAX;
+  }
+
+  log_msg(LOG_DEBUG, "LIST %s after %s", prefix, after);
+  // the response goes in front of the page, so it's all one send and
+  // Nagle doesn't hold the page back waiting for a delayed ACK
+  struct ftp_file_response resp = {0};
+  size_t size;
+  char *page = index_list(prefix, after, limit, sizeof(resp), &size);
+  if (page == NULL) {
+    log_msg(LOG_ERROR, "Failed to list files.");
+    return send_fail(connfd, LIST);
+  }
+
+  resp.type = htonl(LIST);
+  resp.result = htonl(SUCCESS);
+  resp.filesize = htonl(size - sizeof(resp));
+  memcpy(page, &resp, sizeof(resp));
+
+  int err = send_all(connfd, page, size);
+  free(page);
+  if (err == -1) {
+    log_msg(LOG_ERROR, "Error sending listing.");
+    close_conn(connfd);
+    log_msg(LOG_INFO, "Connection closed.");
+    return -1;
+  }
+  metrics_add(M_LIST, 1);
+  return 0;
 }
 
 // send bad-auth response and close connection
@@ -475,12 +1550,88 @@ void deny_auth(int connfd) {
 
   int err = send_all(connfd, &resp, sizeof(resp));
   if (err == -1) {
-    fprintf(stderr, "Error sending auth response.\n");
+    log_msg(LOG_ERROR, "Error sending auth response.");
   }
   err = close_conn(connfd);
   if (err) {
-    fprintf(stderr, "Error closing connection.\n");
+    log_msg(LOG_ERROR, "Error closing connection.");
+  }
+  log_msg(LOG_INFO, "Connection closed.");
+}
+
+// refuse a connection from the accept loop without blocking it: a FAILURE
+// auth response if the socket takes it at once, then close. Whatever of the
+// login has already arrived is read first, so the close is a FIN rather
+// than a reset that could destroy the reply. A TLS client could only read
+// an encrypted reply, so it just sees the connection close.
+void drop_conn(int connfd) {
+  if (!tls_server_enabled()) {
+    struct ftp_auth_response resp = {0};
+    resp.type = htonl(AUTH_RESP);
+    resp.result = htonl(FAILURE);
+    ssize_t n = send(connfd, &resp, sizeof(resp), MSG_DONTWAIT | MSG_NOSIGNAL);
+    char buf[512];
+    size_t left = sizeof(struct ftp_auth_request) + 2 * MAX_NAME_LEN;
+    while (n > 0 && left > 0 && (n = recv(connfd, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+      left -= (size_t) n < left ? (size_t) n : left;
+    }
+  }
+  close(connfd);
+}
+
+// turn a client away for being over a session limit and close the
+// connection; the login may not have been read yet
+void refuse_login(int connfd) {
+  struct ftp_auth_response resp = {0};
+  resp.type = htonl(AUTH_RESP);
+  resp.result = htonl(FAILURE);
+
+  int err = send_all(connfd, &resp, sizeof(resp));
+  if (err == -1) {
+    log_msg(LOG_ERROR, "Error sending auth response.");
+  }
+  // closing with the login still unread would reset the connection, which
+  // can destroy the reply before the client reads it; so let the client
+  // hang up first, for a moment and no more than a login's worth of bytes
+  shutdown(connfd, SHUT_WR);
+  set_timeout(connfd, SO_RCVTIMEO, REFUSE_LINGER);
+  char buf[512];
+  size_t left = sizeof(struct ftp_auth_request) + 2 * MAX_NAME_LEN;
+  ssize_t n;
+  while (left > 0 && (n = recv(connfd, buf, sizeof(buf), 0)) > 0) {
+    left -= (size_t) n < left ? (size_t) n : left;
   }
-  printf("Connection closed.\n");
+  close_conn(connfd);
+  log_msg(LOG_INFO, "Connection closed.");
 }
 
+// print usage message
+void usage(void) {
+  fprintf(stderr, "Usage: TigerS [options]\n");
+  fprintf(stderr, "  -l <level>     log level: debug, info, warn, error (default info)\n");
+  fprintf(stderr, "  -T <file>      write a Chrome trace-event JSON trace of every request\n");
+  fprintf(stderr, "  -W <file>      append every login and request (no payloads) to a capture\n");
+  fprintf(stderr, "                 for TigerReplay\n");
+  fprintf(stderr, "  -B <rate>      total transfer bandwidth shared fairly by active users,\n");
+  fprintf(stderr, "                 bytes/sec with a k/m/g suffix, powers of 1024 (default unlimited)\n");
+  fprintf(stderr, "  -m <count>     most sessions at once, more are refused with a FAILURE login\n");
+  fprintf(stderr, "                 response\n");
+  fprintf(stderr, "  -M <count>     most sessions at once for one user\n");
+  fprintf(stderr, "  -H <secs>      time allowed for a login or request to arrive (default 10)\n");
+  fprintf(stderr, "  -I <secs>      close sessions idle between requests this long (default 300)\n");
+  fprintf(stderr, "  -R <rate>      close transfers slower than this, bytes/sec like -B averaged\n");
+  fprintf(stderr, "                 over 10 s, not counting shaping (default off)\n");
+  fprintf(stderr, "  -D             durable uploads: acknowledge a PUT only once it is on disk,\n");
+  fprintf(stderr, "                 syncing concurrent uploads together\n");
+  fprintf(stderr, "  -P <port>      port to listen on (default %d)\n", FTP_PORT);
+  fprintf(stderr, "  -d <dir>       data directory, repeat to spread files over several disks\n");
+  fprintf(stderr, "                 (default the working directory)\n");
+  fprintf(stderr, "  -U <upstream>  relay: fetch GETs for missing files from user:pass@host[:port]\n");
+  fprintf(stderr, "                 and keep them; multiplexed sessions are refused\n");
+  fprintf(stderr, "  -C <file>      TLS: PEM certificate chain; every connection is encrypted\n");
+  fprintf(stderr, "  -K <file>      TLS: PEM private key for -C\n");
+  fprintf(stderr, "  -A <cpus>      run every thread on these CPUs, e.g. 0-7,16-23 for the NIC's node\n");
+  fprintf(stderr, "  -N             move each session to the NUMA node its packets arrive on\n");
+  fprintf(stderr, "  -G <secs>      after a hot restart (SIGUSR2), how long sessions on the old\n");
+  fprintf(stderr, "                 server may take to finish (default 60)\n");
+}
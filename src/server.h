@@ -1,12 +1,62 @@
 #ifndef SERVER_H
 #define SERVER_H
 
+#include <stdint.h>
+#include <sys/types.h>
 #include "common.h"
+#include "progress.h"
+#include "shape.h"
 
+// per-connection state, owned by the connection's thread
+struct session {
+  int connfd;
+  uint64_t id;
+  struct shape_user *user; // bandwidth share, set after login
+  uint64_t conn_rate;      // per-connection limit in bytes/sec, 0 for none
+  int reject;              // over the session limit, refused before the login is read
+  uint64_t size;           // size of the file the current GET sent, for the capture
+};
+
+// timeouts and limits from the command line, see server.c
+extern uint64_t header_timeout;
+extern uint64_t idle_timeout;
+extern uint64_t min_rate;
+
+// bytes/sec are averaged over this window for the minimum transfer rate
+#define RATE_WINDOW_NS (10 * 1000000000ULL)
+
+// bytes moved in the current minimum-rate window
+struct rate_window {
+  uint64_t start;
+  uint64_t bytes;
+  uint64_t slept;
+};
+
+int open_listener(char *port);
 void *handle_client(void *arg);
+int start_tls(struct session *sess);
+void *serve_client(struct session *sess);
+int serve_get(struct session *sess, char *filename, int follow);
+int serve_follow(struct session *sess, struct progress *p, char *filename, int follow,
+    uint64_t start, uint64_t trace_request);
+int serve_put(struct session *sess, char *filename, size_t filesize);
+int serve_mux(struct session *sess);
+int serve_getdir(struct session *sess, char *dirname);
+int serve_putdir(struct session *sess, char *dirname);
 int send_fail(int connfd, enum ftp_req_type type);
-int check_auth(char *username, char *password);
+const char *request_name(enum ftp_req_type type);
+int serve_copy(struct session *sess, enum ftp_req_type type, char *request, size_t len);
+int serve_list(struct session *sess, char *request, size_t len, size_t limit);
+int send_stats(int connfd);
 void deny_auth(int connfd);
+void drop_conn(int connfd);
+void refuse_login(int connfd);
+int recv_msg(struct session *sess, void *buf, size_t len, const char *what, uint64_t deadline);
+int sendfile_all(int sockfd, int fd, off_t off, size_t len);
+int set_timeout(int fd, int optname, uint64_t ns);
+void rate_start(struct rate_window *w, struct session *sess, int optname);
+int rate_check(struct rate_window *w, size_t n, uint64_t slept);
+void usage(void);
 
 #endif
 
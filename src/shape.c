@@ -0,0 +1,220 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "common.h"
+#include "shape.h"
+
+// Bandwidth shaping in two levels. The global rate (if any) is divided
+// max-min fairly between users that are transferring: users whose own limit
+// is below an equal split keep their limit and the rest is split among the
+// others. Each user's share is then divided equally between that user's
+// transfers, so 50 parallel GETs from one user get the same total as one GET
+// from another user. Each transfer paces itself with a private token bucket;
+// the shape lock is only taken when a transfer starts or finishes.
+
+// how much a transfer may send in one burst, in seconds of its rate
+#define BURST_SECONDS 0.05
+
+static uint64_t global_rate = 0;
+static struct shape_user *users = NULL;
+static pthread_mutex_t shape_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// set the global rate, call once before any sessions start
+// global: total bytes/sec for all transfers, 0 for unlimited
+void shape_init(uint64_t global) {
+  global_rate = global;
+}
+
+// order users by limit, unlimited last
+static int cmp_limit(const void *a, const void *b) {
+  uint64_t x = (*(struct shape_user * const *) a)->limit;
+  uint64_t y = (*(struct shape_user * const *) b)->limit;
+  x = x ? x : UINT64_MAX;
+  y = y ? y : UINT64_MAX;
+  return (x > y) - (x < y);
+}
+
+// recompute every user's share, call with the shape lock held
+static void recompute_shares(void) {
+  int active = 0;
+  for (struct shape_user *u = users; u; u = u->next) {
+    // idle users get their own limit until they start transferring
+    __atomic_store_n(&u->share, u->limit, __ATOMIC_RELAXED);
+    if (u->transfers > 0) {
+      active++;
+    }
+  }
+  if (global_rate == 0 || active == 0) {
+    return;
+  }
+
+  struct shape_user **sorted = malloc(active * sizeof(*sorted));
+  if (sorted == NULL) {
+    return;
+  }
+  int n = 0;
+  for (struct shape_user *u = users; u; u = u->next) {
+    if (u->transfers > 0) {
+      sorted[n++] = u;
+    }
+  }
+  qsort(sorted, n, sizeof(*sorted), cmp_limit);
+
+  // water-fill: smallest limits first, leftovers go to the rest
+  uint64_t remaining = global_rate;
+  for (int i = 0; i < n; i++) {
+    uint64_t fair = remaining / (n - i);
+    uint64_t share = fair;
+    if (sorted[i]->limit && sorted[i]->limit < fair) {
+      share = sorted[i]->limit;
+    }
+    if (share == 0) {
+      share = 1; // never let 0 mean unlimited here
+    }
+    __atomic_store_n(&sorted[i]->share, share, __ATOMIC_RELAXED);
+    remaining -= share < remaining ? share : remaining;
+  }
+  free(sorted);
+}
+
+// register a session for a user
+// return: the user's shared state, NULL if out of memory (no shaping)
+// name: the username
+// limit: the user's limit from users.txt, bytes/sec, 0 for unlimited
+// sessions: set to the user's open sessions, including this one (may be NULL)
+struct shape_user *shape_user_get(char *name, uint64_t limit, int *sessions) {
+  pthread_mutex_lock(&shape_lock);
+  struct shape_user *u;
+  for (u = users; u; u = u->next) {
+    if (strcmp(u->name, name) == 0) {
+      break;
+    }
+  }
+  if (u == NULL) {
+    u = calloc(1, sizeof(*u));
+    if (u) {
+      u->name = strdup(name);
+      if (u->name == NULL) {
+        free(u);
+        u = NULL;
+      }
+    }
+    if (u == NULL) {
+      pthread_mutex_unlock(&shape_lock);
+      return NULL;
+    }
+    u->next = users;
+    users = u;
+  }
+  u->sessions++;
+  if (sessions) {
+    *sessions = u->sessions;
+  }
+  // users.txt is read at every login, so pick up a changed limit
+  if (u->limit != limit) {
+    u->limit = limit;
+    recompute_shares();
+  } else if (u->transfers == 0) {
+    __atomic_store_n(&u->share, limit, __ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(&shape_lock);
+  return u;
+}
+
+// unregister a session, freeing the user once it has none left
+void shape_user_put(struct shape_user *user) {
+  pthread_mutex_lock(&shape_lock);
+  if (--user->sessions == 0 && user->transfers == 0) {
+    struct shape_user **prev = &users;
+    while (*prev != user) {
+      prev = &(*prev)->next;
+    }
+    *prev = user->next;
+    free(user->name);
+    free(user);
+  }
+  pthread_mutex_unlock(&shape_lock);
+}
+
+// begin pacing a transfer
+// t: the transfer's bucket
+// user: the transferring user, NULL for no user limits
+// conn_limit: per-connection limit, bytes/sec, 0 for unlimited
+void shape_start(struct shape_transfer *t, struct shape_user *user, uint64_t conn_limit) {
+  t->user = user;
+  t->conn_limit = conn_limit;
+  t->tokens = 0;
+  t->last_ns = now_ns();
+  if (user) {
+    pthread_mutex_lock(&shape_lock);
+    if (user->transfers++ == 0 && global_rate) {
+      recompute_shares();
+    }
+    pthread_mutex_unlock(&shape_lock);
+  }
+}
+
+// current rate for a transfer
+// return: bytes/sec, 0 for unlimited
+static uint64_t transfer_rate(struct shape_transfer *t) {
+  uint64_t rate = 0;
+  if (t->user) {
+    uint64_t share = __atomic_load_n(&t->user->share, __ATOMIC_RELAXED);
+    int transfers = __atomic_load_n(&t->user->transfers, __ATOMIC_RELAXED);
+    if (share) {
+      rate = share / (transfers > 1 ? transfers : 1);
+      rate = rate ? rate : 1;
+    }
+  }
+  if (t->conn_limit && (rate == 0 || t->conn_limit < rate)) {
+    rate = t->conn_limit;
+  }
+  return rate;
+}
+
+// wait until n more bytes may be transferred
+// return: nanoseconds spent sleeping
+uint64_t shape_wait(struct shape_transfer *t, size_t n) {
+  uint64_t rate = transfer_rate(t);
+  if (rate == 0) {
+    return 0;
+  }
+
+  // refill, capped at one burst
+  uint64_t now = now_ns();
+  double burst = rate * BURST_SECONDS;
+  if (burst < n) {
+    burst = n;
+  }
+  t->tokens += (now - t->last_ns) * (double) rate / 1e9;
+  if (t->tokens > burst) {
+    t->tokens = burst;
+  }
+  t->last_ns = now;
+
+  // go into debt and sleep it off
+  t->tokens -= n;
+  if (t->tokens < 0) {
+    double wait = -t->tokens / rate;
+    struct timespec ts;
+    ts.tv_sec = (time_t) wait;
+    ts.tv_nsec = (long) ((wait - ts.tv_sec) * 1e9);
+    nanosleep(&ts, NULL);
+    t->tokens = 0;
+    t->last_ns = now_ns();
+    return t->last_ns - now;
+  }
+  return 0;
+}
+
+// stop pacing a transfer
+void shape_finish(struct shape_transfer *t) {
+  if (t->user) {
+    pthread_mutex_lock(&shape_lock);
+    if (--t->user->transfers == 0 && global_rate) {
+      recompute_shares();
+    }
+    pthread_mutex_unlock(&shape_lock);
+  }
+}
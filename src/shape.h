@@ -0,0 +1,34 @@
+#ifndef SHAPE_H
+#define SHAPE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// A user with at least one open session. share is the user's fair share of
+// the global bandwidth (bytes/sec, 0 for unlimited), recomputed whenever a
+// user starts or stops transferring.
+struct shape_user {
+  struct shape_user *next;
+  char *name;
+  uint64_t limit;  // from users.txt, 0 for unlimited
+  int sessions;    // open sessions, under the shape lock
+  int transfers;   // transfers in progress, under the shape lock
+  uint64_t share;  // read without the lock
+};
+
+// token bucket for one transfer, owned by the transferring thread
+struct shape_transfer {
+  struct shape_user *user;
+  uint64_t conn_limit;
+  double tokens;
+  uint64_t last_ns;
+};
+
+void shape_init(uint64_t global_rate);
+struct shape_user *shape_user_get(char *name, uint64_t limit, int *sessions);
+void shape_user_put(struct shape_user *user);
+void shape_start(struct shape_transfer *t, struct shape_user *user, uint64_t conn_limit);
+uint64_t shape_wait(struct shape_transfer *t, size_t n);
+void shape_finish(struct shape_transfer *t);
+
+#endif
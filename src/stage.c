@@ -0,0 +1,358 @@
+// syncfs and mkostemp need this
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "metrics.h"
+#include "stage.h"
+
+// Uploads are written to a hidden temporary file in the destination's
+// directory and renamed over the destination once complete, so readers see
+// either the old file or the whole new one, and a failed upload leaves the
+// old file alone.
+//
+// With durability on, a commit isn't acknowledged until the data and the
+// rename are on disk. Commits are handed to one flusher thread, which takes
+// everything queued while it was busy as one batch: it syncs the files,
+// renames them all, then syncs their directories. A big enough batch uses
+// one syncfs per filesystem for each of those steps rather than one fsync
+// per file, so many concurrent uploads share the cost of a journal commit.
+//
+// A caller that mustn't block, like a multiplexed session, starts a commit
+// and is notified when the flusher is done with it; without durability the
+// flusher then just renames.
+
+// a commit waiting for the flusher
+struct flush_req {
+  struct flush_req *next;
+  int fd;
+  dev_t dev;
+  char *tmp;
+  char *path;
+  int done;
+  int renamed;  // the file is in place, even if a later step failed
+  int err;
+  void (*notify)(void *arg);  // called once done is set, NULL for none
+  void *arg;
+};
+
+static int durable = 0;
+static mode_t create_mode = 0666;
+static pthread_mutex_t flush_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flush_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t flush_done = PTHREAD_COND_INITIALIZER;
+static struct flush_req *pending = NULL;
+static struct flush_req **pending_tail = &pending;
+
+// syncfs each filesystem in the batch once
+// ok_only: skip requests that already failed
+static void sync_devices(struct flush_req *batch, int ok_only) {
+  for (struct flush_req *r = batch; r; r = r->next) {
+    if (ok_only && r->err) {
+      continue;
+    }
+    int seen = 0;
+    for (struct flush_req *q = batch; q != r && !seen; q = q->next) {
+      seen = q->dev == r->dev && !(ok_only && q->err);
+    }
+    if (seen) {
+      continue;
+    }
+    if (syncfs(r->fd)) {
+      log_msg(LOG_ERROR, "syncfs: %s", strerror(errno));
+      for (struct flush_req *q = r; q; q = q->next) {
+        if (q->dev == r->dev) {
+          q->err = -1;
+        }
+      }
+    }
+  }
+}
+
+// length of the directory part of path, 0 for none
+static size_t dir_len(char *path) {
+  char *slash = strrchr(path, '/');
+  return slash ? (size_t) (slash - path) : 0;
+}
+
+// fsync the directory holding path
+// return: 0 on success, -1 on error
+static int sync_dir(char *path) {
+  char dir[PATH_MAX];
+  size_t len = dir_len(path);
+  if (path[0] != '/' && len == 0) {
+    strcpy(dir, ".");
+  } else {
+    // "/name" lives in "/"
+    len = len ? len : 1;
+    memcpy(dir, path, len);
+    dir[len] = '\0';
+  }
+  int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd == -1 || fsync(fd)) {
+    log_msg(LOG_ERROR, "fsync %s: %s", dir, strerror(errno));
+    if (fd != -1) {
+      close(fd);
+    }
+    return -1;
+  }
+  close(fd);
+  return 0;
+}
+
+// make a batch of commits durable and visible
+static void flush_batch(struct flush_req *batch) {
+  int n = 0;
+  for (struct flush_req *r = batch; r; r = r->next) {
+    n++;
+  }
+  int whole_fs = n >= STAGE_SYNCFS_MIN;
+
+  // the data, before anyone can see the new name
+  if (!durable) {
+    // only renames to do
+  } else if (whole_fs) {
+    sync_devices(batch, 0);
+  } else {
+    for (struct flush_req *r = batch; r; r = r->next) {
+      if (fsync(r->fd)) {
+        log_msg(LOG_ERROR, "fsync %s: %s", r->path, strerror(errno));
+        r->err = -1;
+      }
+    }
+  }
+
+  for (struct flush_req *r = batch; r; r = r->next) {
+    if (r->err == 0 && rename(r->tmp, r->path)) {
+      log_msg(LOG_ERROR, "rename %s: %s", r->path, strerror(errno));
+      r->err = -1;
+    } else if (r->err == 0) {
+      r->renamed = 1;
+    }
+  }
+
+  // then the renames
+  if (!durable) {
+    return;
+  } else if (whole_fs) {
+    sync_devices(batch, 1);
+  } else {
+    char *last = NULL;
+    for (struct flush_req *r = batch; r; r = r->next) {
+      if (r->err) {
+        continue;
+      }
+      // uploads to one directory usually arrive together
+      size_t len = dir_len(r->path);
+      if (last && dir_len(last) == len && strncmp(last, r->path, len) == 0) {
+        continue;
+      }
+      if (sync_dir(r->path)) {
+        r->err = -1;
+      } else {
+        last = r->path;
+      }
+    }
+  }
+  metrics_add(M_FLUSHES, 1);
+  metrics_add(M_FLUSHED, n);
+}
+
+// wait for commits and flush them in batches
+static void *flusher(void *arg) {
+  (void) arg;
+  pthread_mutex_lock(&flush_lock);
+  for (;;) {
+    while (pending == NULL) {
+      pthread_cond_wait(&flush_work, &flush_lock);
+    }
+    struct flush_req *batch = pending;
+    pending = NULL;
+    pending_tail = &pending;
+    pthread_mutex_unlock(&flush_lock);
+
+    flush_batch(batch);
+
+    pthread_mutex_lock(&flush_lock);
+    for (struct flush_req *r = batch, *next; r; r = next) {
+      // the waiter may return as soon as done is set
+      next = r->next;
+      r->done = 1;
+      if (r->notify) {
+        r->notify(r->arg);
+      }
+    }
+    pthread_cond_broadcast(&flush_done);
+  }
+  return NULL;
+}
+
+// set up staging, call once before any sessions start
+// return: 0 on success, -1 on error
+// sync: make every commit durable before it returns
+int stage_init(int sync) {
+  // temporary files get the mode fopen would have given the upload
+  mode_t mask = umask(0);
+  umask(mask);
+  create_mode = 0666 & ~mask;
+
+  durable = sync;
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, flusher, NULL)) {
+    log_msg(LOG_ERROR, "Failed to start the flusher thread.");
+    return -1;
+  }
+  pthread_detach(thread);
+  return 0;
+}
+
+// create a temporary file for an upload to path
+// return: 0 on success, -1 on error
+// st: set up for writing to st->file
+// path: the upload's final name
+// mode: permission bits for the file, 0 for the usual default
+int stage_open(struct stage *st, char *path, mode_t mode) {
+  st->file = NULL;
+  st->req = NULL;
+  // .name.XXXXXX next to name, which the file index leaves out
+  char *slash = strrchr(path, '/');
+  char *base = slash ? slash + 1 : path;
+  int n = snprintf(st->tmp, sizeof(st->tmp), "%.*s.%s.XXXXXX", (int) (base - path), path, base);
+  if (n >= (int) sizeof(st->tmp) || strlen(path) >= sizeof(st->path)) {
+    log_msg(LOG_ERROR, "Filename too long.");
+    return -1;
+  }
+  strcpy(st->path, path);
+  int fd = mkostemp(st->tmp, O_CLOEXEC);
+  if (fd == -1) {
+    log_msg(LOG_ERROR, "mkstemp %s: %s", st->tmp, strerror(errno));
+    return -1;
+  }
+  fchmod(fd, mode ? mode : create_mode);
+  st->file = fdopen(fd, "w");
+  if (st->file == NULL) {
+    log_msg(LOG_ERROR, "fdopen: %s", strerror(errno));
+    close(fd);
+    unlink(st->tmp);
+    return -1;
+  }
+  return 0;
+}
+
+// publish a finished upload under its final name, replacing any old file
+// return: 0 on success, -1 on error (the upload is discarded)
+int stage_commit(struct stage *st) {
+  if (durable) {
+    if (stage_commit_start(st, NULL, NULL)) {
+      return -1;
+    }
+    return stage_commit_end(st);
+  }
+  int err = 0;
+  if (fflush(st->file)) {
+    log_msg(LOG_ERROR, "fflush: %s", strerror(errno));
+    err = -1;
+  }
+  if (fclose(st->file)) {
+    log_msg(LOG_ERROR, "fclose: %s", strerror(errno));
+    err = -1;
+  }
+  st->file = NULL;
+  if (err == 0 && rename(st->tmp, st->path)) {
+    log_msg(LOG_ERROR, "rename %s: %s", st->path, strerror(errno));
+    err = -1;
+  }
+  if (err) {
+    unlink(st->tmp);
+  }
+  return err;
+}
+
+// hand a finished upload to the flusher to be published, without waiting;
+// stage_commit_end finishes it
+// return: 0 if queued, -1 on error (the upload is discarded)
+// notify: called with arg from the flusher when it is done, must not block;
+//         NULL for none
+int stage_commit_start(struct stage *st, void (*notify)(void *arg), void *arg) {
+  if (fflush(st->file)) {
+    log_msg(LOG_ERROR, "fflush: %s", strerror(errno));
+    stage_abort(st);
+    return -1;
+  }
+  struct flush_req *req = calloc(1, sizeof(*req));
+  if (req == NULL) {
+    log_msg(LOG_ERROR, "Out of memory.");
+    stage_abort(st);
+    return -1;
+  }
+  req->fd = fileno(st->file);
+  req->tmp = st->tmp;
+  req->path = st->path;
+  req->notify = notify;
+  req->arg = arg;
+  struct stat stats;
+  if (fstat(req->fd, &stats) == 0) {
+    req->dev = stats.st_dev;
+  }
+  st->req = req;
+  pthread_mutex_lock(&flush_lock);
+  *pending_tail = req;
+  pending_tail = &req->next;
+  pthread_cond_signal(&flush_work);
+  pthread_mutex_unlock(&flush_lock);
+  return 0;
+}
+
+// return: 1 if the flusher is done with a started commit, so
+//         stage_commit_end won't wait; 0 if not
+int stage_commit_done(struct stage *st) {
+  pthread_mutex_lock(&flush_lock);
+  int done = st->req->done;
+  pthread_mutex_unlock(&flush_lock);
+  return done;
+}
+
+// wait for a started commit and finish it
+// return: 0 on success, -1 on error (the upload is discarded)
+int stage_commit_end(struct stage *st) {
+  struct flush_req *req = st->req;
+  pthread_mutex_lock(&flush_lock);
+  while (!req->done) {
+    pthread_cond_wait(&flush_done, &flush_lock);
+  }
+  pthread_mutex_unlock(&flush_lock);
+  int err = req->err;
+  int renamed = req->renamed;
+  free(req);
+  st->req = NULL;
+  // the flusher keeps the file open to sync it, so it is only closed here,
+  // after the rename; by then the data is synced and in place, and a failed
+  // close loses nothing
+  if (fclose(st->file)) {
+    log_msg(LOG_ERROR, "fclose: %s", strerror(errno));
+    if (!renamed) {
+      err = -1;
+    }
+  }
+  st->file = NULL;
+  if (err && !renamed) {
+    unlink(st->tmp);
+  }
+  return err;
+}
+
+// throw away an unfinished upload
+void stage_abort(struct stage *st) {
+  if (st->file) {
+    fclose(st->file);
+    st->file = NULL;
+  }
+  unlink(st->tmp);
+}
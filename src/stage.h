@@ -0,0 +1,30 @@
+#ifndef STAGE_H
+#define STAGE_H
+
+#include <limits.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+// a batch of at least this many durable commits syncs the whole filesystem
+// once instead of fsyncing each file
+#define STAGE_SYNCFS_MIN 4
+
+struct flush_req;
+
+// an upload being written under a temporary name next to its final one
+struct stage {
+  FILE *file;
+  char path[PATH_MAX];  // final name
+  char tmp[PATH_MAX];   // hidden temporary name in the same directory
+  struct flush_req *req;  // a commit handed to the flusher
+};
+
+int stage_init(int durable);
+int stage_open(struct stage *st, char *path, mode_t mode);
+int stage_commit(struct stage *st);
+int stage_commit_start(struct stage *st, void (*notify)(void *arg), void *arg);
+int stage_commit_done(struct stage *st);
+int stage_commit_end(struct stage *st);
+void stage_abort(struct stage *st);
+
+#endif
@@ -0,0 +1,413 @@
+// for readahead
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "copy.h"
+#include "log.h"
+#include "store.h"
+
+// Files are spread over the data directories by consistent hashing of
+// their names. Each directory takes STORE_POINTS places on a ring of 64-bit
+// hashes and a name belongs to the directory at the first place at or
+// after the name's hash, so adding a directory takes over only the names
+// that now land just before its places, about 1/n of them, and leaves
+// every other file where it is. The places are hashes of the directory's
+// path, so the order of -d options doesn't matter.
+//
+// Each directory also has its own queue of reads and writes served by
+// STORE_WORKERS threads. GET and PUT hand their file I/O to the queue a
+// chunk ahead of the network, so the disk works while the socket does,
+// and a slow disk backs up only its own queue.
+
+struct store_dir {
+  char *root;
+  pthread_mutex_t lock;
+  pthread_cond_t work;
+  pthread_cond_t done;
+  struct store_io *head;
+  struct store_io **tail;
+};
+
+struct ring_point {
+  uint64_t hash;
+  int disk;
+};
+
+static struct store_dir dirs[STORE_MAX_DIRS];
+static int num_dirs = 0;
+static struct ring_point ring[STORE_MAX_DIRS * STORE_POINTS];
+static int ring_size = 0;
+
+// FNV-1a, then a finalizer so similar names spread over the whole ring
+static uint64_t hash_name(const char *s, uint64_t h) {
+  for (; *s; s++) {
+    h = (h ^ (unsigned char) *s) * 0x100000001b3ULL;
+  }
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+static int compare_points(const void *a, const void *b) {
+  const struct ring_point *x = a;
+  const struct ring_point *y = b;
+  return x->hash < y->hash ? -1 : x->hash > y->hash;
+}
+
+// do queued reads and writes for one data directory
+static void *worker(void *arg) {
+  struct store_dir *d = arg;
+  pthread_mutex_lock(&d->lock);
+  for (;;) {
+    while (d->head == NULL) {
+      pthread_cond_wait(&d->work, &d->lock);
+    }
+    struct store_io *io = d->head;
+    d->head = io->next;
+    if (d->head == NULL) {
+      d->tail = &d->head;
+    }
+    pthread_mutex_unlock(&d->lock);
+
+    ssize_t n;
+    if (io->op == STORE_WRITE) {
+      size_t done = 0;
+      n = 0;
+      while (done < io->len) {
+        n = pwrite(io->fd, io->buf + done, io->len - done, io->off + done);
+        if (n == -1 && errno == EINTR) {
+          continue;
+        }
+        if (n == -1) {
+          break;
+        }
+        done += n;
+      }
+      if (n != -1) {
+        n = done;
+      }
+    } else if (io->op == STORE_READAHEAD) {
+      // returns once the reads are issued; the pages are in the cache, or
+      // on their way, when the caller sends them
+      n = readahead(io->fd, io->off, io->len) ? -1 : (ssize_t) io->len;
+    } else {
+      do {
+        n = pread(io->fd, io->buf, io->len, io->off);
+      } while (n == -1 && errno == EINTR);
+    }
+    int err = errno;
+
+    pthread_mutex_lock(&d->lock);
+    io->result = n;
+    io->err = err;
+    io->done = 1;
+    // still under the lock, so a store_wait that returns has seen it called
+    if (io->notify) {
+      io->notify(io->arg);
+    }
+    pthread_cond_broadcast(&d->done);
+  }
+  return NULL;
+}
+
+// set up the data directories and their I/O threads, call once before any
+// sessions start
+// return: 0 on success, -1 on error
+// paths: the data directories, each must exist
+// count: how many, at least 1
+int store_init(char **paths, int count) {
+  if (count < 1 || count > STORE_MAX_DIRS) {
+    log_msg(LOG_ERROR, "Between 1 and %d data directories are supported.", STORE_MAX_DIRS);
+    return -1;
+  }
+  for (int i = 0; i < count; i++) {
+    struct stat st;
+    if (stat(paths[i], &st) || !S_ISDIR(st.st_mode)) {
+      log_msg(LOG_ERROR, "Data directory %s doesn't exist.", paths[i]);
+      return -1;
+    }
+    for (int j = 0; j < i; j++) {
+      if (strcmp(paths[i], paths[j]) == 0) {
+        log_msg(LOG_ERROR, "Data directory %s is given twice.", paths[i]);
+        return -1;
+      }
+    }
+  }
+
+  for (int i = 0; i < count; i++) {
+    struct store_dir *d = &dirs[i];
+    d->root = paths[i];
+    pthread_mutex_init(&d->lock, NULL);
+    pthread_cond_init(&d->work, NULL);
+    pthread_cond_init(&d->done, NULL);
+    d->head = NULL;
+    d->tail = &d->head;
+    for (int j = 0; j < STORE_POINTS; j++) {
+      char key[PATH_MAX + 16];
+      snprintf(key, sizeof(key), "%s#%d", paths[i], j);
+      ring[ring_size].hash = hash_name(key, 0xcbf29ce484222325ULL);
+      ring[ring_size].disk = i;
+      ring_size++;
+    }
+    for (int j = 0; j < STORE_WORKERS; j++) {
+      pthread_t thread;
+      if (pthread_create(&thread, NULL, worker, d)) {
+        log_msg(LOG_ERROR, "Failed to start I/O threads for %s.", d->root);
+        return -1;
+      }
+      pthread_detach(thread);
+    }
+  }
+  num_dirs = count;
+  qsort(ring, ring_size, sizeof(ring[0]), compare_points);
+  return 0;
+}
+
+// return: the number of data directories
+int store_count(void) {
+  return num_dirs;
+}
+
+// return: the path of a data directory
+// disk: its number, in -d order
+char *store_root(int disk) {
+  return dirs[disk].root;
+}
+
+// return: the data directory a file belongs in
+// name: the file's name, relative to the data directories
+int store_disk(char *name) {
+  if (num_dirs == 1) {
+    return 0;
+  }
+  uint64_t h = hash_name(name, 0xcbf29ce484222325ULL);
+  // first place at or after h, wrapping around
+  int lo = 0;
+  int hi = ring_size;
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if (ring[mid].hash < h) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return ring[lo == ring_size ? 0 : lo].disk;
+}
+
+// build the path of a file in one data directory
+// return: 0 on success, -1 if it's too long
+static int join(char *path, int disk, char *name) {
+  return snprintf(path, PATH_MAX, "%s/%s", dirs[disk].root, name) < PATH_MAX ? 0 : -1;
+}
+
+// find where a file belongs
+// return: its data directory, -1 if the name is too long
+// name: the file's name, relative to the data directories
+// path: set to the file's path, PATH_MAX bytes
+int store_path(char *name, char *path) {
+  int disk = store_disk(name);
+  if (join(path, disk, name)) {
+    log_msg(LOG_ERROR, "Filename too long.");
+    return -1;
+  }
+  return disk;
+}
+
+// find an existing file, which may not have been moved to where it belongs
+// yet after a data directory was added
+// return: its data directory, or where it belongs if it's nowhere; -1 if
+//         the name is too long
+// name: the file's name, relative to the data directories
+// path: set to the file's path, PATH_MAX bytes
+int store_find(char *name, char *path) {
+  int disk = store_path(name, path);
+  struct stat st;
+  if (disk == -1 || num_dirs == 1 || lstat(path, &st) == 0 || errno != ENOENT) {
+    return disk;
+  }
+  for (int i = 0; i < num_dirs; i++) {
+    if (i != disk && join(path, i, name) == 0 && lstat(path, &st) == 0) {
+      return i;
+    }
+  }
+  join(path, disk, name);
+  return disk;
+}
+
+// make the directories leading to a file in the data directory it belongs
+// in, if the directory exists in any data directory; a directory exists
+// when it exists in any of them
+// return: 0 on success, -1 on error
+// name: the file's name, relative to the data directories
+int store_mkdirs(char *name) {
+  char *slash = strrchr(name, '/');
+  if (num_dirs == 1 || slash == NULL) {
+    return 0;
+  }
+  int disk = store_disk(name);
+  char parent[PATH_MAX];
+  char path[PATH_MAX];
+  snprintf(parent, sizeof(parent), "%.*s", (int) (slash - name), name);
+  struct stat st;
+  if (join(path, disk, parent) || stat(path, &st) == 0) {
+    return 0;
+  }
+  int found = 0;
+  for (int i = 0; i < num_dirs && !found; i++) {
+    found = join(path, i, parent) == 0 && stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+  }
+  if (!found) {
+    // nothing to mirror, the caller's open fails as it would have
+    return 0;
+  }
+  // each missing level, top down
+  join(path, disk, parent);
+  size_t skip = strlen(dirs[disk].root) + 1;
+  for (char *p = path + skip; ; p++) {
+    if (*p != '/' && *p != '\0') {
+      continue;
+    }
+    char c = *p;
+    *p = '\0';
+    if (mkdir(path, 0755) && errno != EEXIST) {
+      log_msg(LOG_ERROR, "mkdir %s: %s", path, strerror(errno));
+      return -1;
+    }
+    *p = c;
+    if (c == '\0') {
+      break;
+    }
+  }
+  return 0;
+}
+
+// queue a read or write on a data directory's I/O threads
+// disk: the data directory io's file is in
+// io: filled in by the caller, owned by the queue until store_wait
+void store_submit(int disk, struct store_io *io) {
+  struct store_dir *d = &dirs[disk];
+  io->next = NULL;
+  io->done = 0;
+  pthread_mutex_lock(&d->lock);
+  *d->tail = io;
+  d->tail = &io->next;
+  pthread_cond_signal(&d->work);
+  pthread_mutex_unlock(&d->lock);
+}
+
+// wait for a queued read or write
+// return: bytes read or written, -1 on error (errno is set)
+ssize_t store_wait(int disk, struct store_io *io) {
+  struct store_dir *d = &dirs[disk];
+  pthread_mutex_lock(&d->lock);
+  while (!io->done) {
+    pthread_cond_wait(&d->done, &d->lock);
+  }
+  pthread_mutex_unlock(&d->lock);
+  if (io->result == -1) {
+    errno = io->err;
+  }
+  return io->result;
+}
+
+// check on a queued read or write without waiting for it
+// return: 1 if it is done, store_wait then returns at once; 0 if not
+int store_done(int disk, struct store_io *io) {
+  struct store_dir *d = &dirs[disk];
+  pthread_mutex_lock(&d->lock);
+  int done = io->done;
+  pthread_mutex_unlock(&d->lock);
+  return done;
+}
+
+// move the files under one directory of a data directory that belong in
+// another one
+// moved: counts the files moved
+static void rebalance_dir(int disk, char *rel, uint64_t *moved) {
+  char full[PATH_MAX];
+  if (join(full, disk, rel)) {
+    return;
+  }
+  DIR *dir = opendir(full);
+  if (dir == NULL) {
+    return;
+  }
+  struct dirent *ent;
+  while ((ent = readdir(dir))) {
+    char name[PATH_MAX];
+    // also skips . and .., and uploads in progress
+    if (ent->d_name[0] == '.' || (size_t) snprintf(name, sizeof(name), "%s%s%s", rel,
+        *rel ? "/" : "", ent->d_name) >= sizeof(name)) {
+      continue;
+    }
+    struct stat st;
+    if (fstatat(dirfd(dir), ent->d_name, &st, AT_SYMLINK_NOFOLLOW)) {
+      continue;
+    }
+    if (S_ISDIR(st.st_mode)) {
+      rebalance_dir(disk, name, moved);
+      continue;
+    }
+    int owner = store_disk(name);
+    if (!S_ISREG(st.st_mode) || owner == disk) {
+      continue;
+    }
+    char from[PATH_MAX];
+    char to[PATH_MAX];
+    if (join(from, disk, name) || join(to, owner, name)) {
+      continue;
+    }
+    struct stat owner_st;
+    if (lstat(to, &owner_st) == 0) {
+      // written since the directory was added, so this copy is older
+      unlink(from);
+      continue;
+    }
+    uint64_t bytes;
+    enum copy_method method;
+    if (store_mkdirs(name) == 0 && move_file(from, to, &bytes, &method) == 0) {
+      (*moved)++;
+    }
+  }
+  closedir(dir);
+}
+
+// move every file to the data directory it belongs in
+static void *rebalance(void *arg) {
+  (void) arg;
+  uint64_t moved = 0;
+  for (int i = 0; i < num_dirs; i++) {
+    rebalance_dir(i, "", &moved);
+  }
+  log_msg(LOG_INFO, "Moved %llu files to the data directories they belong in.",
+      (unsigned long long) moved);
+  return NULL;
+}
+
+// start moving files that belong in another data directory, as after
+// adding one, in the background; GETs find them where they are meanwhile
+void store_rebalance(void) {
+  if (num_dirs == 1) {
+    return;
+  }
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, rebalance, NULL)) {
+    log_msg(LOG_ERROR, "Failed to start moving files between data directories.");
+    return;
+  }
+  pthread_detach(thread);
+}
@@ -0,0 +1,53 @@
+#ifndef STORE_H
+#define STORE_H
+
+#include <limits.h>
+#include <sys/types.h>
+
+// most data directories (-d) the server can spread files over
+#define STORE_MAX_DIRS 32
+// places each data directory takes on the hash ring; more evens out the
+// share of files each one gets
+#define STORE_POINTS 128
+// I/O threads for each data directory, the most reads and writes it has
+// in flight at once
+#define STORE_WORKERS 4
+// bytes in one queued read or write of a GET or PUT
+#define STORE_CHUNK (256 * 1024)
+
+enum store_op {
+  STORE_READ,       // pread into buf
+  STORE_WRITE,      // pwrite from buf
+  STORE_READAHEAD,  // bring the range into the page cache, buf is unused
+};
+
+// a read or write waiting for, or done by, a data directory's I/O threads
+struct store_io {
+  struct store_io *next;
+  int fd;
+  enum store_op op;
+  char *buf;
+  size_t len;
+  off_t off;
+  ssize_t result;
+  int err;       // errno, when result is -1
+  int done;
+  // called by the I/O thread once it is done, for callers that don't wait
+  // in store_wait; must not block. NULL for none
+  void (*notify)(void *arg);
+  void *arg;
+};
+
+int store_init(char **dirs, int count);
+int store_count(void);
+char *store_root(int disk);
+int store_disk(char *name);
+int store_path(char *name, char *path);
+int store_find(char *name, char *path);
+int store_mkdirs(char *name);
+void store_submit(int disk, struct store_io *io);
+ssize_t store_wait(int disk, struct store_io *io);
+int store_done(int disk, struct store_io *io);
+void store_rebalance(void);
+
+#endif
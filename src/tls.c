@@ -0,0 +1,337 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+#include "tls.h"
+
+// Encrypted connections. OpenSSL does the handshake and then hands the
+// record layer to the kernel (kTLS): from there on the socket is used just
+// like a plain one, send, recv, poll and sendfile included, and the kernel
+// encrypts and decrypts in place, so a GET still goes from the page cache
+// to the socket without passing through user space.
+//
+// Where the kernel can't take both directions (no tls module, or a cipher
+// it doesn't implement), a pump thread runs the record layer in user space
+// between the TCP socket and one end of a socketpair, and the connection
+// is given the other end. Everything above works the same either way; the
+// pump just costs the copies kTLS saves.
+
+// the record layer in user space, for one connection
+struct tls_pump {
+  SSL *ssl;
+  int net;    // the TCP socket
+  int local;  // our end of the socketpair
+};
+
+static SSL_CTX *server_ctx = NULL;
+static SSL_CTX *client_ctx = NULL;
+
+// where failures on a connection are reported, stderr until tls_set_log
+static void (*log_hook)(const char *fmt, va_list args) = NULL;
+
+// report a failure on one connection
+static void tls_log(const char *fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  if (log_hook) {
+    log_hook(fmt, args);
+  } else {
+    vfprintf(stderr, fmt, args);
+    fputc('\n', stderr);
+  }
+  va_end(args);
+}
+
+// report and clear the errors OpenSSL queued on this thread
+static void tls_log_errors(void) {
+  unsigned long e;
+  while ((e = ERR_get_error()) != 0) {
+    char buf[256];
+    ERR_error_string_n(e, buf, sizeof(buf));
+    tls_log("TLS: %s", buf);
+  }
+}
+
+// make a context that lets OpenSSL hand the record layer to the kernel
+// return: the context, NULL on error
+static SSL_CTX *new_ctx(const SSL_METHOD *method) {
+  SSL_CTX *ctx = SSL_CTX_new(method);
+  if (ctx == NULL) {
+    ERR_print_errors_fp(stderr);
+    return NULL;
+  }
+  SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+#if OPENSSL_VERSION_NUMBER < 0x30200000L
+  // before 3.2 OpenSSL offloads only the sending side of TLS 1.3
+  SSL_CTX_set_max_proto_version(ctx, TLS1_2_VERSION);
+#endif
+  // AES-GCM is what the kernel implements; a renegotiation or TLS 1.3
+  // session ticket after the handshake would be a record the kernel
+  // can't hand to us
+  SSL_CTX_set_cipher_list(ctx, "ECDHE+AESGCM");
+  SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION);
+  SSL_CTX_set_num_tickets(ctx, 0);
+  return ctx;
+}
+
+// set up the server side, call once before any connections
+// return: 0 on success, -1 on error
+// cert: PEM certificate chain
+// key: PEM private key
+int tls_server_init(char *cert, char *key) {
+  server_ctx = new_ctx(TLS_server_method());
+  if (server_ctx == NULL) {
+    return -1;
+  }
+  if (SSL_CTX_use_certificate_chain_file(server_ctx, cert) != 1 ||
+      SSL_CTX_use_PrivateKey_file(server_ctx, key, SSL_FILETYPE_PEM) != 1 ||
+      SSL_CTX_check_private_key(server_ctx) != 1) {
+    fprintf(stderr, "Failed to load certificate %s and key %s\n", cert, key);
+    ERR_print_errors_fp(stderr);
+    SSL_CTX_free(server_ctx);
+    server_ctx = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+// set up the client side, call once before any connections
+// return: 0 on success, -1 on error
+// cafile: PEM certificates to trust, NULL for the system's
+int tls_client_init(char *cafile) {
+  client_ctx = new_ctx(TLS_client_method());
+  if (client_ctx == NULL) {
+    return -1;
+  }
+  SSL_CTX_set_verify(client_ctx, SSL_VERIFY_PEER, NULL);
+  int ok = cafile ? SSL_CTX_load_verify_locations(client_ctx, cafile, NULL) :
+      SSL_CTX_set_default_verify_paths(client_ctx);
+  if (ok != 1) {
+    fprintf(stderr, "Failed to load trusted certificates%s%s\n", cafile ? " from " : "",
+        cafile ? cafile : "");
+    ERR_print_errors_fp(stderr);
+    SSL_CTX_free(client_ctx);
+    client_ctx = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+// send the failures of single connections somewhere other than stderr
+// log: called with a printf format and its arguments, one line each
+void tls_set_log(void (*log)(const char *fmt, va_list args)) {
+  log_hook = log;
+}
+
+// return: 1 if connections accepted are encrypted
+int tls_server_enabled(void) {
+  return server_ctx != NULL;
+}
+
+// return: 1 if connections made are encrypted
+int tls_client_enabled(void) {
+  return client_ctx != NULL;
+}
+
+// move data between the TLS connection and the plain socketpair until
+// either side is done with it
+static void *pump(void *arg) {
+  struct tls_pump *p = arg;
+  SSL *ssl = p->ssl;
+  char in[TLS_PUMP_BUF];   // from the network, for the connection
+  char out[TLS_PUMP_BUF];  // from the connection, for the network
+  size_t in_len = 0, in_off = 0;
+  size_t out_len = 0, out_off = 0;
+  int net_eof = 0;
+  fcntl(p->net, F_SETFL, fcntl(p->net, F_GETFL) | O_NONBLOCK);
+  fcntl(p->local, F_SETFL, fcntl(p->local, F_GETFL) | O_NONBLOCK);
+  SSL_set_mode(ssl, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+  for (;;) {
+    short net_events = 0;
+    short local_events = 0;
+    int progress = 0;
+
+    if (in_off == in_len && !net_eof) {
+      int n = SSL_read(ssl, in, sizeof(in));
+      int e = n > 0 ? SSL_ERROR_NONE : SSL_get_error(ssl, n);
+      if (n > 0) {
+        in_len = n;
+        in_off = 0;
+        progress = 1;
+      } else if (e == SSL_ERROR_WANT_READ) {
+        net_events |= POLLIN;
+      } else if (e == SSL_ERROR_WANT_WRITE) {
+        net_events |= POLLOUT;
+      } else {
+        // closed or broken, the connection reads end of file
+        net_eof = 1;
+        shutdown(p->local, SHUT_WR);
+        progress = 1;
+      }
+    }
+    if (in_off < in_len) {
+      ssize_t n = send(p->local, in + in_off, in_len - in_off, MSG_NOSIGNAL);
+      if (n > 0) {
+        in_off += n;
+        progress = 1;
+      } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        local_events |= POLLOUT;
+      } else {
+        break;
+      }
+    }
+
+    if (out_off == out_len) {
+      ssize_t n = recv(p->local, out, sizeof(out), 0);
+      if (n > 0) {
+        out_len = n;
+        out_off = 0;
+        progress = 1;
+      } else if (n == 0) {
+        // closed, and everything it sent has gone out
+        break;
+      } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        local_events |= POLLIN;
+      } else {
+        break;
+      }
+    }
+    if (out_off < out_len) {
+      int n = SSL_write(ssl, out + out_off, out_len - out_off);
+      int e = n > 0 ? SSL_ERROR_NONE : SSL_get_error(ssl, n);
+      if (n > 0) {
+        out_off += n;
+        progress = 1;
+      } else if (e == SSL_ERROR_WANT_READ) {
+        net_events |= POLLIN;
+      } else if (e == SSL_ERROR_WANT_WRITE) {
+        net_events |= POLLOUT;
+      } else {
+        break;
+      }
+    }
+
+    if (progress) {
+      continue;
+    }
+    struct pollfd fds[2] = { { p->net, net_events, 0 }, { p->local, local_events, 0 } };
+    if (poll(fds, 2, -1) == -1 && errno != EINTR) {
+      break;
+    }
+    // closed while we were stuck writing to the network
+    if ((fds[1].revents & (POLLHUP | POLLERR)) && !(fds[1].revents & POLLIN)) {
+      break;
+    }
+  }
+  if (!net_eof) {
+    SSL_shutdown(ssl);
+  }
+  SSL_free(ssl);
+  close(p->net);
+  close(p->local);
+  free(p);
+  return NULL;
+}
+
+// start a pump for a connection the kernel couldn't take over
+// return: the socket for the connection to use, -1 on error
+static int start_pump(SSL *ssl, int fd) {
+  int pair[2];
+  struct tls_pump *p = malloc(sizeof(*p));
+  if (p == NULL || socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair)) {
+    tls_log("Failed to set up TLS: %s", p ? strerror(errno) : "out of memory");
+    free(p);
+    return -1;
+  }
+  p->ssl = ssl;
+  p->net = fd;
+  p->local = pair[1];
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, pump, p)) {
+    tls_log("Failed to start a TLS thread.");
+    close(pair[0]);
+    close(pair[1]);
+    free(p);
+    return -1;
+  }
+  pthread_detach(thread);
+  return pair[0];
+}
+
+// run a handshake and set up the record layer
+// return: the socket for the connection to use, -1 on error (fd is then
+//         still open)
+// host: the server's name to verify, NULL on the server side
+static int handshake(SSL_CTX *ctx, int fd, char *host, int *offloaded) {
+  SSL *ssl = SSL_new(ctx);
+  if (ssl == NULL || SSL_set_fd(ssl, fd) != 1) {
+    tls_log_errors();
+    SSL_free(ssl);
+    return -1;
+  }
+  if (host) {
+    struct in_addr addr;
+    if (inet_pton(AF_INET, host, &addr) == 1) {
+      X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl), host);
+    } else {
+      SSL_set1_host(ssl, host);
+      SSL_set_tlsext_host_name(ssl, host);
+    }
+  }
+  // each flight of the handshake, and each record the pump writes, is
+  // one write that mustn't wait for the ACK of the last one
+  int nodelay = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+  int ret = host ? SSL_connect(ssl) : SSL_accept(ssl);
+  if (ret != 1) {
+    tls_log("TLS handshake failed.");
+    tls_log_errors();
+    SSL_free(ssl);
+    return -1;
+  }
+  *offloaded = BIO_get_ktls_send(SSL_get_wbio(ssl)) && BIO_get_ktls_recv(SSL_get_rbio(ssl));
+  if (*offloaded) {
+    // the kernel has the keys, the socket carries plain data from here and
+    // the session's writes coalesce as on any other connection
+    nodelay = 0;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    SSL_free(ssl);
+    return fd;
+  }
+  int conn = start_pump(ssl, fd);
+  if (conn == -1) {
+    SSL_free(ssl);
+  }
+  return conn;
+}
+
+// accept an encrypted connection
+// return: the socket to use for it, -1 on error (fd is then still open)
+// fd: the accepted TCP socket
+// offloaded: set to 1 if the kernel does the record layer
+int tls_accept(int fd, int *offloaded) {
+  return handshake(server_ctx, fd, NULL, offloaded);
+}
+
+// encrypt a connection to a server
+// return: the socket to use for it, -1 on error (fd is then still open)
+// fd: the connected TCP socket
+// host: the name or address the server's certificate must match
+// offloaded: set to 1 if the kernel does the record layer
+int tls_connect(int fd, char *host, int *offloaded) {
+  return handshake(client_ctx, fd, host, offloaded);
+}
@@ -0,0 +1,17 @@
+#ifndef TLS_H
+#define TLS_H
+
+#include <stdarg.h>
+
+// bytes moved at once by the userspace record layer
+#define TLS_PUMP_BUF (16 * 1024)
+
+int tls_server_init(char *cert, char *key);
+int tls_client_init(char *cafile);
+void tls_set_log(void (*log)(const char *fmt, va_list args));
+int tls_server_enabled(void);
+int tls_client_enabled(void);
+int tls_accept(int fd, int *offloaded);
+int tls_connect(int fd, char *host, int *offloaded);
+
+#endif
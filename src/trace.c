@@ -0,0 +1,161 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "common.h"
+#include "trace.h"
+
+// Phase tracing in Chrome trace-event JSON (also read by Perfetto). Each
+// phase is one complete ("X") event on the lane of the thread that ran it;
+// the server runs one thread per connection, so every connection gets its
+// own timeline. When tracing is off trace_begin and trace_end are a single
+// branch each.
+//
+// The file is a JSON array that is never closed, which the trace-event
+// format allows, so a killed server still leaves a readable trace. It's
+// appended to in whole lines, so a server started by a hot restart with the
+// same -T adds its events to the trace the old one is still writing as it
+// drains, rather than truncating it.
+
+int trace_enabled = 0;
+
+// longest event line, with the detail fully escaped
+#define TRACE_LINE (256 + 2 * TRACE_DETAIL_LEN)
+
+static int trace_fd = -1;
+static char *trace_category = "";
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t trace_key;
+
+struct trace_buf {
+  uint64_t tid;
+  int count;
+  struct trace_event events[TRACE_BUF_EVENTS];
+};
+
+static __thread struct trace_buf *my_buf = NULL;
+
+static void trace_write(struct trace_buf *buf);
+
+// write out and free a thread's buffer when the thread exits
+static void trace_release(void *arg) {
+  struct trace_buf *buf = arg;
+  trace_write(buf);
+  free(buf);
+}
+
+// start tracing to a file
+// return: 0 on success, -1 on error
+// path: file to write the trace to
+// category: tag for every event, e.g. "server" or "client"
+int trace_open(char *path, char *category) {
+  trace_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  if (trace_fd == -1) {
+    fprintf(stderr, "open: %s\n", strerror(errno));
+    return -1;
+  }
+  if (pthread_key_create(&trace_key, trace_release)) {
+    close(trace_fd);
+    return -1;
+  }
+  trace_category = category;
+  // only a new file needs the array opened
+  if (lseek(trace_fd, 0, SEEK_END) == 0 && write(trace_fd, "[\n", 2) != 2) {
+    fprintf(stderr, "write: %s\n", strerror(errno));
+    close(trace_fd);
+    return -1;
+  }
+  trace_enabled = 1;
+  return 0;
+}
+
+// timestamp the start of a phase
+// return: start time, 0 if tracing is off
+uint64_t trace_begin(void) {
+  return trace_enabled ? now_ns() : 0;
+}
+
+// record a finished phase
+// name: phase name, must be a string literal
+// start: value returned by trace_begin
+// conn: connection number shown in the event args
+// detail: optional extra text, e.g. the filename (may be NULL)
+void trace_end(const char *name, uint64_t start, uint64_t conn, const char *detail) {
+  if (!trace_enabled) {
+    return;
+  }
+  if (my_buf == NULL) {
+    my_buf = calloc(1, sizeof(*my_buf));
+    if (my_buf == NULL) {
+      return;
+    }
+    my_buf->tid = syscall(SYS_gettid);
+    pthread_setspecific(trace_key, my_buf);
+  }
+
+  struct trace_event *ev = &my_buf->events[my_buf->count];
+  ev->name = name;
+  ev->start_ns = start;
+  ev->dur_ns = trace_begin() - start;
+  ev->conn = conn;
+  if (detail) {
+    strncpy(ev->detail, detail, sizeof(ev->detail) - 1);
+    ev->detail[sizeof(ev->detail) - 1] = '\0';
+  } else {
+    ev->detail[0] = '\0';
+  }
+
+  if (++my_buf->count == TRACE_BUF_EVENTS) {
+    trace_write(my_buf);
+  }
+}
+
+// write a thread's buffered events to the file and empty the buffer
+static void trace_write(struct trace_buf *buf) {
+  if (buf->count == 0) {
+    return;
+  }
+  pid_t pid = getpid();
+  char out[16 * TRACE_LINE];
+  int len = 0;
+  pthread_mutex_lock(&trace_lock);
+  for (int i = 0; i < buf->count; i++) {
+    struct trace_event *ev = &buf->events[i];
+    len += snprintf(out + len, sizeof(out) - len, "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\","
+        "\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%llu,\"args\":{\"conn\":%llu",
+        ev->name, trace_category, ev->start_ns / 1e3, ev->dur_ns / 1e3, (int) pid,
+        (unsigned long long) buf->tid, (unsigned long long) ev->conn);
+    if (ev->detail[0]) {
+      // escape anything that would break the JSON string
+      len += snprintf(out + len, sizeof(out) - len, ",\"detail\":\"");
+      for (char *c = ev->detail; *c; c++) {
+        if (*c == '"' || *c == '\\') {
+          out[len++] = '\\';
+        }
+        out[len++] = (unsigned char) *c < 0x20 ? '?' : *c;
+      }
+      out[len++] = '"';
+    }
+    len += snprintf(out + len, sizeof(out) - len, "}},\n");
+
+    // whole lines only, so they never interleave with another server's
+    if (len > (int) sizeof(out) - TRACE_LINE || i == buf->count - 1) {
+      ssize_t n = write(trace_fd, out, len);
+      (void) n;
+      len = 0;
+    }
+  }
+  pthread_mutex_unlock(&trace_lock);
+  buf->count = 0;
+}
+
+// write out the calling thread's buffered events now
+void trace_flush(void) {
+  if (trace_enabled && my_buf) {
+    trace_write(my_buf);
+  }
+}
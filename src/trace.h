@@ -0,0 +1,25 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+// events are buffered per thread and written out in batches
+#define TRACE_BUF_EVENTS 128
+#define TRACE_DETAIL_LEN 64
+
+struct trace_event {
+  const char *name;
+  uint64_t start_ns;
+  uint64_t dur_ns;
+  uint64_t conn;
+  char detail[TRACE_DETAIL_LEN];
+};
+
+extern int trace_enabled;
+
+int trace_open(char *path, char *category);
+uint64_t trace_begin(void);
+void trace_end(const char *name, uint64_t start, uint64_t conn, const char *detail);
+void trace_flush(void);
+
+#endif
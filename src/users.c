@@ -0,0 +1,91 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "log.h"
+#include "users.h"
+
+// check if a username and password are in the database
+// each line is: username password [user_rate [conn_rate]]
+// return: 0 if no, 1 if yes, -1 if error
+// limits: set to the user's bandwidth limits on success (may be NULL)
+int check_auth(char *username, char *password, struct user_limits *limits) {
+  // open the user database
+  FILE *users = fopen("users.txt", "r");
+  if (!users) {
+    log_msg(LOG_ERROR, "Failed to open user database: %s", strerror(errno));
+    return 0;
+  }
+
+  // check username and password
+  char line[256];
+  for (;;) {
+    if (fgets(line, 256, users) == NULL) {
+      int result = 0; // reached EOF with no match. Deny auth
+      if (ferror(users)) {
+        log_msg(LOG_ERROR, "Error getting users line: %s", strerror(errno));
+        result = -1;
+      }
+      fclose(users);
+      return result;
+    }
+    // check the line (state is per call, many threads authenticate at once)
+    char *strtok_state;
+    char *token;
+    token = strtok_r(line, " \r\n", &strtok_state);
+    if (token == NULL || strcmp(token, username) != 0) {
+      continue;
+    }
+    // username exists, check password
+    token = strtok_r(NULL, " \r\n", &strtok_state);
+    if (token == NULL || strcmp(token, password) != 0) {
+      // incorrect password
+      continue;
+    }
+    // both were correct, pick up any limits and return positively
+    if (limits) {
+      limits->user_rate = 0;
+      limits->conn_rate = 0;
+      token = strtok_r(NULL, " \r\n", &strtok_state);
+      if (token && parse_rate(token, &limits->user_rate)) {
+        log_msg(LOG_WARN, "Bad user rate for %s: %s", username, token);
+      }
+      token = strtok_r(NULL, " \r\n", &strtok_state);
+      if (token && parse_rate(token, &limits->conn_rate)) {
+        log_msg(LOG_WARN, "Bad connection rate for %s: %s", username, token);
+      }
+    }
+    fclose(users);
+    return 1;
+  }
+
+  // shouldn't get here
+  return -1;
+}
+
+// parse a rate in bytes/sec with an optional k/m/g suffix (powers of 1024,
+// like the sizes elsewhere); "-" means no limit
+// return: 0 on success, -1 if the text is not a rate
+// rate: set to the parsed rate, 0 for no limit
+int parse_rate(char *str, uint64_t *rate) {
+  if (strcmp(str, "-") == 0) {
+    *rate = 0;
+    return 0;
+  }
+  char *end;
+  errno = 0;
+  unsigned long long val = strtoull(str, &end, 10);
+  if (errno || end == str) {
+    return -1;
+  }
+  switch (*end) {
+    case 'k': case 'K': val *= 1024; end++; break;
+    case 'm': case 'M': val *= 1024 * 1024; end++; break;
+    case 'g': case 'G': val *= 1024 * 1024 * 1024; end++; break;
+  }
+  if (*end != '\0') {
+    return -1;
+  }
+  *rate = val;
+  return 0;
+}
@@ -0,0 +1,15 @@
+#ifndef USERS_H
+#define USERS_H
+
+#include <stdint.h>
+
+// optional columns after the password in users.txt, bytes/sec, 0 for none
+struct user_limits {
+  uint64_t user_rate; // shared by all of the user's connections
+  uint64_t conn_rate; // for each connection
+};
+
+int check_auth(char *username, char *password, struct user_limits *limits);
+int parse_rate(char *str, uint64_t *rate);
+
+#endif